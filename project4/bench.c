@@ -0,0 +1,413 @@
+/*
+ * bench.c
+ *
+ * Bulk-transfer benchmark for STCP.  Each run connects to ourselves over
+ * loopback, sends a given number of bytes from the accepted side (as the
+ * server does a file) and times it at the connecting side, from
+ * myconnect() until the last byte has been read.  The network path is
+ * emulated with STCP_NETEM (see network.c) in both directions, seeded with
+ * the run number, so the same command makes the same drops and delays.
+ *
+ * Every combination of the transfer sizes, loss rates, delays and send
+ * buffer sizes given is run a number of times, and one CSV line is written
+ * for each:
+ *
+ *   bytes, loss, delay, sndbuf    the combination (sndbuf 0:  the default)
+ *   runs                          transfers timed
+ *   goodput_mbps                  bytes over the median completion time
+ *   p50_ms, p90_ms, p99_ms        completion time percentiles
+ *   retrans_pct                   data resent, as a share of bytes
+ *   cpu_ns_per_byte               CPU time (user + system, both ends)
+ *
+ * The sending side passes mywrite() up to 64KB at a time, or -w bytes.
+ *
+ * A transfer that fails stops the benchmark.  'make bench' runs the
+ * default set and writes bench.csv.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "mysock.h"
+
+
+
+#define MAX_VALUES  16
+#define MAX_RUNS    1000
+#define CHUNK_SIZE  65536
+
+#ifndef MIN
+#define MIN(a,b)    ((a) < (b) ? (a) : (b))
+#endif
+
+static char usage[] =
+    "usage: %s [-U] [-r runs] [-S seed] [-s sizes] [-l losses] [-d delays]\n"
+    "          [-b sndbufs] [-w write-size] [-x netem]\n"
+    "lists are comma-separated, e.g. -s 16k,1m -l 0,1%% -d 0,10ms -b 0,8192;\n"
+    "-x adds to the emulated path, e.g. -x 'rate 10mbit'\n";
+
+static bool_t reliable = TRUE;
+static size_t write_size = CHUNK_SIZE;  /* per mywrite() when sending */
+
+typedef struct
+{
+    mysocket_t      listen_sd;
+    size_t          bytes;
+    int             sndbuf;
+
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    bool_t          done;           /* receiver has it all */
+    uint64_t        retrans_bytes;  /* by the sending side */
+} transfer_t;
+
+static int split_list(char *list, char **values);
+static size_t parse_size(const char *value);
+static double now(void);
+static double cpu_time(void);
+static int compare_doubles(const void *a, const void *b);
+static double percentile(const double *sorted, int n, int pct);
+static void run_transfer(const char *spec, size_t bytes, int sndbuf,
+                         double *elapsed, double *retrans);
+static void *send_thread(void *arg);
+
+
+/**********************************************************************/
+int
+main(int argc, char *argv[])
+{
+    char default_sizes[] = "64k,1m";
+    char default_losses[] = "0,1%";
+    char default_delays[] = "0,10ms";
+    char default_sndbufs[] = "0";
+    char *sizes[MAX_VALUES], *losses[MAX_VALUES];
+    char *delays[MAX_VALUES], *sndbufs[MAX_VALUES];
+    int num_sizes, num_losses, num_delays, num_sndbufs;
+    char *size_list = default_sizes, *loss_list = default_losses;
+    char *delay_list = default_delays, *sndbuf_list = default_sndbufs;
+    const char *extra = "";
+    unsigned long seed = 1;
+    int runs = 5, opt, errflg = 0;
+    int i, j, k, m, run;
+
+    while ((opt = getopt(argc, argv, "Ur:S:s:l:d:b:w:x:")) != EOF)
+    {
+        switch (opt)
+        {
+        case 'U':
+            reliable = FALSE;
+            break;
+        case 'r':
+            runs = atoi(optarg);
+            break;
+        case 'S':
+            seed = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            size_list = optarg;
+            break;
+        case 'l':
+            loss_list = optarg;
+            break;
+        case 'd':
+            delay_list = optarg;
+            break;
+        case 'b':
+            sndbuf_list = optarg;
+            break;
+        case 'w':
+            write_size = parse_size(optarg);
+            break;
+        case 'x':
+            extra = optarg;
+            break;
+        case '?':
+            ++errflg;
+            break;
+        }
+    }
+
+    num_sizes = split_list(size_list, sizes);
+    num_losses = split_list(loss_list, losses);
+    num_delays = split_list(delay_list, delays);
+    num_sndbufs = split_list(sndbuf_list, sndbufs);
+
+    if (errflg || optind != argc || runs < 1 || runs > MAX_RUNS ||
+        write_size == 0 ||
+        num_sizes < 1 || num_losses < 1 || num_delays < 1 || num_sndbufs < 1)
+    {
+        fprintf(stderr, usage, argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("bytes,loss,delay,sndbuf,runs,goodput_mbps,"
+           "p50_ms,p90_ms,p99_ms,retrans_pct,cpu_ns_per_byte\n");
+
+    for (i = 0; i < num_sizes; ++i)
+    for (j = 0; j < num_losses; ++j)
+    for (k = 0; k < num_delays; ++k)
+    for (m = 0; m < num_sndbufs; ++m)
+    {
+        size_t bytes = parse_size(sizes[i]);
+        int sndbuf = (int) parse_size(sndbufs[m]);
+        double times[MAX_RUNS], retrans = 0, cpu = 0, p50;
+
+        if (!bytes)
+        {
+            fprintf(stderr, "bad transfer size %s\n", sizes[i]);
+            exit(EXIT_FAILURE);
+        }
+
+        for (run = 0; run < runs; ++run)
+        {
+            char spec[256];
+            double elapsed, run_retrans, cpu_start = cpu_time();
+
+            /* the same seeds for every combination, so each sees the same
+             * sequence of random choices
+             */
+            snprintf(spec, sizeof(spec), "%s%s %s%s %s seed %lu",
+                     strcmp(losses[j], "0") ? "loss " : "",
+                     strcmp(losses[j], "0") ? losses[j] : "",
+                     strcmp(delays[k], "0") ? "delay " : "",
+                     strcmp(delays[k], "0") ? delays[k] : "",
+                     extra, seed + run);
+
+            run_transfer(spec, bytes, sndbuf, &elapsed, &run_retrans);
+            times[run] = elapsed;
+            retrans += run_retrans;
+            cpu += cpu_time() - cpu_start;
+        }
+
+        qsort(times, runs, sizeof(times[0]), compare_doubles);
+        p50 = percentile(times, runs, 50);
+        printf("%lu,%s,%s,%d,%d,%.3f,%.3f,%.3f,%.3f,%.3f,%.1f\n",
+               (unsigned long) bytes, losses[j], delays[k], sndbuf, runs,
+               bytes * 8 / p50 / 1e6, p50 * 1e3,
+               percentile(times, runs, 90) * 1e3,
+               percentile(times, runs, 99) * 1e3,
+               100 * retrans / runs, cpu * 1e9 / runs / bytes);
+        fflush(stdout);
+    }
+
+    return 0;
+}
+
+
+/* time one transfer of the given size over the given emulated path */
+static void
+run_transfer(const char *spec, size_t bytes, int sndbuf,
+             double *elapsed, double *retrans)
+{
+    struct sockaddr_in sin;
+    socklen_t len;
+    transfer_t transfer;
+    pthread_t sender;
+    mysocket_t sd;
+    char *buf;
+    size_t received = 0;
+    double start;
+
+    memset(&transfer, 0, sizeof(transfer));
+    transfer.bytes = bytes;
+    transfer.sndbuf = sndbuf;
+    pthread_mutex_init(&transfer.lock, NULL);
+    pthread_cond_init(&transfer.cond, NULL);
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sin.sin_port = htons(0);
+    len = sizeof(sin);
+
+    /* connections accepted on the listening mysocket emulate its path */
+    if ((transfer.listen_sd = mysocket(reliable)) < 0 ||
+        mysetsockopt(transfer.listen_sd, STCP_NETEM, spec, strlen(spec)) < 0 ||
+        mybind(transfer.listen_sd, (struct sockaddr *) &sin, len) < 0 ||
+        mylisten(transfer.listen_sd, 5) < 0 ||
+        mygetsockname(transfer.listen_sd, (struct sockaddr *) &sin, &len) < 0)
+    {
+        perror("listening mysocket");
+        exit(EXIT_FAILURE);
+    }
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if ((sd = mysocket(reliable)) < 0 ||
+        mysetsockopt(sd, STCP_NETEM, spec, strlen(spec)) < 0)
+    {
+        perror("mysocket");
+        exit(EXIT_FAILURE);
+    }
+
+    buf = (char *) malloc(CHUNK_SIZE);
+    assert(buf);
+    pthread_create(&sender, NULL, send_thread, &transfer);
+
+    start = now();
+    if (myconnect(sd, (struct sockaddr *) &sin, sizeof(sin)) < 0)
+    {
+        perror("myconnect");
+        exit(EXIT_FAILURE);
+    }
+
+    while (received < bytes)
+    {
+        ssize_t n = myread(sd, buf, MIN(CHUNK_SIZE, bytes - received));
+        if (n <= 0)
+        {
+            fprintf(stderr, "myread: connection closed after %lu bytes\n",
+                    (unsigned long) received);
+            exit(EXIT_FAILURE);
+        }
+        received += n;
+    }
+    *elapsed = now() - start;
+
+    pthread_mutex_lock(&transfer.lock);
+    transfer.done = TRUE;
+    pthread_cond_signal(&transfer.cond);
+    pthread_mutex_unlock(&transfer.lock);
+
+    /* myclose() waits for the other side to close too */
+    myclose(sd);
+    pthread_join(sender, NULL);
+    myclose(transfer.listen_sd);
+
+    *retrans = (double) transfer.retrans_bytes / bytes;
+    pthread_mutex_destroy(&transfer.lock);
+    pthread_cond_destroy(&transfer.cond);
+    free(buf);
+}
+
+/* the accepting side:  send the bytes, and once the receiver has them all,
+ * see how much data went out to get them there
+ */
+static void *
+send_thread(void *arg)
+{
+    transfer_t *transfer = (transfer_t *) arg;
+    struct sockaddr_in sin;
+    int len = sizeof(sin);
+    struct stcp_info info;
+    socklen_t info_len;
+    mysocket_t sd;
+    size_t sent = 0;
+    char *buf;
+
+    if ((sd = myaccept(transfer->listen_sd, (struct sockaddr *) &sin,
+                       &len)) < 0)
+    {
+        perror("myaccept");
+        exit(EXIT_FAILURE);
+    }
+
+    if (transfer->sndbuf > 0 &&
+        mysetsockopt(sd, STCP_SNDBUF, &transfer->sndbuf,
+                     sizeof(transfer->sndbuf)) < 0)
+        perror("mysetsockopt (STCP_SNDBUF)");
+
+    buf = (char *) malloc(write_size);
+    assert(buf);
+    memset(buf, 'x', write_size);
+    while (sent < transfer->bytes)
+    {
+        ssize_t n = mywrite(sd, buf, MIN(write_size, transfer->bytes - sent));
+        if (n <= 0)
+        {
+            perror("mywrite");
+            exit(EXIT_FAILURE);
+        }
+        sent += n;
+    }
+    free(buf);
+
+    pthread_mutex_lock(&transfer->lock);
+    while (!transfer->done)
+        pthread_cond_wait(&transfer->cond, &transfer->lock);
+    pthread_mutex_unlock(&transfer->lock);
+
+    info_len = sizeof(info);
+    if (mygetsockopt(sd, STCP_INFO, &info, &info_len) < 0)
+    {
+        perror("mygetsockopt");
+        exit(EXIT_FAILURE);
+    }
+    transfer->retrans_bytes = info.stcpi_retrans_bytes;
+    myclose(sd);
+    return NULL;
+}
+
+
+/* split a comma-separated list in place; returns the number of values */
+static int
+split_list(char *list, char **values)
+{
+    int n = 0;
+    char *value, *save = NULL;
+
+    for (value = strtok_r(list, ",", &save); value && n < MAX_VALUES;
+         value = strtok_r(NULL, ",", &save))
+        values[n++] = value;
+    return n;
+}
+
+/* a number of bytes, with an optional k or m (binary) suffix */
+static size_t
+parse_size(const char *value)
+{
+    char *end;
+    unsigned long n = strtoul(value, &end, 0);
+
+    if (*end == 'k' || *end == 'K')
+        n *= 1024;
+    else if (*end == 'm' || *end == 'M')
+        n *= 1024 * 1024;
+    return (size_t) n;
+}
+
+static double
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* user + system time used by the process so far */
+static double
+cpu_time(void)
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+           ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+static int
+compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+/* nearest-rank percentile of n sorted values */
+static double
+percentile(const double *sorted, int n, int pct)
+{
+    int rank = (pct * n + 99) / 100;
+    return sorted[(rank < 1) ? 0 : rank - 1];
+}
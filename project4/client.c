@@ -8,6 +8,12 @@
  * server which then replies with the contents of the file. In the 
  * non-iteractive mode (when the option '-f' is specified along with
  * a filename) it simply asks for that file from the server and exits.
+ *
+ * In batch mode ('-b'), it fetches every file named after the server's
+ * address, without waiting for each response before sending the next
+ * request, and saves each as rcvd.<name>.  With '-n', the files are
+ * fetched over that many connections at once, a stripe at a time, using
+ * range requests (see server.c).
  * 
  */
 
@@ -16,6 +22,9 @@
 #include <ctype.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/time.h>
 #ifdef LINUX
 #include <unistd.h> /*getopt*/
 #endif
@@ -36,13 +45,58 @@
 #define MIN(a,b) ((a) < (b) ? (a) : (b))
 #endif
 
-static char usage[] = "usage: client [-U] [-q] [-f <filename>] server:port\n";
+/* batch mode:  requests sent ahead of the responses on each connection,
+ * and the size of a stripe when fetching over several connections
+ */
+#define PIPELINE_DEPTH  16
+#define STRIPE_SIZE     (1024 * 1024)
+
+static char usage[] =
+    "usage: client [-U] [-q] [-f <filename>] server:port\n"
+    "       client [-U] [-q] [-n <connections>] -b server:port file...\n";
 static char *filename;
 static int quiet_opt = 0;
 
+/* a file fetched in batch mode */
+typedef struct
+{
+    char      *name;
+    char      *path;        /* rcvd.<name> */
+    int        fd;          /* open on path, or -1 with -q */
+    long long  size;        /* whole file, once a response has told us */
+    long long  received;
+    int        failed;
+} batch_file_t;
+
+/* a connection used in batch mode, and the requests it has outstanding */
+typedef struct
+{
+    mysocket_t sd;
+    int        index;
+    int        first_file;  /* earlier files need nothing more from us */
+    long long *next_stripe; /* per file, when striping */
+    struct
+    {
+        int       file;
+        long long offset;   /* -1 for the whole file */
+    } pending[PIPELINE_DEPTH];
+    int        head, count;
+    int        errcnd;
+} batch_conn_t;
+
+static batch_file_t   *batch_files;
+static int             batch_nfiles, batch_nconns = 1;
+static pthread_mutex_t batch_lock = PTHREAD_MUTEX_INITIALIZER;
+/* when striping, batch_cond is signalled as batch_known grows (files whose
+ * size, or failure, a response has told us), or a connection fails */
+static pthread_cond_t  batch_cond = PTHREAD_COND_INITIALIZER;
+static int             batch_known, batch_aborted;
+
 static int parse_address(char *address, struct sockaddr_in *sin);
-static int get_nvt_line(int sd, char *line);
+static int get_nvt_line(int sd, char *line, size_t size);
 static void loop_until_end(int sd);
+static int batch_fetch(struct sockaddr_in *sin, char reliable,
+                       char **names, int nfiles);
 
 
 /**********************************************************************/
@@ -53,20 +107,27 @@ main(int argc, char *argv[])
     char opt;
     char *pline;
     char reliable = 1;
-    int errflg = 0;
+    int errflg = 0, batch = 0;
     int sd;
 
 
 
     filename = NULL;
     /* Parse command line options */
-    while ((opt = getopt(argc, argv, "f:qU")) != EOF)
+    while ((opt = getopt(argc, argv, "bf:n:qU")) != EOF)
     {
         switch (opt)
         {
+        case 'b':
+            batch = 1;
+            break;
         case 'f':
             filename = optarg;
             break;
+        case 'n':
+            if ((batch_nconns = atoi(optarg)) < 1)
+                ++errflg;
+            break;
         case 'q':
             ++quiet_opt;
             break;
@@ -81,7 +142,7 @@ main(int argc, char *argv[])
         }
     }
 
-    if (errflg || optind != argc - 1)
+    if (errflg || (batch ? optind > argc - 2 : optind != argc - 1))
     {
         fputs(usage, stderr);
         exit(1);
@@ -101,6 +162,10 @@ main(int argc, char *argv[])
         exit(1);
     }
 
+    if (batch)
+        return batch_fetch(&sin, reliable, argv + optind + 1,
+                           argc - optind - 1);
+
     if ((sd = mysocket(reliable)) < 0)
     {
         perror("mysocket");
@@ -177,7 +242,7 @@ loop_until_end(int sd)
             break;
         }
 
-        if (get_nvt_line(sd, line) < 0)
+        if (get_nvt_line(sd, line, sizeof(line)) < 0)
         {
             perror("get_nvt_line");
             errcnd = 1;
@@ -278,6 +343,378 @@ loop_until_end(int sd)
     }                           /* end for(;;) */
 }
 
+/**********************************************************************/
+/* next_request
+ *
+ * Picks the next request conn may send:  in batch mode, every file whole,
+ * in order; when striping, every batch_nconns'th stripe of each file,
+ * starting with stripe conn->index.  Until a response has told us a
+ * file's size, only its first stripe is asked for (by the connection
+ * that owns it), and later files are asked for meanwhile; the others
+ * then take only the stripes below that size.
+ *
+ * Returns
+ *  1 if there is a request to send
+ *  0 if there's none until a response comes back (or none at all)
+ */
+static int
+next_request(batch_conn_t *conn, int *file, long long *offset)
+{
+    int k;
+
+    if (batch_nconns == 1)
+    {
+        if (conn->first_file == batch_nfiles)
+            return 0;
+        *file = conn->first_file++;
+        *offset = -1;
+        return 1;
+    }
+
+    for (k = conn->first_file; k < batch_nfiles; ++k)
+    {
+        batch_file_t *bf = &batch_files[k];
+        long long size, start = conn->next_stripe[k] * STRIPE_SIZE;
+        int failed;
+
+        pthread_mutex_lock(&batch_lock);
+        size = bf->size;
+        failed = bf->failed;
+        pthread_mutex_unlock(&batch_lock);
+
+        if (failed || (size >= 0 && start >= size))
+        {
+            /* nothing (more) of this file for us */
+            if (k == conn->first_file)
+                conn->first_file++;
+            continue;
+        }
+        if (size < 0 && conn->next_stripe[k] != 0)
+            continue;   /* wait for stripe 0 to tell us the size */
+
+        *file = k;
+        *offset = start;
+        conn->next_stripe[k] += batch_nconns;
+        return 1;
+    }
+    return 0;
+}
+
+/**********************************************************************/
+/* receive_response
+ *
+ * Reads the response to a request for file (offset is -1 for the whole
+ * file, or where the stripe starts) and writes what follows it into the
+ * file's rcvd copy.
+ *
+ * Returns
+ *  0 on success (including the server reporting an error)
+ *  -1 on failure
+ */
+static int
+receive_response(int sd, int file, long long offset)
+{
+    batch_file_t *bf = &batch_files[file];
+    char line[1000], buf[65536];
+    char *lenstr, *resp;
+    long long length, start, size;
+    int got;
+
+    if (get_nvt_line(sd, line, sizeof(line)) < 0)
+    {
+        perror("get_nvt_line");
+        return -1;
+    }
+    if (!quiet_opt)
+        printf("server: %s\n", line);
+
+    /* Parse the response from the server */
+    if (NULL == (resp = strrchr(line, ',')))
+    {
+        fprintf(stderr, "Malformed response from server.\n");
+        return -1;
+    }
+    *resp++ = '\0';
+
+    if (NULL == (lenstr = strrchr(line, ',')))
+    {
+        fprintf(stderr, "Malformed response from server.\n");
+        return -1;
+    }
+    *lenstr++ = '\0';
+
+    length = atoll(lenstr);
+    if (length == -1)
+    {
+        /* Error reported from server */
+        pthread_mutex_lock(&batch_lock);
+        if (bf->size < 0 && !bf->failed)
+        {
+            batch_known++;
+            pthread_cond_broadcast(&batch_cond);
+        }
+        bf->failed = 1;
+        pthread_mutex_unlock(&batch_lock);
+        return 0;
+    }
+    if (offset >= 0)
+    {
+        /* a stripe; the response also tells us how big the file is */
+        if (sscanf(resp, "Ok %lld/%lld", &start, &size) != 2 ||
+            start != offset)
+        {
+            fprintf(stderr, "Malformed response from server.\n");
+            return -1;
+        }
+        pthread_mutex_lock(&batch_lock);
+        if (bf->size < 0 && !bf->failed)
+        {
+            batch_known++;
+            pthread_cond_broadcast(&batch_cond);
+        }
+        bf->size = size;
+        pthread_mutex_unlock(&batch_lock);
+    }
+    else
+    {
+        offset = 0;
+    }
+
+    /* Retrieve the remote file and write it to the local file */
+    while (length > 0)
+    {
+        if ((got = myread(sd, buf, MIN(length, (long long) sizeof(buf)))) < 0)
+        {
+            perror("myread");
+            return -1;
+        }
+        if (!got)
+        {
+            fprintf(stderr, "Connection closed %lld bytes into %s\n",
+                    bf->received, bf->name);
+            return -1;
+        }
+
+        if (bf->fd != -1 && pwrite(bf->fd, buf, got, offset) != got)
+        {
+            perror("pwrite");
+            return -1;
+        }
+        offset += got;
+        length -= got;
+
+        pthread_mutex_lock(&batch_lock);
+        bf->received += got;
+        pthread_mutex_unlock(&batch_lock);
+    }
+    return 0;
+}
+
+/**********************************************************************/
+/* batch_thread
+ *
+ * Keeps up to PIPELINE_DEPTH requests outstanding on one batch
+ * connection, and reads their responses in order, until it has nothing
+ * left to ask for.  When striping, a connection with nothing to ask for
+ * yet waits for other connections to learn the sizes of more files.
+ */
+static void *
+batch_thread(void *arg)
+{
+    batch_conn_t *conn = (batch_conn_t *) arg;
+    char request[1100];
+    long long offset;
+    int file, k, known, aborted;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&batch_lock);
+        known = batch_known;
+        pthread_mutex_unlock(&batch_lock);
+
+        while (conn->count < PIPELINE_DEPTH &&
+               next_request(conn, &file, &offset))
+        {
+            if (offset < 0)
+                sprintf(request, "%s\r\n", batch_files[file].name);
+            else
+                sprintf(request, "%s,%lld,%d\r\n", batch_files[file].name,
+                        offset, STRIPE_SIZE);
+            if (mywrite(conn->sd, request, strlen(request)) < 0)
+            {
+                perror("mywrite");
+                conn->errcnd = 1;
+                break;
+            }
+
+            k = (conn->head + conn->count++) % PIPELINE_DEPTH;
+            conn->pending[k].file   = file;
+            conn->pending[k].offset = offset;
+        }
+        if (conn->errcnd)
+            break;
+        if (conn->count == 0)
+        {
+            /* any stripes left for us are of files whose sizes we don't
+             * know yet
+             */
+            if (batch_nconns == 1 || known == batch_nfiles)
+                break;
+            pthread_mutex_lock(&batch_lock);
+            while (batch_known == known && !batch_aborted)
+                pthread_cond_wait(&batch_cond, &batch_lock);
+            aborted = batch_aborted;
+            pthread_mutex_unlock(&batch_lock);
+            if (aborted)
+                break;
+            continue;
+        }
+
+        k = conn->head;
+        conn->head = (conn->head + 1) % PIPELINE_DEPTH;
+        conn->count--;
+        if (receive_response(conn->sd, conn->pending[k].file,
+                             conn->pending[k].offset) < 0)
+        {
+            conn->errcnd = 1;
+            break;
+        }
+    }
+
+    if (conn->errcnd)
+    {
+        /* the files this connection was to size never will be */
+        pthread_mutex_lock(&batch_lock);
+        batch_aborted = 1;
+        pthread_cond_broadcast(&batch_cond);
+        pthread_mutex_unlock(&batch_lock);
+    }
+    return NULL;
+}
+
+/**********************************************************************/
+/* batch_fetch
+ *
+ * Fetches the named files over batch_nconns connections, and reports how
+ * long it took altogether.
+ *
+ * Returns the exit status:  0 if every file arrived whole, 1 otherwise.
+ */
+static int
+batch_fetch(struct sockaddr_in *sin, char reliable, char **names, int nfiles)
+{
+    batch_conn_t *conns;
+    pthread_t *threads;
+    struct timeval start, end;
+    long long total = 0;
+    double elapsed;
+    int j, k, fetched = 0, rc = 0;
+    char path[1100];
+
+    batch_nfiles = nfiles;
+    batch_files = (batch_file_t *) calloc(nfiles, sizeof(batch_file_t));
+    conns = (batch_conn_t *) calloc(batch_nconns, sizeof(batch_conn_t));
+    threads = (pthread_t *) calloc(batch_nconns, sizeof(pthread_t));
+    if (!batch_files || !conns || !threads)
+    {
+        perror("calloc");
+        return 1;
+    }
+
+    for (k = 0; k < nfiles; ++k)
+    {
+        char *base = strrchr(names[k], '/');
+
+        batch_files[k].name = names[k];
+        batch_files[k].size = -1;
+        batch_files[k].fd = -1;
+        if (quiet_opt)
+            continue;
+
+        snprintf(path, sizeof(path), "%s.%s", RCVD_FILENAME,
+                 base ? base + 1 : names[k]);
+        if (!(batch_files[k].path = strdup(path)) ||
+            (batch_files[k].fd =
+             open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+        {
+            perror(path);
+            return 1;
+        }
+    }
+
+    gettimeofday(&start, NULL);
+    for (k = 0; k < batch_nconns; ++k)
+    {
+        conns[k].index = k;
+        if (!(conns[k].next_stripe =
+              (long long *) malloc(nfiles * sizeof(long long))))
+        {
+            perror("malloc");
+            return 1;
+        }
+        for (j = 0; j < nfiles; ++j)
+            conns[k].next_stripe[j] = k;
+        if ((conns[k].sd = mysocket(reliable)) < 0 ||
+            myconnect(conns[k].sd, (struct sockaddr *) sin,
+                      sizeof(struct sockaddr_in)) < 0)
+        {
+            perror("myconnect");
+            return 1;
+        }
+    }
+
+    for (k = 0; k < batch_nconns; ++k)
+    {
+        if (pthread_create(&threads[k], NULL, batch_thread, &conns[k]) != 0)
+        {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+    for (k = 0; k < batch_nconns; ++k)
+    {
+        pthread_join(threads[k], NULL);
+        rc |= conns[k].errcnd;
+        if (myclose(conns[k].sd) < 0)
+            perror("myclose");
+        free(conns[k].next_stripe);
+    }
+    gettimeofday(&end, NULL);
+
+    for (k = 0; k < nfiles; ++k)
+    {
+        batch_file_t *bf = &batch_files[k];
+
+        if (bf->fd != -1)
+            close(bf->fd);
+        if (bf->failed || (bf->size >= 0 && bf->received != bf->size))
+        {
+            fprintf(stderr, "%s: not fetched\n", bf->name);
+            if (bf->path)
+                unlink(bf->path);
+            rc = 1;
+        }
+        else
+        {
+            fetched++;
+            total += bf->received;
+        }
+        free(bf->path);
+    }
+
+    elapsed = (end.tv_sec - start.tv_sec) +
+              (end.tv_usec - start.tv_usec) / 1e6;
+    printf("fetched %d of %d files, %lld bytes, over %d connection%s in "
+           "%.3fs (%.1f MB/s)\n", fetched, nfiles, total, batch_nconns,
+           (batch_nconns == 1) ? "" : "s", elapsed,
+           elapsed > 0 ? total / elapsed / 1e6 : 0.0);
+
+    free(threads);
+    free(conns);
+    free(batch_files);
+    return rc;
+}
+
 /**********************************************************************/
 /* parse_address
  *
@@ -338,43 +775,44 @@ cleanup:
 /**********************************************************************/
 /* get_nvt_line
  * 
- * Retrieves the next line of NVT ASCII from mysocket layer.
+ * Retrieves the next line of NVT ASCII from mysocket layer, into line
+ * (size bytes), without its CRLF.  myreadline() hands it over a whole
+ * line at a time, ending at each LF; a line ends at CRLF.
  *
  * Returns 
  *  0 on success
  *  -1 on failure
  */
 static int
-get_nvt_line(int sd, char *line)
+get_nvt_line(int sd, char *line, size_t size)
 {
-    char last_char;
-    char this_char;
+    size_t used = 0;
     int len;
 
-    last_char = '\0';
     for (;;)
     {
-        len = myread(sd, &this_char, sizeof(this_char));
+        len = myreadline(sd, line + used, size - used);
         if (len < 0)
             return -1;
 
+        /* Connection ended before line terminator (or empty string):
+         * line holds whatever came before the end */
         if (len == 0)
-        {
-            /* Connection ended before line terminator (or empty string) */
-            *line = '\0';
             return 0;
-        }
-    /** fprintf(stderr, "read character %c\n", this_char); **/
 
-        if (last_char == '\r' && this_char == '\n')
+        used += len;
+        if (used >= 2 && line[used - 2] == '\r' && line[used - 1] == '\n')
         {
-            /* Reached the end of line. Already wrote \r into string, overwrite
-             * it with a NUL */
-            line[-1] = '\0';
+            /* Reached the end of line; overwrite the CRLF with a NUL */
+            line[used - 2] = '\0';
             return 0;
         }
 
-        *line++ = this_char;
-        last_char = this_char;
+        if (used == size - 1)
+        {
+            /* no room left for the rest of the line */
+            errno = EMSGSIZE;
+            return -1;
+        }
     }
 }
@@ -9,6 +9,7 @@
 #include "mysock_impl.h"
 #include "mysock_hash.h"
 #include "network_io.h"
+#include "network.h"
 #include "transport.h"
 #include "connection_demux.h"
 
@@ -61,18 +62,19 @@ typedef struct
 /* maintains queue of pending connections per listening socket.
  * there is one entry in listen_table per passive (listening) socket.
  */
-HASH_TABLE_DECLARE(listen_table, mysocket_t, listen_queue_t *,
-                   MAX_NUM_CONNECTIONS);
+HASH_TABLE_DECLARE(listen_table, mysocket_t, listen_queue_t *, 16);
 static pthread_rwlock_t listen_lock; /* XXX: see notes in network_io_vns.c */
 
 static listen_queue_t *_get_connection_queue(mysock_context_t *ctx);
 
 
 /* called by myaccept() to grab the first completed connection off the
- * given mysocket's connection queue, or block until one completes.
+ * given mysocket's connection queue, or block until one completes.  if
+ * block is FALSE and no connection has completed, returns FALSE at once.
  */
-void _mysock_dequeue_connection(mysock_context_t  *accept_ctx,
-                                mysock_context_t **new_ctx)
+bool_t _mysock_dequeue_connection(mysock_context_t  *accept_ctx,
+                                  mysock_context_t **new_ctx,
+                                  bool_t             block)
 {
     listen_queue_t *q;
     completed_connect_t *r;
@@ -86,6 +88,14 @@ void _mysock_dequeue_connection(mysock_context_t  *accept_ctx,
     assert(q);
 
     PTHREAD_CALL(pthread_mutex_lock(&q->connection_lock));
+    if (!q->completed_queue && !block)
+    {
+        PTHREAD_CALL(pthread_mutex_unlock(&q->connection_lock));
+        PTHREAD_CALL(pthread_rwlock_unlock(&listen_lock));
+        *new_ctx = NULL;
+        return FALSE;
+    }
+
     while (!q->completed_queue)
     {
         PTHREAD_CALL(pthread_cond_wait(&q->connection_cond,
@@ -114,6 +124,28 @@ void _mysock_dequeue_connection(mysock_context_t  *accept_ctx,
 
     PTHREAD_CALL(pthread_mutex_unlock(&q->connection_lock));
     PTHREAD_CALL(pthread_rwlock_unlock(&listen_lock));
+    return TRUE;
+}
+
+/* returns TRUE if myaccept() on the given listening mysocket would return
+ * a connection without blocking.
+ */
+bool_t _mysock_connection_ready(mysock_context_t *accept_ctx)
+{
+    listen_queue_t *q;
+    bool_t ready = FALSE;
+
+    assert(accept_ctx && accept_ctx->listening);
+
+    PTHREAD_CALL(pthread_rwlock_rdlock(&listen_lock));
+    if ((q = _get_connection_queue(accept_ctx)))
+    {
+        PTHREAD_CALL(pthread_mutex_lock(&q->connection_lock));
+        ready = (q->completed_queue != NULL);
+        PTHREAD_CALL(pthread_mutex_unlock(&q->connection_lock));
+    }
+    PTHREAD_CALL(pthread_rwlock_unlock(&listen_lock));
+    return ready;
 }
 
 static void _debug_print_connection(const char *msg, const char *reason,
@@ -219,6 +251,7 @@ bool_t _mysock_enqueue_connection(mysock_context_t      *ctx,
 
         new_ctx = _mysock_get_context(queue_entry->sd);
         new_ctx->listen_sd = ctx->my_sd;
+        _network_netem_inherit(&new_ctx->network_state, &ctx->network_state);
 
         new_ctx->network_state.peer_addr       = *peer_addr;
         new_ctx->network_state.peer_addr_len   = peer_addr_len;
@@ -237,11 +270,14 @@ bool_t _mysock_enqueue_connection(mysock_context_t      *ctx,
                                       &ctx->network_state,
                                       user_data, packet, packet_len);
 
-        _mysock_transport_init(queue_entry->sd, FALSE);
-
-        /* pass the SYN packet on to the main STCP code */
+        /* pass the SYN packet on to the main STCP code.  this is queued
+         * before the new connection's network thread starts, as each
+         * queue may only have one producer at a time.
+         */
         _mysock_enqueue_buffer(new_ctx, &new_ctx->network_recv_queue,
                                packet, packet_len);
+
+        _mysock_transport_init(queue_entry->sd, FALSE);
     }
     else
     {
@@ -300,6 +336,11 @@ void _mysock_passive_connection_complete(mysock_context_t *ctx)
         PTHREAD_CALL(pthread_cond_signal(&q->connection_cond));
     }
     PTHREAD_CALL(pthread_rwlock_unlock(&listen_lock));
+
+    /* the listening socket is now readable.  (this takes the poll locks,
+     * so it must come after the listen table is released.)
+     */
+    _mysock_notify_pollers(_mysock_get_context(ctx->listen_sd));
 }
 
 /* called by mylisten() to specify the number of pending connection
@@ -10,6 +10,7 @@
 #include "mysock.h"
 #include "mysock_impl.h"
 #include "network_io.h"
+#include "network.h"
 #include "stcp_api.h"
 #include "transport.h"
 
@@ -23,7 +24,9 @@
 
 
 /* helper functions to start transport layer and network receive threads */
+#ifndef TRANSPORT_POOL
 static void *transport_thread_func(void *arg);
+#endif
 
 static void verify_mysocket_descriptor(mysock_context_t *comp_ctx,
                                        mysocket_t        my_sd);
@@ -31,14 +34,47 @@ static mysock_context_t *_mysock_allocate_context(void);
 static bool_t _mysock_free_queue(mysock_context_t *ctx, packet_queue_t *pq);
 
 
-/* mysocket descriptor table, one entry per STCP connection */
-static mysock_context_t *global_ctx[MAX_NUM_CONNECTIONS];
+/* mysocket descriptor table, one entry per STCP connection.  the table is
+ * allocated a chunk at a time, and chunks never move once they are in
+ * place, so _mysock_get_context() reads it without taking a lock.  free
+ * descriptors are chained through next_free, so allocating one is O(1);
+ * sd_lock serialises allocation and release.
+ */
+#define SD_CHUNK_SIZE   256
+#define SD_MAX_CHUNKS   (MAX_NUM_CONNECTIONS / SD_CHUNK_SIZE)
+
+typedef struct
+{
+    mysock_context_t *ctx[SD_CHUNK_SIZE];
+    mysocket_t        next_free[SD_CHUNK_SIZE];
+} sd_chunk_t;
+
+static sd_chunk_t *sd_table[SD_MAX_CHUNKS];
+static unsigned int sd_num_chunks;
+static mysocket_t sd_free_head = -1;
+static pthread_mutex_t sd_lock = PTHREAD_MUTEX_INITIALIZER;
+
 
+/* pointer to the descriptor table entry for sd, or NULL if sd is out of
+ * range or its chunk has not been allocated yet.
+ */
+static mysock_context_t **_mysock_descriptor_slot(mysocket_t sd)
+{
+    sd_chunk_t *chunk;
+
+    if (sd < 0 || sd >= MAX_NUM_CONNECTIONS)
+        return NULL;
+
+    chunk = __atomic_load_n(&sd_table[sd / SD_CHUNK_SIZE], __ATOMIC_ACQUIRE);
+    return chunk ? &chunk->ctx[sd % SD_CHUNK_SIZE] : NULL;
+}
 
 /* create a new mysocket, and find space in our mysocket descriptor table */
 mysocket_t _mysock_new_mysocket(bool_t is_reliable)
 {
     mysock_context_t *connection_context = _mysock_allocate_context();
+    sd_chunk_t *chunk;
+    mysocket_t sd;
     int k;
 
     if (!connection_context)
@@ -49,21 +85,41 @@ mysocket_t _mysock_new_mysocket(bool_t is_reliable)
 
     /* propagates down to new connections arriving on a listening socket */
     connection_context->network_state.is_reliable = is_reliable;
+    _network_netem_init(&connection_context->network_state);
 
-    /* search for a free mysocket descriptor */
-    for (k = 0; k < MAX_NUM_CONNECTIONS; ++k)
+    PTHREAD_CALL(pthread_mutex_lock(&sd_lock));
+    if (sd_free_head < 0 && sd_num_chunks < SD_MAX_CHUNKS &&
+        (chunk = (sd_chunk_t *) calloc(1, sizeof(sd_chunk_t))) != NULL)
     {
-        if (!global_ctx[k])
-        {
-            global_ctx[k] = connection_context;
-            connection_context->my_sd = k;
-            return k;
-        }
+        /* every descriptor is in use; grow the table by another chunk */
+        sd = sd_num_chunks * SD_CHUNK_SIZE;
+        for (k = 0; k < SD_CHUNK_SIZE; ++k)
+            chunk->next_free[k] = (k + 1 < SD_CHUNK_SIZE) ? sd + k + 1 : -1;
+
+        __atomic_store_n(&sd_table[sd_num_chunks], chunk, __ATOMIC_RELEASE);
+        ++sd_num_chunks;
+        sd_free_head = sd;
     }
 
-    _mysock_free_context(connection_context);
-    errno = EMFILE;
-    return -1;
+    if ((sd = sd_free_head) >= 0)
+    {
+        chunk = sd_table[sd / SD_CHUNK_SIZE];
+        sd_free_head = chunk->next_free[sd % SD_CHUNK_SIZE];
+
+        connection_context->my_sd = sd;
+        __atomic_store_n(&chunk->ctx[sd % SD_CHUNK_SIZE],
+                         connection_context, __ATOMIC_RELEASE);
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&sd_lock));
+
+    if (sd < 0)
+    {
+        _mysock_free_context(connection_context);
+        errno = EMFILE;
+        return -1;
+    }
+
+    return sd;
 }
 
 /* obtain a pointer to the connection context for the given mysocket
@@ -71,9 +127,11 @@ mysocket_t _mysock_new_mysocket(bool_t is_reliable)
  */
 mysock_context_t *_mysock_get_context(mysocket_t sd)
 {
+    mysock_context_t **slot;
+
     ASSERT_VALID_MYSOCKET_DESCRIPTOR(NULL, sd);
-    return (sd >= 0 && sd < (int)ARRAY_DIM(global_ctx))
-        ? global_ctx[sd] : NULL;
+    slot = _mysock_descriptor_slot(sd);
+    return slot ? __atomic_load_n(slot, __ATOMIC_ACQUIRE) : NULL;
 }
 
 /* initiate a new STCP connection; called by myconnect() and myaccept() */
@@ -84,6 +142,12 @@ void _mysock_transport_init(mysocket_t sd, bool_t is_active)
     assert(!connection_context->listening);
     connection_context->is_active = is_active;
 
+#ifdef TRANSPORT_POOL
+    /* hand the connection to the transport worker pool, which reads its
+     * network input and runs STCP for it alongside other connections
+     */
+    _mysock_pool_add(connection_context);
+#else
     /* start a new network thread; this handles incoming data, passing it
      * up to the transport layer.  (the network input is threaded so we can
      * keep track of timeouts/when data arrives, in a portable manner
@@ -101,6 +165,7 @@ void _mysock_transport_init(mysocket_t sd, bool_t is_active)
         connection_context,
         FALSE);
     connection_context->transport_thread_started = TRUE;
+#endif  /*TRANSPORT_POOL*/
 }
 
 int _mysock_wait_for_connection(mysock_context_t *ctx)
@@ -120,59 +185,274 @@ int _mysock_wait_for_connection(mysock_context_t *ctx)
 }
 
 
+/* set up an empty queue of the given size (a power of two).  the ring
+ * itself is only allocated by the first write to it (see
+ * _mysock_enqueue_buffer()), so a connection that is idle, or only sends or
+ * only receives, doesn't pay for the rings it never uses.
+ */
+void _mysock_init_queue(packet_queue_t *pq, size_t size, bool_t packets)
+{
+    assert(pq && size > 0 && !(size & (size - 1)));
+
+    memset(pq, 0, sizeof(*pq));
+    pq->size    = size;
+    pq->packets = packets;
+}
+
+/* number of bytes in the queue, including the lengths stored in front of
+ * datagrams in a packet queue.  either end may call this.
+ */
+size_t _mysock_queued(packet_queue_t *pq)
+{
+    assert(pq);
+    return __atomic_load_n(&pq->tail, __ATOMIC_SEQ_CST) -
+           __atomic_load_n(&pq->head, __ATOMIC_SEQ_CST);
+}
+
+/* a thread about to block on data_ready_cond calls _mysock_begin_wait(),
+ * then checks its condition, calling pthread_cond_wait() until it holds,
+ * and finally _mysock_end_wait().  the queues are used without the lock,
+ * so their producers/consumers only signal the condition variable (in
+ * _mysock_wakeup()) while someone is waiting.  since 'waiting' is raised
+ * before the condition is checked, either the waiter sees the new data or
+ * the other side sees the waiter.
+ */
+void _mysock_begin_wait(mysock_context_t *ctx)
+{
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    __atomic_add_fetch(&ctx->waiting, 1, __ATOMIC_SEQ_CST);
+}
+
+void _mysock_end_wait(mysock_context_t *ctx)
+{
+    __atomic_sub_fetch(&ctx->waiting, 1, __ATOMIC_SEQ_CST);
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+}
+
+void _mysock_wakeup(mysock_context_t *ctx)
+{
+    if (__atomic_load_n(&ctx->waiting, __ATOMIC_SEQ_CST) > 0)
+    {
+        PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+        PTHREAD_CALL(pthread_cond_broadcast(&ctx->data_ready_cond));
+        PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+    }
+#ifdef TRANSPORT_POOL
+    /* STCP doesn't wait on data_ready_cond when run by the worker pool */
+    _mysock_pool_kick(ctx);
+#endif
+}
+
+/* room left in the send buffer for mywrite(): whatever app_recv_queue and
+ * the data STCP hasn't had acknowledged yet leave of sndbuf, as long as it
+ * also fits in app_recv_queue.
+ */
+size_t _mysock_send_space(mysock_context_t *ctx)
+{
+    size_t queued = _mysock_queued(&ctx->app_recv_queue);
+    size_t used   = queued +
+                    __atomic_load_n(&ctx->snd_unacked, __ATOMIC_SEQ_CST);
+    size_t limit  = __atomic_load_n(&ctx->sndbuf, __ATOMIC_SEQ_CST);
+
+    if (used >= limit)
+        return 0;
+    return MIN(limit - used, ctx->app_recv_queue.size - queued);
+}
+
+/* the most room _mysock_send_space() can ever report:  sndbuf, but no more
+ * than app_recv_queue holds (sndbuf may be set well beyond it)
+ */
+size_t _mysock_send_space_max(mysock_context_t *ctx)
+{
+    return MIN(__atomic_load_n(&ctx->sndbuf, __ATOMIC_SEQ_CST),
+               ctx->app_recv_queue.size);
+}
+
+/* block until the send buffer has at least 'wanted' bytes of room (or as
+ * much as it can ever have, if less), or the STCP thread exits.  returns
+ * the room available.
+ */
+size_t _mysock_wait_for_send_space(mysock_context_t *ctx, size_t wanted)
+{
+    size_t space;
+
+    assert(wanted > 0);
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    __atomic_store_n(&ctx->snd_wanted, wanted, __ATOMIC_SEQ_CST);
+    while ((space = _mysock_send_space(ctx)) <
+               MIN(wanted, _mysock_send_space_max(ctx)) &&
+           !__atomic_load_n(&ctx->transport_done, __ATOMIC_SEQ_CST))
+    {
+        PTHREAD_CALL(pthread_cond_wait(&ctx->space_ready_cond,
+                                       &ctx->data_ready_lock));
+    }
+    __atomic_store_n(&ctx->snd_wanted, 0, __ATOMIC_SEQ_CST);
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+    return space;
+}
+
+/* called by STCP whenever the send buffer may have drained (data taken
+ * from app_recv_queue or acknowledged); wakes a blocked mywrite() once
+ * there's as much room as it asked for.
+ */
+void _mysock_wakeup_writer(mysock_context_t *ctx)
+{
+    size_t wanted = __atomic_load_n(&ctx->snd_wanted, __ATOMIC_SEQ_CST);
+    size_t space  = _mysock_send_space(ctx);
+
+    if (wanted > 0 && space >= MIN(wanted, _mysock_send_space_max(ctx)))
+    {
+        PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+        PTHREAD_CALL(pthread_cond_broadcast(&ctx->space_ready_cond));
+        PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+    }
+    if (space > 0)
+        _mysock_notify_pollers(ctx);
+}
+
+/* copy len bytes in or out of the ring at position pos, wrapping around */
+static void _mysock_ring_copy_in(packet_queue_t *pq, size_t pos,
+                                 const void *src, size_t len)
+{
+    size_t offset = pos & (pq->size - 1);
+    size_t first  = MIN(len, pq->size - offset);
+
+    memcpy(pq->data + offset, src, first);
+    memcpy(pq->data, (const char *) src + first, len - first);
+}
+
+static void _mysock_ring_copy_out(packet_queue_t *pq, size_t pos,
+                                  void *dst, size_t len)
+{
+    size_t offset = pos & (pq->size - 1);
+    size_t first  = MIN(len, pq->size - offset);
+
+    memcpy(dst, pq->data + offset, first);
+    memcpy((char *) dst + first, pq->data, len - first);
+}
+
 /* add an incoming buffer (packet) to a queue for this connection; it will be
  * dequeued by stcp_network_recv() or myread() when the transport layer or
  * application is ready to use it, depending on the queue to which
  * the buffer (or packet) is added.
  *
- * in the interest of simplicity (and since we aren't writing a high
- * performance TCP stack), this just copies the specified buffer for its own
- * use, so the calling code can do whatever it wants with the packet
- * afterwards.  the copied buffer is freed later by dequeue_buffer().
+ * the buffer is copied into the queue, so the calling code can do whatever
+ * it wants with it afterwards.  a datagram that doesn't fit in a full packet
+ * queue is dropped, as a real network interface would.  only as much as
+ * fits is written to a byte queue; a zero-length write marks the end of the
+ * stream.  this never blocks, and returns the number of bytes queued.
  */
-void _mysock_enqueue_buffer(mysock_context_t *ctx,
-                            packet_queue_t   *pq,
-                            const void       *packet,
-                            size_t            packet_len)
+size_t _mysock_enqueue_buffer(mysock_context_t *ctx,
+                              packet_queue_t   *pq,
+                              const void       *packet,
+                              size_t            packet_len)
 {
-    packet_queue_node_t *node;
+    size_t tail, room, queued = 0;
 
     assert(ctx && pq && (packet || !packet_len));
 
-    node = (packet_queue_node_t *) calloc(1, sizeof(packet_queue_node_t));
-    assert(node);
-
-    node->data = (char *) malloc(packet_len * sizeof(char));
-    assert(node->data);
+    /* only the producer allocates the ring, and before publishing anything
+     * in it, so a consumer that sees data queued also sees pq->data
+     */
+    if (!pq->data && packet_len > 0)
+    {
+        pq->data = (char *) malloc(pq->size);
+        assert(pq->data);
+    }
 
-    if (packet_len > 0)
-        memcpy(node->data, packet, packet_len);
-    node->data_len = packet_len;
+    tail = pq->tail;
+    if (pq->packets)
+    {
+        room = pq->size - (tail - __atomic_load_n(&pq->head,
+                                                  __ATOMIC_SEQ_CST));
+        if (room < sizeof(packet_len) + packet_len)
+        {
+            DEBUG_LOG(("dropping %u byte packet (queue full)\n",
+                       (unsigned) packet_len));
+            return 0;
+        }
 
-    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
-    if (!pq->head)
+        _mysock_ring_copy_in(pq, tail, &packet_len, sizeof(packet_len));
+        _mysock_ring_copy_in(pq, tail + sizeof(packet_len),
+                             packet, packet_len);
+        __atomic_store_n(&pq->tail, tail + sizeof(packet_len) + packet_len,
+                         __ATOMIC_SEQ_CST);
+        queued = packet_len;
+    }
+    else if (packet_len == 0)
     {
-        assert(!pq->tail);
-        pq->head = pq->tail = node;
+        __atomic_store_n(&pq->eof, TRUE, __ATOMIC_SEQ_CST);
     }
     else
     {
-        assert(pq->tail);
-        assert(!pq->tail->next);
-        assert(!node->next);
-        pq->tail->next = node;
-        pq->tail = node;
+        room = pq->size - (tail - __atomic_load_n(&pq->head,
+                                                  __ATOMIC_SEQ_CST));
+        queued = MIN(room, packet_len);
+        _mysock_ring_copy_in(pq, tail, packet, queued);
+        __atomic_store_n(&pq->tail, tail + queued, __ATOMIC_SEQ_CST);
     }
-    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
-    PTHREAD_CALL(pthread_cond_broadcast(&ctx->data_ready_cond));
+
+    _mysock_wakeup(ctx);
+    return queued;
+}
+
+/* block until more than 'queued' bytes are in the queue, or (for a byte
+ * queue) the stream has ended.  returns the number of bytes queued.
+ */
+size_t _mysock_wait_for_data(mysock_context_t *ctx,
+                             packet_queue_t   *pq,
+                             size_t            queued)
+{
+    size_t now;
+
+#define QUEUE_READY() \
+    ((now = _mysock_queued(pq)) > queued || \
+     (!pq->packets && __atomic_load_n(&pq->eof, __ATOMIC_SEQ_CST)))
+
+    if (!QUEUE_READY())
+    {
+        _mysock_begin_wait(ctx);
+        while (!QUEUE_READY())
+        {
+            PTHREAD_CALL(pthread_cond_wait(&ctx->data_ready_cond,
+                                           &ctx->data_ready_lock));
+        }
+        _mysock_end_wait(ctx);
+    }
+#undef QUEUE_READY
+
+    return now;
+}
+
+/* look for byte c in a byte queue, among the queued bytes [from, to)
+ * (counted from the head), without removing anything.  returns its
+ * position, or -1 if it isn't there.  only the consumer may call this.
+ */
+ssize_t _mysock_find_byte(packet_queue_t *pq, size_t from, size_t to, int c)
+{
+    assert(pq && !pq->packets);
+    assert(to <= _mysock_queued(pq));
+
+    while (from < to)
+    {
+        size_t      offset = (pq->head + from) & (pq->size - 1);
+        size_t      run    = MIN(to - from, pq->size - offset);
+        const char *found  = (const char *) memchr(pq->data + offset, c, run);
+
+        if (found)
+            return from + (found - (pq->data + offset));
+        from += run;
+    }
+
+    return -1;
 }
 
-/* remove one packet from the head of the waiting packet queue, copying the
- * packet's payload into the specified buffer.  returns the number of bytes
- * copied.  if remove_partial is true, and there is insufficient room in the
- * destination buffer for the packet at the head of the queue, it is only
- * partially dequeued, and the remaining contents remain at the queue's head
- * for a subsequent call to dequeue_buffer().
+/* remove data from the head of the queue, blocking until there is some,
+ * and copy it into the specified buffer.  a packet queue yields one
+ * datagram at a time, and returns its full length even if only max_len
+ * bytes of it fit in dst (remove_partial must be FALSE).  a byte queue
+ * yields up to max_len bytes, regardless of how they were written, and 0
+ * once the stream has ended.
  */
 size_t _mysock_dequeue_buffer(mysock_context_t *ctx,
                               packet_queue_t   *pq,
@@ -180,87 +460,51 @@ size_t _mysock_dequeue_buffer(mysock_context_t *ctx,
                               size_t            max_len,
                               bool_t            remove_partial)
 {
-    packet_queue_node_t *node;
-    size_t               packet_len;
-    char *mid;
+    size_t head, queued, packet_len;
 
     assert(ctx && pq && dst);
+    assert(!(pq->packets && remove_partial));
 
     /* block until queue is non-empty */
-    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
-    while (!pq->head)
-    {
-        PTHREAD_CALL(pthread_cond_wait(&ctx->data_ready_cond,
-                                       &ctx->data_ready_lock));
-    }
+    (void) _mysock_wait_for_data(ctx, pq, 0);
 
-    node = pq->head;
-    
-    mid = malloc(node->data_len - max_len);
+    head   = pq->head;
+    queued = __atomic_load_n(&pq->tail, __ATOMIC_SEQ_CST) - head;
 
-    assert(node && node->data);
-
-    if (node->data_len > max_len && remove_partial)
+    if (pq->packets)
     {
-        /* remove only a portion of the packet at the head of the queue,
-         * leaving the rest around for the next call to dequeue_buffer().
-         */
-        PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
-        memcpy(dst, node->data, max_len);
-	memcpy(mid , node->data + max_len, node->data_len-max_len);
-	/* memcpy(node->data, node->data + max_len, node->data_len - max_len);*/
-	memcpy(node->data , mid , node->data_len-max_len);
-	/*printf("%s\n",dst);*/
-        node->data_len -= max_len;
-        packet_len = max_len;
+        assert(queued >= sizeof(packet_len));
+        _mysock_ring_copy_out(pq, head, &packet_len, sizeof(packet_len));
+        assert(queued >= sizeof(packet_len) + packet_len);
+        _mysock_ring_copy_out(pq, head + sizeof(packet_len), dst,
+                              MIN(max_len, packet_len));
+        head += sizeof(packet_len) + packet_len;
     }
     else
     {
-        /* dequeue the entire packet at the head of the queue */
-        if (!(pq->head = pq->head->next))
-        {
-            assert(pq->tail == node);
-            pq->tail = NULL;
-        }
-        PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
-
-        memcpy(dst, node->data, MIN(max_len, node->data_len));
-        packet_len = node->data_len;
-
-        free(node->data);
-
-        memset(node, 0, sizeof(*node));
-        free(node);
+        /* an empty queue here means the stream has ended */
+        packet_len = MIN(max_len, queued);
+        _mysock_ring_copy_out(pq, head, dst, packet_len);
+        head += packet_len;
     }
 
+    __atomic_store_n(&pq->head, head, __ATOMIC_SEQ_CST);
     return packet_len;
 }
 
-/* free any last buffers in the specified queue, discarding the contents.
- * this is called only when the mysocket context is being deallocated, so
- * there are no concerns about thread safety here.  returns TRUE if
- * non-zero-length buffers were deallocated, FALSE otherwise.
+/* free the specified queue, discarding its contents.  this is called only
+ * when the mysocket context is being deallocated, so there are no concerns
+ * about thread safety here.  returns TRUE if the queue held any data,
+ * FALSE otherwise.
  */
 static bool_t _mysock_free_queue(mysock_context_t *ctx, packet_queue_t *pq)
 {
-    packet_queue_node_t *node;
-    bool_t result = FALSE;
+    bool_t result;
 
     assert(ctx && pq);
-    result = (pq->head != NULL);
-    for (node = pq->head; node; )
-    {
-        packet_queue_node_t *next = node->next;
-
-        if (node->data_len > 0)
-            result = TRUE;
-
-        free(node->data);
-        free(node);
-        node = next;
-    }
-
-    pq->head = pq->tail = NULL;
+    result = (pq->tail != pq->head);
+    free(pq->data);
+    memset(pq, 0, sizeof(*pq));
     return result;
 }
 
@@ -289,9 +533,17 @@ static mysock_context_t *_mysock_allocate_context(void)
      * data is ready from the application or the network.
      */
     PTHREAD_CALL(pthread_cond_init(&ctx->data_ready_cond, NULL));
+    PTHREAD_CALL(pthread_cond_init(&ctx->space_ready_cond, NULL));
     PTHREAD_CALL(pthread_mutex_init(&ctx->data_ready_lock, NULL));
+    PTHREAD_CALL(pthread_mutex_init(&ctx->poll_lock, NULL));
 
     ctx->blocking = TRUE;   /* we unblock once we're connected */
+    ctx->sndbuf   = SNDBUF_DEFAULT;
+
+    _mysock_init_queue(&ctx->network_recv_queue, NETWORK_RECV_QUEUE_SIZE,
+                       TRUE);
+    _mysock_init_queue(&ctx->app_recv_queue, APP_RECV_QUEUE_SIZE, FALSE);
+    _mysock_init_queue(&ctx->app_send_queue, APP_SEND_QUEUE_SIZE, FALSE);
 
 
     /* initialise underlying network state.  this includes creating the actual
@@ -313,6 +565,7 @@ static mysock_context_t *_mysock_allocate_context(void)
  */
 void _mysock_free_context(mysock_context_t *ctx)
 {
+    mysock_context_t **slot;
     int sd;
 
     assert(ctx);
@@ -321,7 +574,9 @@ void _mysock_free_context(mysock_context_t *ctx)
     PTHREAD_CALL(pthread_mutex_destroy(&ctx->blocking_lock));
 
     PTHREAD_CALL(pthread_cond_destroy(&ctx->data_ready_cond));
+    PTHREAD_CALL(pthread_cond_destroy(&ctx->space_ready_cond));
     PTHREAD_CALL(pthread_mutex_destroy(&ctx->data_ready_lock));
+    PTHREAD_CALL(pthread_mutex_destroy(&ctx->poll_lock));
 
     /* free any last buffers that might be lying around (e.g. retransmitted
      * packets from the peer).  normally, the application from/to queues
@@ -332,24 +587,34 @@ void _mysock_free_context(mysock_context_t *ctx)
     (void) _mysock_free_queue(ctx, &ctx->app_recv_queue);
     (void) _mysock_free_queue(ctx, &ctx->app_send_queue);
 
+    _network_netem_close(&ctx->network_state);
     _network_close(&ctx->network_state);
 
-    /* clear mysocket descriptor table entry */
+    /* clear mysocket descriptor table entry, and put the descriptor back
+     * on the free list
+     */
     sd = ctx->my_sd;
-    if (global_ctx[sd] == ctx)
-        global_ctx[sd] = 0;
+    PTHREAD_CALL(pthread_mutex_lock(&sd_lock));
+    if ((slot = _mysock_descriptor_slot(sd)) && *slot == ctx)
+    {
+        __atomic_store_n(slot, NULL, __ATOMIC_RELEASE);
+        sd_table[sd / SD_CHUNK_SIZE]->next_free[sd % SD_CHUNK_SIZE] =
+            sd_free_head;
+        sd_free_head = sd;
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&sd_lock));
 
     memset(ctx, 0, sizeof(*ctx));
     free(ctx);
 }
 
+#ifndef TRANSPORT_POOL
 /* transport layer thread; transport_init() should not return until the
  * transport layer finishes (i.e. the connection is over).
  */
 static void *transport_thread_func(void *arg_ptr)
 {
     mysock_context_t *ctx = (mysock_context_t *) arg_ptr;
-    char eof_packet;
 
     assert(ctx);
     ASSERT_VALID_MYSOCKET_DESCRIPTOR(ctx, ctx->my_sd);
@@ -367,6 +632,20 @@ static void *transport_thread_func(void *arg_ptr)
     /* transport_init() has returned; both sides have closed the connection,
      * do some final cleanup here...
      */
+    _mysock_transport_finished(ctx);
+    return NULL;
+}
+#endif  /*!TRANSPORT_POOL*/
+
+/* called once STCP is done with the connection (and with errno as STCP
+ * left it):  reports a failed connection attempt to the application,
+ * and makes myread()/mywrite() see the end of the connection.
+ */
+void _mysock_transport_finished(mysock_context_t *ctx)
+{
+    char eof_packet;
+
+    _mysock_trace_close(ctx);
 
     PTHREAD_CALL(pthread_mutex_lock(&ctx->blocking_lock));
     if (ctx->blocking)
@@ -392,10 +671,15 @@ static void *transport_thread_func(void *arg_ptr)
     }
 
     /* force final myread() to return 0 bytes (this should have been done
-     * by the transport layer already in response to the peer's FIN).
+     * by the transport layer already in response to the peer's FIN), and
+     * fail any mywrite() still waiting for room.
      */
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    __atomic_store_n(&ctx->transport_done, TRUE, __ATOMIC_SEQ_CST);
+    PTHREAD_CALL(pthread_cond_broadcast(&ctx->space_ready_cond));
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
     _mysock_enqueue_buffer(ctx, &ctx->app_send_queue, &eof_packet, 0);
-    return NULL;
+    _mysock_notify_pollers(ctx);
 }
 
 
@@ -406,10 +690,11 @@ static void *transport_thread_func(void *arg_ptr)
 static void verify_mysocket_descriptor(mysock_context_t *comp_ctx,
                                        mysocket_t        my_sd)
 {
-    mysock_context_t *ctx;
+    mysock_context_t **slot, *ctx;
 
-    assert(my_sd >= 0 && my_sd < (int)ARRAY_DIM(global_ctx));
-    ctx = global_ctx[my_sd];
+    slot = _mysock_descriptor_slot(my_sd);
+    assert(slot);
+    ctx = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
 
     assert(ctx);
     assert(ctx->my_sd == my_sd);
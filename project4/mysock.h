@@ -27,13 +27,117 @@ typedef int bool_t;
 typedef int mysocket_t;     /* mysocket descriptor */
 
 
-/* maximum number of mysockets per process */
-#define MAX_NUM_CONNECTIONS 64
+/* maximum number of mysockets per process.  the descriptor table starts
+ * small and grows on demand up to this size.
+ */
+#define MAX_NUM_CONNECTIONS 65536
 
 #if (MAX_NUM_CONNECTIONS & (MAX_NUM_CONNECTIONS - 1)) != 0
     #error MAX_NUM_CONNECTIONS should be a power of two
 #endif
 
+/* mysetsockopt()/mygetsockopt() options; all but STCP_NETEM and STCP_INFO
+ * take an int value
+ */
+#define STCP_NODELAY    1   /* nonzero: send small writes right away */
+#define STCP_CORK       2   /* nonzero: hold back partial segments until
+                             * cleared again (or until myclose()) */
+#define STCP_SNDBUF     3   /* send buffer size in bytes: data written but
+                             * not yet acknowledged by the peer */
+#define STCP_NONBLOCK   4   /* nonzero: myread(), mywrite() and myaccept()
+                             * fail with EAGAIN (mywrite() may also return
+                             * a short count) instead of blocking */
+#define STCP_NETEM      5   /* string:  the network path to emulate for
+                             * this mysocket, e.g. "delay 20ms loss 1%"
+                             * (see network.c), or "" for none.  must be set
+                             * before myconnect()/mylisten() */
+#define STCP_INFO       6   /* struct stcp_info (below), read only */
+
+/* a snapshot of a connection's transport state, modelled on Linux's
+ * struct tcp_info.  the STCP layer republishes it after every event it
+ * handles, and mygetsockopt(STCP_INFO) copies the latest one without
+ * waiting on the transport thread.  sizes and windows are in bytes, times
+ * in microseconds.  if optlen is short, the structure is truncated, so
+ * fields are only ever added at the end.
+ */
+struct stcp_info
+{
+    uint32_t stcpi_state;       /* STCP_ESTABLISHED etc., below */
+    uint32_t stcpi_mss;         /* segment size both ends agreed on */
+    uint32_t stcpi_sack;        /* nonzero if SACK was negotiated */
+    uint32_t stcpi_cwnd;        /* congestion window */
+    uint32_t stcpi_ssthresh;    /* slow start threshold */
+    uint32_t stcpi_srtt;        /* smoothed RTT, 0 before the first sample */
+    uint32_t stcpi_rttvar;      /* RTT variation */
+    uint32_t stcpi_rto;         /* retransmission timeout, with backoff */
+    uint32_t stcpi_backoff;     /* consecutive timeouts */
+    uint32_t stcpi_unacked;     /* sequence space sent but not acked */
+    uint32_t stcpi_in_flight;   /* estimate of what's still in the network
+                                 * (less SACKed and lost segments) */
+    uint32_t stcpi_sacked;      /* unacked bytes the peer has SACKed */
+    uint32_t stcpi_dupacks;     /* duplicate ACKs in a row */
+    uint32_t stcpi_snd_wnd;     /* window the peer last advertised */
+    uint32_t stcpi_rcv_wnd;     /* window we last advertised */
+    uint32_t stcpi_in_recovery; /* nonzero during fast recovery */
+
+    /* totals over the life of the connection */
+    uint64_t stcpi_segs_out;        /* including retransmissions */
+    uint64_t stcpi_segs_in;
+    uint64_t stcpi_bytes_sent;      /* payload, including retransmissions */
+    uint64_t stcpi_bytes_acked;     /* payload acked by the peer */
+    uint64_t stcpi_bytes_received;  /* payload passed up in order */
+    uint64_t stcpi_retrans_segs;    /* segments sent more than once */
+    uint64_t stcpi_retrans_bytes;   /* payload in those */
+    uint64_t stcpi_total_dupacks;   /* duplicate ACKs received */
+    uint64_t stcpi_timeouts;        /* retransmission timeouts */
+    uint64_t stcpi_recoveries;      /* fast recovery episodes */
+};
+
+/* stcpi_state values, numbered as Linux's TCP states */
+#define STCP_ESTABLISHED    1
+#define STCP_SYN_SENT       2
+#define STCP_SYN_RECV       3
+#define STCP_FIN_WAIT1      4
+#define STCP_FIN_WAIT2      5
+#define STCP_CLOSE          7
+#define STCP_CLOSE_WAIT     8
+#define STCP_LAST_ACK       9
+#define STCP_LISTEN         10
+#define STCP_CLOSING        11
+
+/* readiness events for mypoll() and myepoll_wait() */
+#define MYPOLLIN    0x001   /* myread() or myaccept() won't block */
+#define MYPOLLOUT   0x004   /* mywrite() won't block */
+#define MYPOLLHUP   0x010   /* connection is over; always reported */
+#define MYPOLLNVAL  0x020   /* not a mysocket (mypoll() only) */
+#define MYEPOLLET   0x80000000u /* edge-triggered: report a mysocket again
+                                 * only after new data/room/connections */
+
+#define MYEPOLL_CTL_ADD 1
+#define MYEPOLL_CTL_DEL 2
+#define MYEPOLL_CTL_MOD 3
+
+struct mypollfd
+{
+    mysocket_t sd;
+    short      events;      /* requested events */
+    short      revents;     /* returned events */
+};
+
+typedef union myepoll_data
+{
+    void     *ptr;
+    int       sd;
+    uint32_t  u32;
+    uint64_t  u64;
+} myepoll_data_t;
+
+struct myepoll_event
+{
+    uint32_t       events;
+    myepoll_data_t data;
+};
+
 
 extern mysocket_t mysocket(bool_t is_reliable);
 extern int mybind(mysocket_t sd, struct sockaddr *addr, int addrlen);
@@ -42,11 +146,28 @@ extern int myconnect(mysocket_t sd, struct sockaddr* name, int namelen);
 extern int myaccept(mysocket_t sd, struct sockaddr* addr, int *addrlen);
 extern int myclose(mysocket_t sd);
 extern int myread(mysocket_t sd, void *buffer, size_t length);
+extern int myreadline(mysocket_t sd, char *buffer, size_t length);
 extern int mywrite(mysocket_t sd, const void *buffer, size_t length);
+extern ssize_t mysendfile(mysocket_t sd, int fd, off_t offset, size_t count);
 extern int mygetsockname(mysocket_t sd, struct sockaddr *addr,
                          socklen_t *addrlen);
 extern int mygetpeername(mysocket_t sd, struct sockaddr *addr,
                          socklen_t *addrlen);
+extern int mysetsockopt(mysocket_t sd, int optname, const void *optval,
+                        socklen_t optlen);
+extern int mygetsockopt(mysocket_t sd, int optname, void *optval,
+                        socklen_t *optlen);
+
+/* readiness multiplexing, modelled on poll(2) and epoll(7).  timeouts are
+ * in milliseconds; -1 waits forever.
+ */
+extern int mypoll(struct mypollfd *fds, unsigned int nfds, int timeout);
+extern int myepoll_create(void);
+extern int myepoll_ctl(int epd, int op, mysocket_t sd,
+                       struct myepoll_event *event);
+extern int myepoll_wait(int epd, struct myepoll_event *events,
+                        int maxevents, int timeout);
+extern int myepoll_close(int epd);
 
 /* return IP address of interface on which packets to/from peer_addr are
  * delivered.  peer_addr is in network byte order.
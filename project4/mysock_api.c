@@ -1,16 +1,21 @@
 /* mysock_api.c--application interface to the mysocket layer */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <unistd.h>
+#include <sched.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include "mysock.h"
 #include "mysock_impl.h"
 #include "network_io.h"
+#include "network.h"
 #include "connection_demux.h"
 
 
@@ -100,9 +105,14 @@ mysocket_t myaccept(mysocket_t sd, struct sockaddr *addr, int *addrlen)
 #endif  /*DEBUG*/
 
     /* the new socket is created on an incoming SYN.  block here until we
-     * establish a connection, or STCP indicates an error condition.
+     * establish a connection, or STCP indicates an error condition.  a
+     * non-blocking listener fails with EAGAIN instead.
      */
-    _mysock_dequeue_connection(accept_ctx, &ctx);
+    if (!_mysock_dequeue_connection(accept_ctx, &ctx,
+                                    !accept_ctx->nonblocking))
+    {
+        MYSOCK_ERROR_EXIT(EAGAIN);
+    }
     assert(ctx);
 
     if (!ctx->stcp_errno)
@@ -169,7 +179,7 @@ int myclose(mysocket_t sd)
     PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
     ctx->close_requested = TRUE;
     PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
-    PTHREAD_CALL(pthread_cond_broadcast(&ctx->data_ready_cond));
+    _mysock_wakeup(ctx);
 
     /* block until STCP thread exits */
     if (ctx->transport_thread_started)
@@ -179,9 +189,16 @@ int myclose(mysocket_t sd)
         PTHREAD_CALL(pthread_join(ctx->transport_thread, NULL));
         ctx->transport_thread_started = FALSE;
     }
+#ifdef TRANSPORT_POOL
+    /* (or until the worker pool is done with the connection) */
+    _mysock_pool_wait(ctx);
+#endif
 
     _network_stop_recv_thread(ctx);
 
+    /* nothing can become ready any more; drop out of any epoll sets */
+    _mysock_detach_pollers(ctx);
+
     if (ctx->listening)
     {
         /* remove entry from SYN demultiplexing table */
@@ -195,18 +212,184 @@ int myclose(mysocket_t sd)
     return 0;
 }
 
+/* queue data for STCP to send.  the data goes into the send buffer
+ * (STCP_SNDBUF); if that is full, mywrite() blocks until the peer has
+ * acknowledged enough to make room for the rest (or for half the buffer),
+ * unless the socket is non-blocking, in which case it returns the number
+ * of bytes that fit, or fails with EAGAIN if none did.
+ */
 int mywrite(mysocket_t sd, const void *buf, size_t buf_len)
 {
     mysock_context_t *ctx = _mysock_get_context(sd);
+    size_t written = 0, space;
 
     MYSOCK_CHECK(ctx != NULL, EBADF);
     MYSOCK_CHECK(!ctx->listening, EINVAL);
 
     assert(!ctx->close_requested);
-    _mysock_enqueue_buffer(ctx, &ctx->app_recv_queue, buf, buf_len);
 
-    /* XXX: all bytes are queued, irrespective of current sender window */
-    return buf_len;
+    while (written < buf_len)
+    {
+        if (__atomic_load_n(&ctx->transport_done, __ATOMIC_SEQ_CST))
+            break;
+
+        if ((space = _mysock_send_space(ctx)) == 0)
+        {
+            if (ctx->nonblocking)
+                break;
+
+            (void) _mysock_wait_for_send_space(
+                ctx, MIN(_mysock_send_space_max(ctx) / 2, buf_len - written));
+            continue;
+        }
+
+        written += _mysock_enqueue_buffer(ctx, &ctx->app_recv_queue,
+                                          (const char *) buf + written,
+                                          MIN(space, buf_len - written));
+    }
+
+    if (written == 0 && buf_len > 0)
+    {
+        MYSOCK_ERROR_EXIT(ctx->transport_done ? EPIPE : EAGAIN);
+    }
+    return written;
+}
+
+/* lend len bytes at data to STCP, which copies them into its segments
+ * from there (see stcp_app_recv()), and wait until it has taken all of
+ * them, or has exited.  returns the number of bytes taken.
+ */
+static size_t _mysock_lend_sendfile(mysock_context_t *ctx,
+                                    const char *data, size_t len)
+{
+    size_t left;
+
+    assert(__atomic_load_n(&ctx->sendfile_left, __ATOMIC_ACQUIRE) == 0);
+    ctx->sendfile_data = data;
+    __atomic_store_n(&ctx->sendfile_left, len, __ATOMIC_RELEASE);
+    _mysock_wakeup(ctx);
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    while ((left = __atomic_load_n(&ctx->sendfile_left,
+                                   __ATOMIC_ACQUIRE)) > 0 &&
+           !__atomic_load_n(&ctx->transport_done, __ATOMIC_SEQ_CST))
+    {
+        PTHREAD_CALL(pthread_cond_wait(&ctx->space_ready_cond,
+                                       &ctx->data_ready_lock));
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+
+    /* STCP has exited, and won't take the rest */
+    __atomic_store_n(&ctx->sendfile_left, 0, __ATOMIC_SEQ_CST);
+    return len - left;
+}
+
+/* send count bytes of the file open on fd, starting at offset, as if they
+ * had been passed to mywrite() (the file position is neither used nor
+ * changed).  the file is mapped, and STCP copies each segment's payload
+ * straight from the mapping as the window opens, so the data isn't copied
+ * into the send buffer first.  a file that can't be mapped is pread()
+ * SENDFILE_CHUNK bytes at a time instead.  this returns once STCP has
+ * taken everything; as that includes a last piece smaller than a
+ * segment, STCP_CORK doesn't hold it back.  a non-blocking mysocket gets
+ * as much as fits in its send buffer, as with mywrite().
+ *
+ * returns the number of bytes sent, which is less than count if the file
+ * ends first, or -1 on error.
+ */
+ssize_t mysendfile(mysocket_t sd, int fd, off_t offset, size_t count)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    size_t sent = 0, taken, skip, page = (size_t) sysconf(_SC_PAGESIZE);
+    void *map = MAP_FAILED;
+    char *buf = NULL;
+    struct stat st;
+    int error = 0;
+
+    MYSOCK_CHECK(ctx != NULL, EBADF);
+    MYSOCK_CHECK(!ctx->listening, EINVAL);
+    MYSOCK_CHECK(offset >= 0, EINVAL);
+
+    assert(!ctx->close_requested);
+
+    if (fstat(fd, &st) < 0)
+        return -1;
+
+    /* pages past the end of a mapped file can't be touched */
+    skip = offset % page;
+    if (S_ISREG(st.st_mode))
+    {
+        count = (offset < st.st_size) ?
+            MIN(count, (size_t) (st.st_size - offset)) : 0;
+        if (count > 0)
+            map = mmap(NULL, skip + count, PROT_READ, MAP_SHARED,
+                       fd, offset - skip);
+    }
+
+    if (map != MAP_FAILED)
+    {
+        const char *data = (const char *) map + skip;
+
+        (void) madvise(map, skip + count, MADV_SEQUENTIAL);
+        if (ctx->nonblocking)
+        {
+            int rc = mywrite(sd, data, count);
+
+            if (rc < 0)
+                error = errno;
+            sent = (rc < 0) ? 0 : (size_t) rc;
+        }
+        else
+        {
+            sent = _mysock_lend_sendfile(ctx, data, count);
+        }
+        munmap(map, skip + count);
+    }
+
+    while (map == MAP_FAILED && sent < count &&
+           !__atomic_load_n(&ctx->transport_done, __ATOMIC_SEQ_CST))
+    {
+        ssize_t len;
+
+        if (!buf && !(buf = (char *) malloc(SENDFILE_CHUNK)))
+        {
+            error = ENOMEM;
+            break;
+        }
+        if ((len = pread(fd, buf, MIN(count - sent, SENDFILE_CHUNK),
+                         offset + sent)) <= 0)
+        {
+            error = (len < 0) ? errno : 0;
+            break;
+        }
+
+        if (ctx->nonblocking)
+        {
+            int rc = mywrite(sd, buf, len);
+
+            if (rc < 0)
+                error = errno;
+            taken = (rc < 0) ? 0 : (size_t) rc;
+        }
+        else
+        {
+            taken = _mysock_lend_sendfile(ctx, buf, len);
+        }
+
+        sent += taken;
+        if (taken < (size_t) len)
+            break;
+    }
+
+    free(buf);
+    if (sent == 0 && count > 0)
+    {
+        if (error)
+            MYSOCK_ERROR_EXIT(error);
+        if (ctx->transport_done)
+            MYSOCK_ERROR_EXIT(EPIPE);
+    }
+    return sent;
 }
 
 int myread(mysocket_t sd, void *buf, size_t buf_len)
@@ -222,16 +405,100 @@ int myread(mysocket_t sd, void *buf, size_t buf_len)
     if (ctx->eof)
         return 0;
 
+    if (ctx->nonblocking && _mysock_queued(&ctx->app_send_queue) == 0 &&
+        !__atomic_load_n(&ctx->app_send_queue.eof, __ATOMIC_SEQ_CST))
+    {
+        MYSOCK_ERROR_EXIT(EAGAIN);
+    }
+
     if ((len = _mysock_dequeue_buffer(ctx, &ctx->app_send_queue,
                                       buf, buf_len, TRUE)) == 0)
     {
         /* make sure repeated calls to myread() return 0 on EOF */
         ctx->eof = TRUE;
     }
+    else
+    {
+        /* there's more room in the receive buffer now; let STCP know, so
+         * it can open the window it advertises to the peer.
+         */
+        __atomic_store_n(&ctx->app_data_read, TRUE, __ATOMIC_SEQ_CST);
+        _mysock_wakeup(ctx);
+    }
 
     return len;
 }
 
+/* read a line:  everything up to and including the next '\n', or the first
+ * buf_len - 1 bytes if the line is longer, followed by a NUL, as with
+ * fgets().  the line is looked for where it lies in the receive buffer
+ * and copied out in one go, instead of with a myread() per byte.  this
+ * blocks until the whole line has arrived (a non-blocking mysocket fails
+ * with EAGAIN instead, and consumes nothing); at the end of the stream, it
+ * returns what's left of an unterminated last line, and then 0.
+ *
+ * returns the length of the line, not counting the NUL, or -1 on error.
+ */
+int myreadline(mysocket_t sd, char *buf, size_t buf_len)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    packet_queue_t *pq;
+    size_t queued = 0, scanned = 0, len;
+    ssize_t found;
+    bool_t ended;
+
+    MYSOCK_CHECK(ctx != NULL, EBADF);
+    MYSOCK_CHECK(!ctx->listening, EINVAL);
+    MYSOCK_CHECK(buf != NULL && buf_len > 1, EINVAL);
+
+    assert(!ctx->close_requested);
+
+    *buf = '\0';
+    if (ctx->eof)
+        return 0;
+
+    pq = &ctx->app_send_queue;
+    for (;;)
+    {
+        /* eof first:  once it's set, everything is queued */
+        ended  = __atomic_load_n(&pq->eof, __ATOMIC_SEQ_CST);
+        queued = _mysock_queued(pq);
+
+        /* only the bytes that arrived since the last look are searched */
+        if ((found = _mysock_find_byte(pq, scanned, MIN(queued, buf_len - 1),
+                                       '\n')) >= 0)
+        {
+            len = found + 1;
+            break;
+        }
+        if (queued >= buf_len - 1 || ended)
+        {
+            len = MIN(queued, buf_len - 1);
+            break;
+        }
+        scanned = queued;
+
+        if (ctx->nonblocking)
+            MYSOCK_ERROR_EXIT(EAGAIN);
+        (void) _mysock_wait_for_data(ctx, pq, queued);
+    }
+
+    if (len == 0)
+    {
+        /* make sure repeated calls return 0 on EOF, as for myread() */
+        ctx->eof = TRUE;
+        return 0;
+    }
+
+    (void) _mysock_dequeue_buffer(ctx, pq, buf, len, TRUE);
+    buf[len] = '\0';
+
+    /* as in myread(), let STCP open its window */
+    __atomic_store_n(&ctx->app_data_read, TRUE, __ATOMIC_SEQ_CST);
+    _mysock_wakeup(ctx);
+    return len;
+}
+
 /* fills in addr with current port associated with the mysocket descriptor.
  * like the regular getsockname(), this does not fill in the local IP
  * address unless it's known.
@@ -279,6 +546,171 @@ int mygetpeername(mysocket_t sd, struct sockaddr *name, socklen_t *namelen)
     return 0;
 }
 
+/* set a socket option (see mysock.h).  STCP is woken up so that a cleared
+ * STCP_CORK flushes whatever it was holding.  STCP_SNDBUF is clamped to
+ * [SNDBUF_MIN, SNDBUF_MAX].  STCP_NETEM takes a string of up to 255
+ * characters (optlen need not count a terminating NUL).
+ */
+int mysetsockopt(mysocket_t sd, int optname, const void *optval,
+                 socklen_t optlen)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    int value;
+
+    MYSOCK_CHECK(ctx != NULL, EBADF);
+    MYSOCK_CHECK(optval != NULL, EFAULT);
+
+    if (optname == STCP_NETEM)
+    {
+        char spec[256];
+        int rc;
+
+        MYSOCK_CHECK(optlen < sizeof(spec), EINVAL);
+        memcpy(spec, optval, optlen);
+        spec[optlen] = '\0';
+
+        PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+        if (ctx->network_state.peer_addr_valid || ctx->listening)
+            rc = EISCONN;
+        else if (_network_netem_configure(&ctx->network_state, spec) < 0)
+            rc = EINVAL;
+        else
+            rc = 0;
+        PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+
+        MYSOCK_CHECK(rc == 0, rc);
+        return 0;
+    }
+
+    MYSOCK_CHECK(optlen == sizeof(int), EINVAL);
+
+    value = *(const int *) optval;
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    switch (optname)
+    {
+    case STCP_NODELAY:
+        ctx->nodelay = (value != 0);
+        break;
+    case STCP_CORK:
+        ctx->cork = (value != 0);
+        break;
+    case STCP_SNDBUF:
+        value = (value < SNDBUF_MIN) ? SNDBUF_MIN : value;
+        value = (value > SNDBUF_MAX) ? SNDBUF_MAX : value;
+        __atomic_store_n(&ctx->sndbuf, (size_t) value, __ATOMIC_SEQ_CST);
+        PTHREAD_CALL(pthread_cond_broadcast(&ctx->space_ready_cond));
+        break;
+    case STCP_NONBLOCK:
+        ctx->nonblocking = (value != 0);
+        break;
+    default:
+        PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+        MYSOCK_ERROR_EXIT(ENOPROTOOPT);
+    }
+    ctx->sockopt_changed = TRUE;
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+    _mysock_wakeup(ctx);
+    return 0;
+}
+
+/* copy the latest snapshot stcp_set_info() published, retrying if the STCP
+ * thread was writing it meanwhile.  before the first one, only the state is
+ * known.
+ */
+static void _mysock_read_info(mysock_context_t *ctx, struct stcp_info *info)
+{
+    uint32_t *dst = (uint32_t *) info;
+    const uint32_t *src = (const uint32_t *) &ctx->info;
+    unsigned int seq, k;
+    bool_t valid;
+
+    for (;;)
+    {
+        seq = __atomic_load_n(&ctx->info_seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+        {
+            sched_yield();
+            continue;
+        }
+        for (k = 0; k < sizeof(*info) / sizeof(uint32_t); ++k)
+            dst[k] = __atomic_load_n(&src[k], __ATOMIC_RELAXED);
+        valid = __atomic_load_n(&ctx->info_valid, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&ctx->info_seq, __ATOMIC_RELAXED) == seq)
+            break;
+    }
+
+    if (!valid)
+    {
+        memset(info, 0, sizeof(*info));
+        info->stcpi_state = ctx->listening ? STCP_LISTEN : STCP_CLOSE;
+    }
+}
+
+int mygetsockopt(mysocket_t sd, int optname, void *optval, socklen_t *optlen)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    int value;
+
+    MYSOCK_CHECK(ctx != NULL, EBADF);
+    MYSOCK_CHECK(optval != NULL && optlen != NULL, EFAULT);
+
+    if (optname == STCP_NETEM)
+    {
+        const char *spec;
+        socklen_t len;
+
+        PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+        spec = _network_netem_spec(&ctx->network_state);
+        len = spec ? strlen(spec) + 1 : 1;
+        if (*optlen >= len)
+            memcpy(optval, spec ? spec : "", len);
+        PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+
+        MYSOCK_CHECK(*optlen >= len, EINVAL);
+        *optlen = len;
+        return 0;
+    }
+
+    if (optname == STCP_INFO)
+    {
+        struct stcp_info info;
+
+        _mysock_read_info(ctx, &info);
+        *optlen = MIN(*optlen, (socklen_t) sizeof(info));
+        memcpy(optval, &info, *optlen);
+        return 0;
+    }
+
+    MYSOCK_CHECK(*optlen >= sizeof(int), EINVAL);
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    switch (optname)
+    {
+    case STCP_NODELAY:
+        value = ctx->nodelay;
+        break;
+    case STCP_CORK:
+        value = ctx->cork;
+        break;
+    case STCP_SNDBUF:
+        value = (int) ctx->sndbuf;
+        break;
+    case STCP_NONBLOCK:
+        value = ctx->nonblocking;
+        break;
+    default:
+        PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+        MYSOCK_ERROR_EXIT(ENOPROTOOPT);
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+
+    *(int *) optval = value;
+    *optlen = sizeof(int);
+    return 0;
+}
+
 /* returns IP address of interface on which packets to/from network address
  * peer_addr (network byte order) are delivered.
  */
@@ -14,7 +14,10 @@
  * lock/unlock the hash table as needed.
  *
  * HASH_TABLE_DECLARE and HASH_TABLE_DECLARE_EXTENDED must be invoked in
- * the global namespace, before any use of the hash table.  HASH_INSERT,
+ * the global namespace, before any use of the hash table.  the size given
+ * there is only the initial number of buckets; the table doubles whenever
+ * it holds as many entries as buckets, and halves again (down to the
+ * initial size) once it is less than a quarter full.  HASH_INSERT,
  * HASH_DELETE, and HASH_LOOKUP perform the usual insertion, delete, and
  * lookup operations, using chaining for conflict resolution.  data items
  * are copied into the hash table; this is a shallow copy for pointers.
@@ -60,27 +63,60 @@ typedef struct tbl##_entry \
     datatype            data; \
     struct tbl##_entry *next; \
 } __##tbl##_entry_t; \
-static __##tbl##_entry_t *tbl[size]; \
+static __##tbl##_entry_t **tbl; \
+static unsigned int tbl##_size;     /* # of buckets, 0 until first insert */ \
+static unsigned int tbl##_count;    /* # of entries */ \
 \
 static __##tbl##_entry_t *_hash_get_entry_##tbl(keytype key) \
 { \
     __##tbl##_entry_t *e; \
     unsigned int ndx; \
     \
-    ndx = hashfn(key, size); \
-    assert(ndx < size); \
+    if (!tbl) \
+        return NULL; \
+    ndx = hashfn(key, tbl##_size); \
+    assert(ndx < tbl##_size); \
     \
     for (e = tbl[ndx]; e && !keyequal(e->key, key); e = e->next) ; \
     return (e && keyequal(e->key, key)) ? e : NULL; \
 } \
 \
+static void _hash_resize_##tbl(unsigned int new_size) \
+{ \
+    __##tbl##_entry_t **new_tbl, *e, *next; \
+    unsigned int k, ndx; \
+    \
+    new_tbl = (__##tbl##_entry_t **) calloc(new_size, sizeof(*new_tbl)); \
+    assert(new_tbl); \
+    \
+    for (k = 0; k < tbl##_size; ++k) \
+    { \
+        for (e = tbl[k]; e; e = next) \
+        { \
+            next = e->next; \
+            ndx = hashfn(e->key, new_size); \
+            assert(ndx < new_size); \
+            e->next = new_tbl[ndx]; \
+            new_tbl[ndx] = e; \
+        } \
+    } \
+    \
+    free(tbl); \
+    tbl = new_tbl; \
+    tbl##_size = new_size; \
+} \
+\
 static void _hash_insert_##tbl(keytype key, datatype data) \
 { \
     unsigned int ndx; \
     __##tbl##_entry_t *old_head; \
     \
-    ndx = hashfn(key, size); \
-    assert(ndx < size); \
+    /* keep chains short by doubling the table once it is full */ \
+    if (tbl##_count >= tbl##_size) \
+        _hash_resize_##tbl(tbl##_size ? 2 * tbl##_size : (size)); \
+    \
+    ndx = hashfn(key, tbl##_size); \
+    assert(ndx < tbl##_size); \
     old_head = tbl[ndx]; \
     \
     tbl[ndx] = (__##tbl##_entry_t *) malloc(sizeof(__##tbl##_entry_t)); \
@@ -89,6 +125,7 @@ static void _hash_insert_##tbl(keytype key, datatype data) \
     tbl[ndx]->key  = key; \
     tbl[ndx]->data = data; \
     tbl[ndx]->next = old_head; \
+    ++tbl##_count; \
     \
     assert(_hash_get_entry_##tbl(key) == tbl[ndx]); \
 } \
@@ -126,14 +163,17 @@ static void _hash_delete_##tbl(keytype key) \
     __##tbl##_entry_t *prev = 0, *e; \
     unsigned int ndx; \
     \
-    ndx = hashfn(key, size); \
-    assert(ndx < size); \
+    if (!tbl) \
+        return; \
+    ndx = hashfn(key, tbl##_size); \
+    assert(ndx < tbl##_size); \
     \
     for (e = tbl[ndx]; e; e = e->next) \
     { \
         if (keyequal(e->key, key)) \
         { \
             *((e == tbl[ndx]) ? &tbl[ndx] : &prev->next) = e->next; \
+            --tbl##_count; \
             break; \
         } \
         prev = e; \
@@ -141,6 +181,10 @@ static void _hash_delete_##tbl(keytype key) \
     \
     free(e); \
     assert(!_hash_get_entry_##tbl(key)); \
+    \
+    /* and halve it again once it is mostly empty */ \
+    if (tbl##_size > (size) && tbl##_count < tbl##_size / 4) \
+        _hash_resize_##tbl(tbl##_size / 2); \
 }
 
 
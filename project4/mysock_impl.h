@@ -14,6 +14,7 @@
 #include <pthread.h>
 #include "mysock.h"
 #include "network_io.h"
+#include "stcp_api.h"
 
 #ifdef __GNUC__
     #define INLINE __inline__
@@ -48,20 +49,63 @@ static INLINE void _pthread_call(int pthread_retval)
 #endif
 
 
-/* packet/buffer queue */
-typedef struct packet_queue_node
-{
-    char                     *data;
-    size_t                    data_len;
-    struct packet_queue_node *next;
-} packet_queue_node_t;
-
+/* packet/buffer queue.  this is a bounded single-producer/single-consumer
+ * ring: only the producer advances tail and only the consumer advances head,
+ * so data is copied in and out without taking data_ready_lock.  both count
+ * bytes ever written/read, so tail - head is the number of bytes queued.
+ * a packet queue keeps datagram boundaries by storing each datagram behind
+ * its length; a byte queue is a plain stream, ended by setting eof.
+ */
 typedef struct
 {
-    packet_queue_node_t *head;
-    packet_queue_node_t *tail;
+    char    *data;
+    size_t   size;      /* power of two */
+    size_t   head;      /* advanced by the consumer only */
+    size_t   tail;      /* advanced by the producer only */
+    bool_t   packets;   /* TRUE for a packet queue */
+    bool_t   eof;       /* byte queue: nothing more will be written */
 } packet_queue_t;
 
+/* queue sizes.  the network queue holds a full receive window's worth of
+ * datagrams plus their lengths; once it's full, further datagrams are
+ * dropped.  nothing is written to a full byte queue.
+ *
+ * a ring is only allocated by its first write.  the handshake already
+ * writes to the network queue, so every connection holds those 512KB; one
+ * that receives data adds app_send_queue (and STCP's reassembly buffer, as
+ * big, once a segment arrives out of order), and one that sends adds
+ * app_recv_queue.  a connection carrying data both ways thus reserves
+ * about 1.25MB of address space, but only the pages its rings have
+ * actually used are resident:  all of it under bulk transfer, a few pages
+ * for one that exchanges small messages.
+ */
+#define NETWORK_RECV_QUEUE_SIZE (512 * 1024)
+#define APP_RECV_QUEUE_SIZE     (256 * 1024)
+#define APP_SEND_QUEUE_SIZE     STCP_APP_BUFFER_SIZE
+
+/* send buffer (STCP_SNDBUF) limits.  the send buffer holds both the data
+ * waiting in app_recv_queue and the data STCP has sent but the peer hasn't
+ * acknowledged yet; the former is also bounded by APP_RECV_QUEUE_SIZE.
+ */
+#define SNDBUF_DEFAULT  (256 * 1024)
+#define SNDBUF_MIN      (4 * 1024)
+#define SNDBUF_MAX      (4 * 1024 * 1024)
+
+/* mysendfile() reads a file it can't map this much at a time */
+#define SENDFILE_CHUNK  (1024 * 1024)
+
+/* on Linux, connections are run by a shared pool of transport worker
+ * threads (transport_pool.c) rather than by two threads each; build with
+ * -DNO_TRANSPORT_POOL for the latter.  listening sockets always keep their
+ * own network receive thread.
+ */
+#if defined(LINUX) && !defined(NO_TRANSPORT_POOL)
+    #define TRANSPORT_POOL
+#endif
+
+struct myepoll_entry;
+struct transport_worker;
+
 /* mysocket context (and the arguments provided to the transport layer
  * thread).  most of this is mysock/network layer working state, with STCP
  * working state maintained separately by the student.  there is one instance
@@ -98,16 +142,75 @@ typedef struct mysock_context
     pthread_t       transport_thread;
     bool_t          transport_thread_started;
 
+    /* or, with TRANSPORT_POOL, the worker that owns the connection (i.e.
+     * waits for its network input and keeps its timer), and the state of
+     * the connection there
+     */
+    struct transport_worker *worker;
+    struct mysock_context   *task_next;     /* worker's finished list */
+    struct mysock_context   *runq_next;     /* worker's run queue */
+    int                      task_state;    /* TASK_* in transport_pool.c */
+    int64_t                  task_deadline; /* STCP timer (ns), or 0 */
+    unsigned int             task_timer;    /* 1 + index in timer heap */
+    bool_t                   task_finished; /* STCP is done */
+    bool_t                   task_released; /* ...and so is the worker */
+
     /* is data ready from either network or the app? */
     pthread_cond_t  data_ready_cond;
+    pthread_cond_t  space_ready_cond;   /* send buffer has room again */
     pthread_mutex_t data_ready_lock;
+    unsigned int    waiting;            /* threads between _mysock_begin_wait()
+                                         * and _mysock_end_wait() */
     bool_t          close_requested;    /* myclose() called by app? */
+    bool_t          transport_done;     /* STCP thread has exited */
     bool_t          eof;                /* true once peer finishes writing */
+    bool_t          app_data_read;      /* myread() consumed data since the
+                                         * last APP_DATA_READ event */
+    bool_t          sockopt_changed;    /* mysetsockopt() called since the
+                                         * last APP_SOCKOPT event */
+    size_t          app_data_lowat;     /* APP_DATA only fires once this
+                                         * many bytes are queued */
+
+    /* send buffer accounting; the app only writes while
+     * app_recv_queue + snd_unacked stays within sndbuf
+     */
+    size_t          snd_unacked;        /* taken by STCP, not yet acked */
+    size_t          snd_wanted;         /* room a blocked mywrite() waits
+                                         * for, or 0 */
+
+    /* file data lent to STCP by mysendfile(), which STCP takes once
+     * app_recv_queue is empty, as the send buffer allows.  sendfile_data
+     * is STCP's to advance while sendfile_left > 0.
+     */
+    const char     *sendfile_data;
+    size_t          sendfile_left;
+
+    /* epoll instances (mysock_poll.c) watching this mysocket */
+    pthread_mutex_t       poll_lock;
+    struct myepoll_entry *pollers;
+
+    /* socket options (see mysock.h) */
+    bool_t          nodelay;
+    bool_t          cork;
+    size_t          sndbuf;
+    bool_t          nonblocking;
+
+    /* latest stcp_set_info() snapshot, under a sequence lock:  the STCP
+     * thread makes info_seq odd while it writes, so mygetsockopt() retries
+     * a copy that overlapped a write instead of blocking it
+     */
+    unsigned int     info_seq;
+    bool_t           info_valid;
+    struct stcp_info info;
+
+    /* event trace ring, if stcp_trace_open() was called (stcp_trace.c) */
+    struct stcp_trace_ring *trace;
 
     /* data sent to peer is sent immediately, so no queue is needed for that
      * case.  we keep a queue for the other three cases:  data coming from
      * peer, data sent to the app for consumption with myread(), and data
-     * coming from the app via mywrite().
+     * coming from the app via mywrite().  each has a single producer and a
+     * single consumer thread.
      */
     packet_queue_t  network_recv_queue; /* data coming from peer */
     packet_queue_t  app_send_queue; /* data to be passed up to app */
@@ -124,12 +227,31 @@ void _mysock_transport_init(mysocket_t sd, bool_t is_active);
 
 int _mysock_wait_for_connection(mysock_context_t *ctx);
 
+void _mysock_transport_finished(mysock_context_t *ctx);
+
 void _mysock_free_context(mysock_context_t *ctx);
 
-void _mysock_enqueue_buffer(mysock_context_t *ctx,
-                            packet_queue_t   *pq,
-                            const void       *packet,
-                            size_t            packet_len);
+void _mysock_init_queue(packet_queue_t *pq, size_t size, bool_t packets);
+
+size_t _mysock_queued(packet_queue_t *pq);
+
+void _mysock_begin_wait(mysock_context_t *ctx);
+
+void _mysock_end_wait(mysock_context_t *ctx);
+
+void _mysock_wakeup(mysock_context_t *ctx);
+
+size_t _mysock_send_space(mysock_context_t *ctx);
+size_t _mysock_send_space_max(mysock_context_t *ctx);
+
+size_t _mysock_wait_for_send_space(mysock_context_t *ctx, size_t wanted);
+
+void _mysock_wakeup_writer(mysock_context_t *ctx);
+
+size_t _mysock_enqueue_buffer(mysock_context_t *ctx,
+                              packet_queue_t   *pq,
+                              const void       *packet,
+                              size_t            packet_len);
 
 size_t _mysock_dequeue_buffer(mysock_context_t *ctx,
                               packet_queue_t   *pq,
@@ -137,8 +259,34 @@ size_t _mysock_dequeue_buffer(mysock_context_t *ctx,
                               size_t            max_len,
                               bool_t            remove_partial);
 
+size_t _mysock_wait_for_data(mysock_context_t *ctx,
+                             packet_queue_t   *pq,
+                             size_t            queued);
+
+ssize_t _mysock_find_byte(packet_queue_t *pq, size_t from, size_t to, int c);
+
 int _mysock_bind_ephemeral(mysock_context_t *ctx);
 
+/* stcp_api.c */
+unsigned int _mysock_transport_events(mysock_context_t *ctx,
+                                      unsigned int      flags,
+                                      int64_t          *release_at);
+
+/* transport_pool.c */
+void _mysock_pool_add(mysock_context_t *ctx);
+
+void _mysock_pool_kick(mysock_context_t *ctx);
+
+void _mysock_pool_wait(mysock_context_t *ctx);
+
+/* stcp_trace.c */
+void _mysock_trace_close(mysock_context_t *ctx);
+
+/* mysock_poll.c */
+void _mysock_notify_pollers(mysock_context_t *ctx);
+
+void _mysock_detach_pollers(mysock_context_t *ctx);
+
 pthread_t _mysock_create_thread(void *(*start)(void *args), void *args,                                         bool_t create_detached);
 
 #endif  /* __MYSOCK_INTERNAL_H__ */
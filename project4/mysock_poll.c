@@ -0,0 +1,529 @@
+/* mysock_poll.c--readiness multiplexing (mypoll(), myepoll_*()) for
+ * mysockets.
+ *
+ * an epoll instance keeps an interest list of mysockets and a ready list.
+ * whenever something happens on a mysocket that could make it readable or
+ * writable (data or a FIN passed up by STCP, send buffer space freed, a
+ * connection completed on a listening socket, or the connection ending),
+ * the mysocket layer calls _mysock_notify_pollers(), which puts the
+ * mysocket on the ready list of every epoll instance watching it.
+ * myepoll_wait() then works out what each mysocket on the ready list is
+ * actually ready for.  level-triggered mysockets that are still ready stay
+ * on the list; edge-triggered ones (MYEPOLLET) come off until the next
+ * notification.  mypoll() is just a temporary level-triggered epoll
+ * instance.
+ *
+ * locking:  registry_lock (interest list changes) is taken before a
+ * context's poll_lock (its list of watchers), which is taken before an
+ * instance's lock (its ready list).  _mysock_notify_pollers() only needs
+ * the last two, and returns straight away for mysockets nobody watches.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include "mysock.h"
+#include "mysock_impl.h"
+#include "connection_demux.h"
+
+
+#define MAX_NUM_EPOLL 16    /* epoll instances open at once */
+
+#define MYSOCK_ERROR_EXIT(rc) { errno = rc; return -1; }
+#define MYSOCK_CHECK(cond,rc)   { if (!(cond)) MYSOCK_ERROR_EXIT(rc); }
+
+
+struct myepoll;
+
+typedef struct myepoll_entry
+{
+    struct myepoll        *ep;
+    mysock_context_t      *ctx;
+    mysocket_t             sd;
+    uint32_t               events;      /* MYPOLL* | MYEPOLLET */
+    myepoll_data_t         data;
+
+    bool_t                 ready;       /* on ep's ready list? */
+    struct myepoll_entry  *ready_next;
+    struct myepoll_entry  *next;        /* ep's interest list */
+    struct myepoll_entry  *next_in_ctx; /* ctx->pollers */
+} myepoll_entry_t;
+
+typedef struct myepoll
+{
+    pthread_mutex_t   lock;
+    pthread_cond_t    cond;
+
+    myepoll_entry_t  *interest;
+    myepoll_entry_t  *ready_head, *ready_tail;
+} myepoll_t;
+
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static myepoll_t *epoll_table[MAX_NUM_EPOLL];
+
+
+static void _myepoll_init(myepoll_t *ep);
+static void _myepoll_destroy(myepoll_t *ep);
+static int _myepoll_add(myepoll_t *ep, mysocket_t sd,
+                        const struct myepoll_event *event);
+static int _myepoll_wait(myepoll_t *ep, struct myepoll_event *events,
+                         int maxevents, int timeout);
+
+
+/* what the given mysocket is ready for right now */
+static uint32_t _mysock_poll_events(mysock_context_t *ctx)
+{
+    uint32_t events = 0;
+    bool_t done;
+
+    if (ctx->listening)
+        return _mysock_connection_ready(ctx) ? MYPOLLIN : 0;
+
+    done = __atomic_load_n(&ctx->transport_done, __ATOMIC_SEQ_CST);
+
+    if (_mysock_queued(&ctx->app_send_queue) > 0 ||
+        __atomic_load_n(&ctx->app_send_queue.eof, __ATOMIC_SEQ_CST))
+        events |= MYPOLLIN;
+    if (done)
+        events |= MYPOLLHUP;
+    else if (_mysock_send_space(ctx) > 0)
+        events |= MYPOLLOUT;
+    return events;
+}
+
+/* put e at the tail of its instance's ready list.  ep->lock must be held. */
+static void _myepoll_make_ready(myepoll_entry_t *e)
+{
+    myepoll_t *ep = e->ep;
+
+    if (e->ready)
+        return;
+
+    e->ready      = TRUE;
+    e->ready_next = NULL;
+    if (ep->ready_tail)
+        ep->ready_tail->ready_next = e;
+    else
+        ep->ready_head = e;
+    ep->ready_tail = e;
+}
+
+/* take e off its instance's ready list.  ep->lock must be held. */
+static void _myepoll_unready(myepoll_entry_t *e)
+{
+    myepoll_t *ep = e->ep;
+    myepoll_entry_t *prev = NULL, *p;
+
+    if (!e->ready)
+        return;
+
+    for (p = ep->ready_head; p != e; prev = p, p = p->ready_next)
+        assert(p);
+
+    if (prev)
+        prev->ready_next = e->ready_next;
+    else
+        ep->ready_head = e->ready_next;
+    if (ep->ready_tail == e)
+        ep->ready_tail = prev;
+    e->ready = FALSE;
+}
+
+/* unlink e from its mysocket and its instance, and free it.  registry_lock
+ * must be held.
+ */
+static void _myepoll_remove(myepoll_entry_t *e)
+{
+    myepoll_t *ep = e->ep;
+    mysock_context_t *ctx = e->ctx;
+    myepoll_entry_t **pp;
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->poll_lock));
+    for (pp = &ctx->pollers; *pp != e; pp = &(*pp)->next_in_ctx)
+        assert(*pp);
+    __atomic_store_n(pp, e->next_in_ctx, __ATOMIC_SEQ_CST);
+
+    PTHREAD_CALL(pthread_mutex_lock(&ep->lock));
+    _myepoll_unready(e);
+    for (pp = &ep->interest; *pp != e; pp = &(*pp)->next)
+        assert(*pp);
+    *pp = e->next;
+    PTHREAD_CALL(pthread_mutex_unlock(&ep->lock));
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->poll_lock));
+
+    free(e);
+}
+
+static myepoll_entry_t *_myepoll_find(myepoll_t *ep, mysocket_t sd)
+{
+    myepoll_entry_t *e;
+
+    for (e = ep->interest; e && e->sd != sd; e = e->next)
+        ;
+    return e;
+}
+
+static myepoll_t *_myepoll_get(int epd)
+{
+    if (epd < 0 || epd >= MAX_NUM_EPOLL)
+        return NULL;
+    return epoll_table[epd];
+}
+
+
+/* called by the mysocket layer whenever ctx may have become ready */
+void _mysock_notify_pollers(mysock_context_t *ctx)
+{
+    myepoll_entry_t *e;
+
+    if (!ctx || !__atomic_load_n(&ctx->pollers, __ATOMIC_SEQ_CST))
+        return;
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->poll_lock));
+    for (e = ctx->pollers; e; e = e->next_in_ctx)
+    {
+        PTHREAD_CALL(pthread_mutex_lock(&e->ep->lock));
+        if (!e->ready)
+        {
+            _myepoll_make_ready(e);
+            PTHREAD_CALL(pthread_cond_broadcast(&e->ep->cond));
+        }
+        PTHREAD_CALL(pthread_mutex_unlock(&e->ep->lock));
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->poll_lock));
+}
+
+/* called by myclose():  remove ctx from every epoll instance watching it */
+void _mysock_detach_pollers(mysock_context_t *ctx)
+{
+    assert(ctx);
+
+    PTHREAD_CALL(pthread_mutex_lock(&registry_lock));
+    while (ctx->pollers)
+        _myepoll_remove(ctx->pollers);
+    PTHREAD_CALL(pthread_mutex_unlock(&registry_lock));
+}
+
+
+static void _myepoll_init(myepoll_t *ep)
+{
+    memset(ep, 0, sizeof(*ep));
+    PTHREAD_CALL(pthread_mutex_init(&ep->lock, NULL));
+    PTHREAD_CALL(pthread_cond_init(&ep->cond, NULL));
+}
+
+/* registry_lock must be held */
+static void _myepoll_destroy(myepoll_t *ep)
+{
+    while (ep->interest)
+        _myepoll_remove(ep->interest);
+
+    PTHREAD_CALL(pthread_cond_destroy(&ep->cond));
+    PTHREAD_CALL(pthread_mutex_destroy(&ep->lock));
+}
+
+/* registry_lock must be held */
+static int _myepoll_add(myepoll_t *ep, mysocket_t sd,
+                        const struct myepoll_event *event)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    myepoll_entry_t *e;
+
+    MYSOCK_CHECK(ctx != NULL, EBADF);
+    MYSOCK_CHECK(_myepoll_find(ep, sd) == NULL, EEXIST);
+
+    e = (myepoll_entry_t *) calloc(1, sizeof(myepoll_entry_t));
+    assert(e);
+    e->ep     = ep;
+    e->ctx    = ctx;
+    e->sd     = sd;
+    e->events = event->events;
+    e->data   = event->data;
+
+    /* start out on the ready list, so the first myepoll_wait() looks at
+     * the mysocket's current state.
+     */
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->poll_lock));
+    PTHREAD_CALL(pthread_mutex_lock(&ep->lock));
+    e->next      = ep->interest;
+    ep->interest = e;
+    _myepoll_make_ready(e);
+    PTHREAD_CALL(pthread_cond_broadcast(&ep->cond));
+    PTHREAD_CALL(pthread_mutex_unlock(&ep->lock));
+
+    e->next_in_ctx = ctx->pollers;
+    __atomic_store_n(&ctx->pollers, e, __ATOMIC_SEQ_CST);
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->poll_lock));
+    return 0;
+}
+
+/* go once through the ready list, filling in up to maxevents events.
+ * ep->lock must be held.
+ */
+static int _myepoll_collect(myepoll_t *ep, struct myepoll_event *events,
+                            int maxevents)
+{
+    myepoll_entry_t *e, *last = ep->ready_tail;
+    uint32_t revents;
+    int n = 0;
+    bool_t done = (last == NULL);
+
+    while (!done && n < maxevents)
+    {
+        e = ep->ready_head;
+        done = (e == last);
+
+        ep->ready_head = e->ready_next;
+        if (!ep->ready_head)
+            ep->ready_tail = NULL;
+        e->ready = FALSE;
+
+        revents = _mysock_poll_events(e->ctx) & (e->events | MYPOLLHUP);
+        if (!revents)
+            continue;
+
+        events[n].events = revents;
+        events[n].data   = e->data;
+        ++n;
+
+        if (!(e->events & MYEPOLLET))
+            _myepoll_make_ready(e);
+    }
+    return n;
+}
+
+static int _myepoll_wait(myepoll_t *ep, struct myepoll_event *events,
+                         int maxevents, int timeout)
+{
+    struct timespec abstime;
+    struct timeval now;
+    int n;
+
+    if (timeout > 0)
+    {
+        gettimeofday(&now, NULL);
+        abstime.tv_sec  = now.tv_sec + timeout / 1000;
+        abstime.tv_nsec = now.tv_usec * 1000 + (timeout % 1000) * 1000000;
+        if (abstime.tv_nsec >= 1000000000)
+        {
+            abstime.tv_sec  += 1;
+            abstime.tv_nsec -= 1000000000;
+        }
+    }
+
+    PTHREAD_CALL(pthread_mutex_lock(&ep->lock));
+    while ((n = _myepoll_collect(ep, events, maxevents)) == 0 && timeout != 0)
+    {
+        if (timeout < 0)
+        {
+            PTHREAD_CALL(pthread_cond_wait(&ep->cond, &ep->lock));
+        }
+        else if (pthread_cond_timedwait(&ep->cond, &ep->lock,
+                                        &abstime) == ETIMEDOUT)
+        {
+            n = _myepoll_collect(ep, events, maxevents);
+            break;
+        }
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&ep->lock));
+    return n;
+}
+
+
+/* create an epoll instance; returns its descriptor */
+int myepoll_create(void)
+{
+    int epd;
+
+    PTHREAD_CALL(pthread_mutex_lock(&registry_lock));
+    for (epd = 0; epd < MAX_NUM_EPOLL && epoll_table[epd]; ++epd)
+        ;
+    if (epd == MAX_NUM_EPOLL)
+    {
+        PTHREAD_CALL(pthread_mutex_unlock(&registry_lock));
+        MYSOCK_ERROR_EXIT(EMFILE);
+    }
+
+    epoll_table[epd] = (myepoll_t *) malloc(sizeof(myepoll_t));
+    assert(epoll_table[epd]);
+    _myepoll_init(epoll_table[epd]);
+    PTHREAD_CALL(pthread_mutex_unlock(&registry_lock));
+    return epd;
+}
+
+/* add, change or remove the interest of epoll instance epd in sd */
+int myepoll_ctl(int epd, int op, mysocket_t sd, struct myepoll_event *event)
+{
+    myepoll_t *ep;
+    myepoll_entry_t *e;
+    int rc = 0;
+
+    PTHREAD_CALL(pthread_mutex_lock(&registry_lock));
+    if (!(ep = _myepoll_get(epd)))
+    {
+        rc = EBADF;
+        goto done;
+    }
+
+    switch (op)
+    {
+    case MYEPOLL_CTL_ADD:
+        if (!event)
+            rc = EINVAL;
+        else if (_myepoll_add(ep, sd, event) < 0)
+            rc = errno;
+        break;
+
+    case MYEPOLL_CTL_MOD:
+        if (!event)
+            rc = EINVAL;
+        else if (!(e = _myepoll_find(ep, sd)))
+            rc = ENOENT;
+        else
+        {
+            PTHREAD_CALL(pthread_mutex_lock(&ep->lock));
+            e->events = event->events;
+            e->data   = event->data;
+            _myepoll_make_ready(e);
+            PTHREAD_CALL(pthread_cond_broadcast(&ep->cond));
+            PTHREAD_CALL(pthread_mutex_unlock(&ep->lock));
+        }
+        break;
+
+    case MYEPOLL_CTL_DEL:
+        if (!(e = _myepoll_find(ep, sd)))
+            rc = ENOENT;
+        else
+            _myepoll_remove(e);
+        break;
+
+    default:
+        rc = EINVAL;
+        break;
+    }
+
+done:
+    PTHREAD_CALL(pthread_mutex_unlock(&registry_lock));
+    MYSOCK_CHECK(rc == 0, rc);
+    return 0;
+}
+
+/* wait up to timeout ms for mysockets in epoll instance epd to become
+ * ready; returns the number of events filled in.
+ */
+int myepoll_wait(int epd, struct myepoll_event *events, int maxevents,
+                 int timeout)
+{
+    myepoll_t *ep;
+
+    MYSOCK_CHECK(events != NULL && maxevents > 0, EINVAL);
+
+    /* myepoll_close() mustn't free the instance under us, so it's looked
+     * up under registry_lock; closing an instance while another thread
+     * waits on it is an application error, as with close().
+     */
+    PTHREAD_CALL(pthread_mutex_lock(&registry_lock));
+    ep = _myepoll_get(epd);
+    PTHREAD_CALL(pthread_mutex_unlock(&registry_lock));
+    MYSOCK_CHECK(ep != NULL, EBADF);
+
+    return _myepoll_wait(ep, events, maxevents, timeout);
+}
+
+int myepoll_close(int epd)
+{
+    myepoll_t *ep;
+
+    PTHREAD_CALL(pthread_mutex_lock(&registry_lock));
+    if (!(ep = _myepoll_get(epd)))
+    {
+        PTHREAD_CALL(pthread_mutex_unlock(&registry_lock));
+        MYSOCK_ERROR_EXIT(EBADF);
+    }
+
+    epoll_table[epd] = NULL;
+    _myepoll_destroy(ep);
+    PTHREAD_CALL(pthread_mutex_unlock(&registry_lock));
+
+    free(ep);
+    return 0;
+}
+
+/* like poll(2):  wait up to timeout ms for any of the nfds mysockets to
+ * become ready, filling in revents.  returns the number of mysockets with
+ * non-zero revents.
+ */
+int mypoll(struct mypollfd *fds, unsigned int nfds, int timeout)
+{
+    myepoll_t ep;
+    struct myepoll_event event, *events;
+    unsigned int k;
+    int n, nvalid = 0, ninvalid = 0, j;
+
+    MYSOCK_CHECK(fds != NULL || nfds == 0, EINVAL);
+
+    events = (struct myepoll_event *)
+        malloc((nfds ? nfds : 1) * sizeof(*events));
+    assert(events);
+
+    _myepoll_init(&ep);
+
+    PTHREAD_CALL(pthread_mutex_lock(&registry_lock));
+    for (k = 0; k < nfds; ++k)
+    {
+        myepoll_entry_t *e;
+
+        fds[k].revents = 0;
+        event.events   = (uint32_t) (unsigned short) fds[k].events;
+        event.data.u32 = k;
+
+        /* the same mysocket may appear more than once */
+        if ((e = _myepoll_find(&ep, fds[k].sd)))
+        {
+            e->events |= event.events;
+            continue;
+        }
+
+        if (_myepoll_add(&ep, fds[k].sd, &event) < 0)
+        {
+            fds[k].revents = MYPOLLNVAL;
+            ++ninvalid;
+        }
+        else
+        {
+            ++nvalid;
+        }
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&registry_lock));
+
+    n = _myepoll_wait(&ep, events, nvalid ? nvalid : 1,
+                      ninvalid ? 0 : timeout);
+
+    for (j = 0; j < n; ++j)
+    {
+        mysocket_t sd = fds[events[j].data.u32].sd;
+
+        /* fill in every slot naming this mysocket */
+        for (k = events[j].data.u32; k < nfds; ++k)
+        {
+            if (fds[k].sd == sd)
+            {
+                fds[k].revents = (short)
+                    (events[j].events & (fds[k].events | MYPOLLHUP));
+            }
+        }
+    }
+
+    PTHREAD_CALL(pthread_mutex_lock(&registry_lock));
+    _myepoll_destroy(&ep);
+    PTHREAD_CALL(pthread_mutex_unlock(&registry_lock));
+    free(events);
+
+    for (k = 0, n = 0; k < nfds; ++k)
+        n += (fds[k].revents != 0);
+    return n;
+}
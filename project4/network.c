@@ -6,6 +6,8 @@
 #include <string.h>
 #include <errno.h>
 #include <assert.h>
+#include <time.h>
+#include <pthread.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -16,20 +18,683 @@
 #include "transport.h"  /* for dprintf() */
 
 
+/* network impairment emulation.
+ *
+ * a mysocket may be given a netem-like description of the path its packets
+ * take, either in the STCP_NETEM environment variable (for every mysocket
+ * the process creates) or with mysetsockopt(STCP_NETEM) (before myconnect()
+ * or mylisten(); connections accepted on a listening mysocket inherit it).
+ * the description is a list of keywords and values, e.g.
+ *
+ *   "delay 40ms 5ms loss gemodel 1% 30% rate 10mbit limit 100 seed 7"
+ *
+ *   loss P%                     drop each packet with probability P
+ *   loss gemodel P% [R% [B% [G%]]]
+ *                               Gilbert-Elliott loss:  go from the good to
+ *                               the bad state with probability P and back
+ *                               with probability R (default 100% - P), and
+ *                               drop with probability B in the bad state
+ *                               (default 100%) and G in the good (default 0)
+ *   duplicate P%                send a second copy with probability P
+ *   delay T [J]                 delay each packet by T, plus or minus up to
+ *                               J chosen uniformly (so jitter reorders)
+ *   rate R [B]                  token bucket:  R bits/s (units bit, kbit,
+ *                               mbit or gbit), with a bucket of B bytes
+ *                               (default one packet)
+ *   limit N                     packets waiting for the rate or delay, past
+ *                               which new ones are dropped (default 1000)
+ *   reorder P% [D]              with probability P, hold a packet back
+ *                               until D (default 1) later packets have gone
+ *                               out, or NETEM_MAX_HOLD after it was due
+ *   seed N                      seed for the random choices above
+ *
+ * times are in s, ms, us or ns (microseconds without a unit, as for netem).
+ * decisions come from a generator of our own, seeded from the seed and the
+ * order in which the process's emulated mysockets were created, so a run
+ * is reproducible from its seed.
+ *
+ * packets that can't go out yet wait in a queue ordered by release time.
+ * the transport thread (or worker) sends them when they fall due:  in
+ * _network_sendv(), and via _network_netem_release() whenever it waits for
+ * events, which tells it when to wake up for the next one.
+ *
+ * without a description, an unreliable mysocket (mysocket(FALSE)) keeps the
+ * original behaviour:  1 packet in 32 each dropped, duplicated, or swapped
+ * with a later one.
+ */
+
+#define NETEM_DEFAULT_LIMIT 1000
+#define NETEM_MAX_HOLD      10000000LL  /* 10ms */
+#define NETEM_SPEC_VAR      "STCP_NETEM"
+
+typedef struct
+{
+    double       loss;          /* Bernoulli loss probability */
+    bool_t       gemodel;       /* Gilbert-Elliott loss instead */
+    double       ge_p, ge_r;    /* good->bad, bad->good transitions */
+    double       ge_bad_loss, ge_good_loss;
+    double       duplicate;
+    int64_t      delay, jitter; /* ns */
+    double       rate;          /* bytes per ns, or 0 for no limit */
+    double       burst;         /* bytes */
+    unsigned int limit;
+    double       reorder;
+    unsigned int reorder_depth;
+    uint64_t     seed;
+} netem_config_t;
+
+typedef struct
+{
+    int64_t      due;           /* when it may go out (ns) */
+    uint64_t     seq;           /* order of packets due at the same time */
+    unsigned int hold;          /* reorder:  later packets to go out first */
+    size_t       len;
+    char        *data;          /* MAX_IP_PAYLOAD_LEN bytes */
+} netem_packet_t;
+
+struct netem_state
+{
+    netem_config_t  config;
+    char           *spec;
+
+    uint64_t        random;     /* generator state */
+    bool_t          ge_bad;
+    double          tokens;     /* bytes */
+    int64_t         tokens_time;
+    uint64_t        seq;
+
+    netem_packet_t *queue;      /* min-heap on (due, seq) */
+    unsigned int    num_queued;
+    netem_packet_t *held;       /* due, but held back for reordering */
+    unsigned int    num_held;
+    unsigned int    max_packets;
+    char           *free_bufs;  /* spare packet buffers, linked through
+                                 * their first bytes */
+};
+
+static netem_config_t env_config;
+static char *env_spec;
+static pthread_once_t env_once = PTHREAD_ONCE_INIT;
+static uint64_t num_emulated;   /* mysockets given an emulator so far */
+
+
+static int64_t _netem_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* splitmix64, to seed; xorshift64* to draw */
+static uint64_t _netem_mix(uint64_t x)
+{
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return (x ^ (x >> 31)) | 1;
+}
+
+/* a uniformly distributed number in [0, 1) */
+static double _netem_random(struct netem_state *nm)
+{
+    nm->random ^= nm->random >> 12;
+    nm->random ^= nm->random << 25;
+    nm->random ^= nm->random >> 27;
+    return ((nm->random * 0x2545f4914f6cdd1dULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static bool_t _netem_chance(struct netem_state *nm, double p)
+{
+    return p > 0 && _netem_random(nm) < p;
+}
+
+
+/* parse a value with one of the given unit suffixes (each followed by its
+ * multiplier), or the default multiplier if there is none.  returns -1 if
+ * it isn't a non-negative number with a known unit.
+ */
+static double _netem_parse_value(const char *word, double no_unit, ...)
+{
+    va_list units;
+    const char *unit;
+    char *end;
+    double value, scale = -1;
+
+    if (!word || (value = strtod(word, &end)) < 0 || end == word)
+        return -1;
+    if (!*end)
+        return value * no_unit;
+
+    va_start(units, no_unit);
+    while ((unit = va_arg(units, const char *)))
+    {
+        double unit_scale = va_arg(units, double);
+        if (!strcmp(end, unit))
+        {
+            scale = unit_scale;
+            break;
+        }
+    }
+    va_end(units);
+
+    return (scale < 0) ? -1 : value * scale;
+}
+
+static double _netem_percent(const char *word)
+{
+    double p = _netem_parse_value(word, 0.01, "%", 0.01, NULL);
+    return (p > 1) ? -1 : p;
+}
+
+static double _netem_time(const char *word)
+{
+    return _netem_parse_value(word, 1e3, "s", 1e9, "ms", 1e6, "us", 1e3,
+                              "ns", 1.0, NULL);
+}
+
+static double _netem_bytes(const char *word)
+{
+    return _netem_parse_value(word, 1.0, "b", 1.0, "kb", 1024.0,
+                              "mb", 1024.0 * 1024.0, NULL);
+}
+
+static double _netem_count(const char *word)
+{
+    return _netem_parse_value(word, 1.0, NULL);
+}
+
+/* is the next word (if any) a value rather than a keyword? */
+#define NETEM_HAVE_VALUE(words, k, num_words) \
+    ((k) + 1 < (num_words) && \
+     (((words)[(k) + 1][0] >= '0' && (words)[(k) + 1][0] <= '9') || \
+      (words)[(k) + 1][0] == '.'))
+
+/* parse a netem-like description (see above).  returns 0, or -1 if it
+ * isn't understood.
+ */
+static int _netem_parse(const char *spec, netem_config_t *config)
+{
+    char *words[64], *copy, *save = NULL, *word;
+    int num_words = 0, k;
+    double v;
+
+    memset(config, 0, sizeof(*config));
+    config->limit = NETEM_DEFAULT_LIMIT;
+    config->burst = MAX_IP_PAYLOAD_LEN;
+    config->reorder_depth = 1;
 
+    if (!(copy = strdup(spec)))
+        return -1;
+    for (word = strtok_r(copy, " \t,", &save);
+         word && num_words < (int) (sizeof(words) / sizeof(words[0]));
+         word = strtok_r(NULL, " \t,", &save))
+        words[num_words++] = word;
 
-/* helper function for stcp_network_send(); this takes care of unreliable
- * delivery simulation, etc, before passing a packet off to
- * _network_send_packet() for actual transmission over the network.
+#define NETEM_NEXT(value, parse) \
+    if (k + 1 >= num_words || ((value) = parse(words[++k])) < 0) \
+        goto bad
+#define NETEM_NEXT_OPTIONAL(value, parse) \
+    if (NETEM_HAVE_VALUE(words, k, num_words) && \
+        ((value) = parse(words[++k])) < 0) \
+        goto bad
+
+    for (k = 0; k < num_words; ++k)
+    {
+        if (!strcmp(words[k], "loss"))
+        {
+            if (k + 1 < num_words && !strcmp(words[k + 1], "random"))
+                ++k;
+            if (k + 1 < num_words && !strcmp(words[k + 1], "gemodel"))
+            {
+                ++k;
+                config->gemodel = TRUE;
+                NETEM_NEXT(config->ge_p, _netem_percent);
+                config->ge_r = 1 - config->ge_p;
+                config->ge_bad_loss = 1;
+                config->ge_good_loss = 0;
+                NETEM_NEXT_OPTIONAL(config->ge_r, _netem_percent);
+                NETEM_NEXT_OPTIONAL(config->ge_bad_loss, _netem_percent);
+                NETEM_NEXT_OPTIONAL(config->ge_good_loss, _netem_percent);
+            }
+            else
+            {
+                NETEM_NEXT(config->loss, _netem_percent);
+            }
+        }
+        else if (!strcmp(words[k], "duplicate"))
+        {
+            NETEM_NEXT(config->duplicate, _netem_percent);
+        }
+        else if (!strcmp(words[k], "delay"))
+        {
+            NETEM_NEXT(v, _netem_time);
+            config->delay = (int64_t) v;
+            v = 0;
+            NETEM_NEXT_OPTIONAL(v, _netem_time);
+            config->jitter = (int64_t) v;
+        }
+        else if (!strcmp(words[k], "rate"))
+        {
+            if (k + 1 >= num_words ||
+                (v = _netem_parse_value(words[++k], 1.0, "bit", 1.0,
+                                        "kbit", 1e3, "mbit", 1e6,
+                                        "gbit", 1e9, NULL)) <= 0)
+                goto bad;
+            config->rate = v / 8 / 1e9;
+            NETEM_NEXT_OPTIONAL(config->burst, _netem_bytes);
+        }
+        else if (!strcmp(words[k], "limit"))
+        {
+            NETEM_NEXT(v, _netem_count);
+            config->limit = (unsigned int) v;
+        }
+        else if (!strcmp(words[k], "reorder"))
+        {
+            NETEM_NEXT(config->reorder, _netem_percent);
+            v = 1;
+            NETEM_NEXT_OPTIONAL(v, _netem_count);
+            config->reorder_depth = (unsigned int) v;
+        }
+        else if (!strcmp(words[k], "seed"))
+        {
+            NETEM_NEXT(v, _netem_count);
+            config->seed = (uint64_t) v;
+        }
+        else
+        {
+            goto bad;
+        }
+    }
+
+#undef NETEM_NEXT
+#undef NETEM_NEXT_OPTIONAL
+
+    free(copy);
+    return 0;
+
+bad:
+    fprintf(stderr, "%s: can't make sense of \"%s\"\n",
+            NETEM_SPEC_VAR, spec);
+    free(copy);
+    return -1;
+}
+
+static void _netem_read_env(void)
+{
+    const char *spec = getenv(NETEM_SPEC_VAR);
+
+    if (spec && *spec && _netem_parse(spec, &env_config) == 0)
+        env_spec = strdup(spec);
+}
+
+/* start emulating the given path on a mysocket, replacing whatever it was
+ * emulating before (NULL spec:  none)
  */
-int _network_send(mysocket_t sd, const void *buf, size_t len)
+static void _netem_start(network_context_t *ctx, const netem_config_t *config,
+                         const char *spec)
+{
+    struct netem_state *nm;
+
+    _network_netem_close(ctx);
+    if (!spec)
+        return;
+
+    nm = (struct netem_state *) calloc(1, sizeof(*nm));
+    assert(nm);
+    nm->config = *config;
+    nm->spec   = strdup(spec);
+    nm->random = _netem_mix(config->seed +
+                            __atomic_fetch_add(&num_emulated, 1,
+                                               __ATOMIC_SEQ_CST));
+    nm->tokens = config->burst;
+    ctx->netem = nm;
+}
+
+/* set up emulation from the environment, for a new mysocket */
+void _network_netem_init(network_context_t *ctx)
+{
+    assert(ctx);
+
+    PTHREAD_CALL(pthread_once(&env_once, _netem_read_env));
+    if (env_spec)
+        _netem_start(ctx, &env_config, env_spec);
+}
+
+/* emulate the path described by spec (an empty spec:  none).  returns 0,
+ * or -1 if spec isn't understood.
+ */
+int _network_netem_configure(network_context_t *ctx, const char *spec)
+{
+    netem_config_t config;
+
+    assert(ctx && spec);
+
+    if (!*spec)
+    {
+        _netem_start(ctx, NULL, NULL);
+        return 0;
+    }
+    if (_netem_parse(spec, &config) < 0)
+        return -1;
+
+    _netem_start(ctx, &config, spec);
+    return 0;
+}
+
+/* the spec being emulated, or NULL */
+const char *_network_netem_spec(const network_context_t *ctx)
+{
+    assert(ctx);
+    return ctx->netem ? ctx->netem->spec : NULL;
+}
+
+/* a connection accepted on a listening mysocket emulates the same path */
+void _network_netem_inherit(network_context_t *ctx,
+                            const network_context_t *listen_ctx)
+{
+    assert(ctx && listen_ctx);
+
+    if (listen_ctx->netem)
+        _netem_start(ctx, &listen_ctx->netem->config,
+                     listen_ctx->netem->spec);
+}
+
+
+static bool_t _netem_before(const netem_packet_t *a, const netem_packet_t *b)
+{
+    return a->due < b->due || (a->due == b->due && a->seq < b->seq);
+}
+
+static void _netem_push(struct netem_state *nm, const netem_packet_t *pkt)
+{
+    unsigned int k, parent;
+
+    assert(nm->num_queued + nm->num_held < nm->max_packets);
+    for (k = nm->num_queued++; k > 0; k = parent)
+    {
+        parent = (k - 1) / 2;
+        if (!_netem_before(pkt, &nm->queue[parent]))
+            break;
+        nm->queue[k] = nm->queue[parent];
+    }
+    nm->queue[k] = *pkt;
+}
+
+static netem_packet_t _netem_pop(struct netem_state *nm)
+{
+    netem_packet_t top = nm->queue[0], last;
+    unsigned int k, child;
+
+    assert(nm->num_queued > 0);
+    last = nm->queue[--nm->num_queued];
+    for (k = 0; (child = 2 * k + 1) < nm->num_queued; k = child)
+    {
+        if (child + 1 < nm->num_queued &&
+            _netem_before(&nm->queue[child + 1], &nm->queue[child]))
+            ++child;
+        if (!_netem_before(&nm->queue[child], &last))
+            break;
+        nm->queue[k] = nm->queue[child];
+    }
+    if (nm->num_queued > 0)
+        nm->queue[k] = last;
+    return top;
+}
+
+static char *_netem_get_buf(struct netem_state *nm)
+{
+    char *buf;
+
+    if ((buf = nm->free_bufs))
+        memcpy(&nm->free_bufs, buf, sizeof(char *));
+    else
+        buf = (char *) malloc(MAX_IP_PAYLOAD_LEN);
+    assert(buf);
+    return buf;
+}
+
+static void _netem_put_buf(struct netem_state *nm, char *buf)
+{
+    memcpy(buf, &nm->free_bufs, sizeof(char *));
+    nm->free_bufs = buf;
+}
+
+/* send a packet that has made it through, and any held back until it had
+ * gone
+ */
+static void _netem_transmit(network_context_t *ctx, netem_packet_t *pkt)
+{
+    struct netem_state *nm = ctx->netem;
+    unsigned int k;
+
+    _network_send_packet(ctx, pkt->data, pkt->len);
+    _netem_put_buf(nm, pkt->data);
+
+    for (k = 0; k < nm->num_held; )
+    {
+        if (--nm->held[k].hold > 0)
+        {
+            ++k;
+            continue;
+        }
+
+        dprintf("====>network_send:sending a reordered packet\n");
+        _network_send_packet(ctx, nm->held[k].data, nm->held[k].len);
+        _netem_put_buf(nm, nm->held[k].data);
+        nm->held[k] = nm->held[--nm->num_held];
+    }
+}
+
+/* queue a packet to go out at the time the rate and delay allow, or drop
+ * it if too many are already waiting
+ */
+static void _netem_enqueue(network_context_t *ctx, const struct iovec *iov,
+                           int iovcnt, size_t len, int64_t now)
+{
+    struct netem_state *nm = ctx->netem;
+    const netem_config_t *config = &nm->config;
+    netem_packet_t pkt;
+    int64_t depart = now;
+
+    if (nm->num_queued + nm->num_held >= config->limit)
+    {
+        dprintf("====>network_send:queue full, dropping the packet\n");
+        return;
+    }
+
+    if (nm->num_queued + nm->num_held == nm->max_packets)
+    {
+        unsigned int max_packets = nm->max_packets ? 2 * nm->max_packets : 16;
+
+        nm->queue = (netem_packet_t *)
+            realloc(nm->queue, max_packets * sizeof(netem_packet_t));
+        nm->held = (netem_packet_t *)
+            realloc(nm->held, max_packets * sizeof(netem_packet_t));
+        assert(nm->queue && nm->held);
+        nm->max_packets = max_packets;
+    }
+
+    if (config->rate > 0)
+    {
+        /* token bucket.  a packet that finds too few tokens leaves when
+         * enough have come in, and the ones after it wait their turn.
+         */
+        if (now > nm->tokens_time)
+        {
+            nm->tokens += (now - nm->tokens_time) * config->rate;
+            if (nm->tokens > config->burst)
+                nm->tokens = config->burst;
+            nm->tokens_time = now;
+        }
+        if (nm->tokens < len)
+        {
+            nm->tokens_time += (int64_t) ((len - nm->tokens) / config->rate);
+            nm->tokens = len;
+        }
+        nm->tokens -= len;
+        depart = nm->tokens_time;
+    }
+
+    pkt.due = depart + config->delay;
+    if (config->jitter > 0)
+    {
+        pkt.due += (int64_t) ((2 * _netem_random(nm) - 1) * config->jitter);
+        if (pkt.due < depart)
+            pkt.due = depart;
+    }
+    pkt.seq  = nm->seq++;
+    pkt.hold = _netem_chance(nm, config->reorder) ? config->reorder_depth : 0;
+    pkt.len  = len;
+    pkt.data = _netem_get_buf(nm);
+    assert(len <= MAX_IP_PAYLOAD_LEN);
+    (void) _network_gather(pkt.data, iov, iovcnt);
+
+    _netem_push(nm, &pkt);
+}
+
+static void _netem_send(network_context_t *ctx, const struct iovec *iov,
+                        int iovcnt, size_t len)
+{
+    struct netem_state *nm = ctx->netem;
+    const netem_config_t *config = &nm->config;
+    int64_t now = _netem_now();
+    bool_t lost;
+
+    if (config->gemodel)
+    {
+        if (_netem_chance(nm, nm->ge_bad ? config->ge_r : config->ge_p))
+            nm->ge_bad = !nm->ge_bad;
+        lost = _netem_chance(nm, nm->ge_bad ? config->ge_bad_loss :
+                                              config->ge_good_loss);
+    }
+    else
+    {
+        lost = _netem_chance(nm, config->loss);
+    }
+
+    if (lost)
+    {
+        dprintf("====>network_send:dropping the packet\n");
+    }
+    else
+    {
+        _netem_enqueue(ctx, iov, iovcnt, len, now);
+        if (_netem_chance(nm, config->duplicate))
+        {
+            dprintf("====>network_send:duplicating the packet\n");
+            _netem_enqueue(ctx, iov, iovcnt, len, now);
+        }
+    }
+
+    (void) _network_netem_release(ctx);
+}
+
+/* send the emulated packets that are due.  returns the time (as for
+ * clock_gettime(CLOCK_REALTIME), in ns) at which the next will be, or 0 if
+ * there are none waiting.
+ */
+int64_t _network_netem_release(network_context_t *ctx)
+{
+    struct netem_state *nm;
+    netem_packet_t pkt;
+    int64_t now, next = 0;
+    unsigned int k;
+
+    assert(ctx);
+    if (!(nm = ctx->netem) || (!nm->num_queued && !nm->num_held))
+        return 0;
+
+    now = _netem_now();
+    while (nm->num_queued > 0 && nm->queue[0].due <= now)
+    {
+        pkt = _netem_pop(nm);
+        if (pkt.hold > 0 && now < pkt.due + NETEM_MAX_HOLD)
+            nm->held[nm->num_held++] = pkt;
+        else
+            _netem_transmit(ctx, &pkt);
+    }
+
+    for (k = 0; k < nm->num_held; )
+    {
+        if (now >= nm->held[k].due + NETEM_MAX_HOLD)
+        {
+            pkt = nm->held[k];
+            nm->held[k] = nm->held[--nm->num_held];
+            pkt.hold = 0;
+            _netem_transmit(ctx, &pkt);
+            k = 0;  /* that may have released others */
+            continue;
+        }
+        if (!next || nm->held[k].due + NETEM_MAX_HOLD < next)
+            next = nm->held[k].due + NETEM_MAX_HOLD;
+        ++k;
+    }
+
+    if (nm->num_queued > 0 && (!next || nm->queue[0].due < next))
+        next = nm->queue[0].due;
+    return next;
+}
+
+/* stop emulating.  packets still waiting are sent right away, rather than
+ * lost (which could cost the peer a retransmission timeout for the last
+ * ACK of a connection).
+ */
+void _network_netem_close(network_context_t *ctx)
+{
+    struct netem_state *nm;
+    netem_packet_t pkt;
+    char *buf;
+
+    assert(ctx);
+    if (!(nm = ctx->netem))
+        return;
+
+    while (nm->num_queued > 0)
+    {
+        pkt = _netem_pop(nm);
+        _network_send_packet(ctx, pkt.data, pkt.len);
+        _netem_put_buf(nm, pkt.data);
+    }
+    while (nm->num_held > 0)
+    {
+        pkt = nm->held[--nm->num_held];
+        _network_send_packet(ctx, pkt.data, pkt.len);
+        _netem_put_buf(nm, pkt.data);
+    }
+
+    while ((buf = nm->free_bufs))
+    {
+        memcpy(&nm->free_bufs, buf, sizeof(char *));
+        free(buf);
+    }
+    free(nm->queue);
+    free(nm->held);
+    free(nm->spec);
+    free(nm);
+    ctx->netem = NULL;
+}
+
+
+/* helper function for stcp_network_sendv(); this takes care of unreliable
+ * delivery simulation, etc, before passing a packet (in iovcnt pieces) off
+ * to _network_send_packetv() for actual transmission over the network.
+ * only a packet that's kept back is copied.
+ */
+int _network_sendv(mysocket_t sd, const struct iovec *iov, int iovcnt,
+                   size_t len)
 {
     mysock_context_t *sock_ctx = _mysock_get_context(sd);
     network_context_t *ctx;
 
-    assert(sock_ctx && buf);
+    assert(sock_ctx && iov);
     ctx = &sock_ctx->network_state;
 
+    if (ctx->netem)
+    {
+        _netem_send(ctx, iov, iovcnt, len);
+        return len;
+    }
 
     if (!ctx->is_reliable)
     {
@@ -43,14 +708,14 @@ int _network_send(mysocket_t sd, const void *buf, size_t len)
         case 1:
             /* send duplicate */
             dprintf("====>network_send:duplicating the packet\n");
-            _network_send_packet(ctx, buf, len);
+            _network_send_packetv(ctx, iov, iovcnt, len);
             break;
 
         case 2:
             /* store the packet in our queue. Will send it later */
             dprintf("====>network_send:keeping the packet in our queue\n");
             assert(len <= sizeof(ctx->copy_buffer));
-            memcpy(&ctx->copy_buffer, buf, len);
+            (void) _network_gather(ctx->copy_buffer, iov, iovcnt);
             ctx->copy_buf_len = len;
             ctx->copied = TRUE;
             return len;
@@ -68,7 +733,7 @@ int _network_send(mysocket_t sd, const void *buf, size_t len)
             else
             {
                 dprintf("====>network_send:duplicating the packet\n");
-                _network_send_packet(ctx, buf, len);
+                _network_send_packetv(ctx, iov, iovcnt, len);
             }
             return len;
 
@@ -78,7 +743,7 @@ int _network_send(mysocket_t sd, const void *buf, size_t len)
         }
     }
 
-    return _network_send_packet(ctx, buf, len);
+    return _network_send_packetv(ctx, iov, iovcnt, len);
 }
 
 /* helper function for stcp_network_recv() */
@@ -6,9 +6,20 @@
 #define __NETWORK_H__
 
 #include "mysock.h"
+#include "network_io.h"
 
-int _network_send(mysocket_t sd, const void *buf, size_t len);
+int _network_sendv(mysocket_t sd, const struct iovec *iov, int iovcnt,
+                   size_t len);
 int _network_recv(mysocket_t sd, void *dst, size_t max_len);
 
+/* network impairment emulation (STCP_NETEM); see network.c */
+void _network_netem_init(network_context_t *ctx);
+int _network_netem_configure(network_context_t *ctx, const char *spec);
+const char *_network_netem_spec(const network_context_t *ctx);
+void _network_netem_inherit(network_context_t *ctx,
+                            const network_context_t *listen_ctx);
+int64_t _network_netem_release(network_context_t *ctx);
+void _network_netem_close(network_context_t *ctx);
+
 #endif  /* __NETWORK_H__ */
 
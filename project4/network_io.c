@@ -1,6 +1,7 @@
 /* network_io.c:  routines shared amongst all network layer instantiations */
 
 #include <assert.h>
+#include <string.h>
 #include <netinet/in.h>
 #include "mysock_impl.h"
 #include "network_io.h"
@@ -19,13 +20,50 @@
 
 uint32_t _network_get_local_addr(network_context_t *ctx)
 {
+    uint32_t peer_ip;
+
     assert(ctx);
 
     assert(ctx->peer_addr_valid);
     assert(ctx->peer_addr_len > 0);
     assert(ctx->peer_addr.sa_family == AF_INET);
 
-    return _network_get_interface_ip(
-        ((struct sockaddr_in *) &ctx->peer_addr)->sin_addr.s_addr);
+    /* the lookup involves resolving our hostname, so it is only done
+     * again if the peer changes
+     */
+    peer_ip = ((struct sockaddr_in *) &ctx->peer_addr)->sin_addr.s_addr;
+    if (ctx->local_ip_peer != peer_ip || !peer_ip)
+    {
+        ctx->local_ip      = _network_get_interface_ip(peer_ip);
+        ctx->local_ip_peer = peer_ip;
+    }
+
+    return ctx->local_ip;
+}
+
+/* send a packet that is in one piece */
+ssize_t _network_send_packet(network_context_t *ctx,
+                             const void *src, size_t len)
+{
+    struct iovec iov;
+
+    assert(src);
+    iov.iov_base = (void *) src;
+    iov.iov_len  = len;
+    return _network_send_packetv(ctx, &iov, 1, len);
 }
 
+size_t _network_gather(void *dst, const struct iovec *iov, int iovcnt)
+{
+    char *cdst = (char *) dst;
+    int k;
+
+    assert(dst && iov);
+    for (k = 0; k < iovcnt; ++k)
+    {
+        memcpy(cdst, iov[k].iov_base, iov[k].iov_len);
+        cdst += iov[k].iov_len;
+    }
+
+    return cdst - (char *) dst;
+}
@@ -9,10 +9,14 @@
 #ifdef LINUX
 #include <stdint.h>
 #endif
+#include <sys/uio.h>
 #include "mysock.h"
 
 #define MAX_IP_PAYLOAD_LEN 1500
 
+/* most pieces _network_send_packetv() takes for one packet */
+#define NETWORK_IOV_MAX 16
+
 
 struct mysock_context;
 
@@ -31,10 +35,15 @@ typedef struct
     socklen_t       peer_addr_len;
     bool_t          peer_addr_valid;
 
+    /* _network_get_local_addr() result, and the peer it was looked up for */
+    uint32_t        local_ip;
+    uint32_t        local_ip_peer;
+
     /* additional (opaque) data used by underlying I/O implementation */
     void *impl_data;
 
     /* packet reordering/duplication simulation */
+    struct netem_state *netem;  /* impairment emulator (network.c) */
     unsigned int random_seed;
     bool_t       copied;
     char         copy_buffer[MAX_IP_PAYLOAD_LEN];
@@ -65,9 +74,24 @@ uint32_t _network_get_local_addr(network_context_t *ctx);
  */
 uint32_t _network_get_interface_ip(uint32_t peer_addr);
 
-/* send an STCP packet to our peer */
+/* send an STCP packet to our peer.  the packet may be held back, to be
+ * sent along with later ones, until _network_flush() is called; this is
+ * done whenever STCP waits for events, and when the mysocket is closed.
+ */
 ssize_t _network_send_packet(network_context_t *ctx,
                              const void *src, size_t len);
+void _network_flush(network_context_t *ctx);
+
+/* as _network_send_packet(), for a packet of len bytes gathered from
+ * iovcnt (at most NETWORK_IOV_MAX) pieces.  the pieces may be reused as
+ * soon as this returns.
+ */
+ssize_t _network_send_packetv(network_context_t *ctx,
+                              const struct iovec *iov, int iovcnt,
+                              size_t len);
+
+/* copy iovcnt pieces, one after the other, to dst; returns the length */
+size_t _network_gather(void *dst, const struct iovec *iov, int iovcnt);
 
 /* start/stop per-mysocket network receive thread.  the stop() interface
  * must not return until the network receive thread has exited.
@@ -75,6 +99,15 @@ ssize_t _network_send_packet(network_context_t *ctx,
 int _network_start_recv_thread(struct mysock_context *ctx);
 void _network_stop_recv_thread(struct mysock_context *ctx);
 
+/* used instead of the receive thread by the transport worker pool:  the
+ * descriptor that becomes readable when packets arrive for the mysocket,
+ * and a non-blocking read of every packet already waiting there into its
+ * network_recv_queue.  the latter returns -1 once the peer has gone away
+ * (or on error), and 0 otherwise.
+ */
+int _network_get_fd(network_context_t *ctx);
+int _network_recv_ready(struct mysock_context *ctx);
+
 /* called when a SYN packet is dequeued on a passive socket, to update any
  * state in the network layer.
  */
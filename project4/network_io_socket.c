@@ -76,6 +76,14 @@ int _network_get_port(network_context_t *ctx)
     return sin.sin_port;
 }
 
+/* the socket the transport worker pool waits on for input */
+int _network_get_fd(network_context_t *ctx)
+{
+    assert(ctx);
+    VERIFY_SOCKET(ctx);
+    return GET_SOCKET(ctx);
+}
+
 /* return the address associated with the interface over which packets
  * to/from the given peer (network byte order) are delivered.  this is
  * completely broken for multi-homed hosts; it should consult the local
@@ -160,6 +168,13 @@ int _network_start_recv_thread(mysock_context_t *ctx)
         return -1;
     }
 
+    if (pipe(net_ctx->exit_pipe) < 0)
+    {
+        perror("pipe");
+        assert(0);
+        return -1;
+    }
+
     net_ctx->recv_thread = _mysock_create_thread(network_recv_thread_func,
                                                  ctx, FALSE);
     net_ctx->recv_thread_started = TRUE;
@@ -292,6 +307,19 @@ static void *network_recv_thread_func(void *arg_ptr)
         if (done)
             break;
 
+        if (!ctx->listening)
+        {
+            /* take everything that has arrived, as whole packets, straight
+             * onto this context's receive queue
+             */
+            if (_network_recv_ready(ctx) < 0)
+            {
+                DEBUG_LOG(("_network_recv_ready failed, errno=%d\n", errno));
+                break;
+            }
+            continue;
+        }
+
         /* block, waiting for network input.  (the system call will be
          * interrupted by the transport layer thread if we're to exit).
          */
@@ -299,27 +327,25 @@ static void *network_recv_thread_func(void *arg_ptr)
                                                packet_buf,
                                                sizeof(packet_buf))) <= 0)
         {
+            /* a datagram socket may have nothing to read after all, or
+             * report an ICMP error for something sent earlier
+             */
+            if (bytes_read < 0 &&
+                (errno == EINTR || errno == EAGAIN || errno == ECONNREFUSED))
+                continue;
+
             DEBUG_LOG(("_network_recv_packet interrupted, errno=%d\n", errno));
             break;
         }
 
         assert(bytes_read <= (int)sizeof(packet_buf));
-        if (ctx->listening)
-        {
-            /* if the socket was accepting new connections, incoming
-             * packets need to be demultiplexed and dispatched to the
-             * appropriate mysocket context.
-             */
-            _mysock_enqueue_connection(ctx, packet_buf, bytes_read,
-                                       &ctx->network_state.peer_addr,
-                                       ctx->network_state.peer_addr_len, NULL);
-        }
-        else
-        {
-            /* enqueue the packet directly for this context */
-            _mysock_enqueue_buffer(ctx, &ctx->network_recv_queue,
-                                   packet_buf, bytes_read);
-        }
+
+        /* packets on a listening socket need to be demultiplexed and
+         * dispatched to the appropriate mysocket context.
+         */
+        _mysock_enqueue_connection(ctx, packet_buf, bytes_read,
+                                   &ctx->network_state.peer_addr,
+                                   ctx->network_state.peer_addr_len, NULL);
     }
 
     return NULL;
@@ -333,6 +359,8 @@ _network_alloc_context_socket(int socket_type, size_t ctx_len)
 
     assert(ctx);
 
+    /* the exit pipe is only created along with a receive thread */
+    ctx->exit_pipe[0] = ctx->exit_pipe[1] = -1;
 
     /* create the actual socket used for communication to the peer */
     if ((ctx->socket = socket(AF_INET, socket_type, 0)) < 0)
@@ -343,15 +371,6 @@ _network_alloc_context_socket(int socket_type, size_t ctx_len)
         ctx = NULL;
     }
 
-    ctx->exit_pipe[0] = ctx->exit_pipe[1] = -1;
-    if (pipe(ctx->exit_pipe) < 0)
-    {
-        perror("pipe");
-        assert(0);
-        _network_destroy_context_socket(ctx);
-        ctx = NULL;
-    }
-
     return ctx;
 }
 
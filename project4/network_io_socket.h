@@ -28,7 +28,34 @@ typedef struct
     int                exit_pipe[2];    /* used to wake up read thread */
 } network_context_socket_t;
 
-typedef network_context_socket_t network_context_socket_udp_t;
+/* flags for sending packets.  a transport pool worker runs many
+ * connections, so it mustn't block on any one socket:  a packet that
+ * doesn't fit in the socket buffer is lost instead, as it might be in the
+ * network, and STCP retransmits it as usual.
+ */
+#ifdef TRANSPORT_POOL
+#define NETWORK_SEND_FLAGS MSG_DONTWAIT
+#else
+#define NETWORK_SEND_FLAGS 0
+#endif
+
+/* packets held back by the UDP network layer until _network_flush() */
+#define UDP_SEND_BATCH 16
+
+typedef struct
+{
+    network_context_socket_t base;
+
+    /* additional state required by UDP-based network layer */
+    mysock_context_t *sock_ctx;
+    bool_t            connected;
+
+    /* packets sent since the last flush, back to back in send_buf */
+    char             *send_buf;
+    size_t            send_len;
+    uint16_t          send_lens[UDP_SEND_BATCH];
+    unsigned int      send_count;
+} network_context_socket_udp_t;
 
 typedef struct
 {
@@ -39,6 +66,19 @@ typedef struct
     socket_t          new_socket;   /* temporary result of accept() */
     pthread_mutex_t   connect_lock;
     bool_t            connected;
+
+    /* bytes read by _network_recv_ready() that don't yet make up a whole
+     * packet
+     */
+    char             *recv_buf;
+    size_t            recv_len;
+
+    /* what a non-blocking send left of a packet (and its length); the
+     * peer would lose track of where packets start without it, so it goes
+     * before anything else
+     */
+    char             *send_rest;
+    size_t            send_rest_off, send_rest_len;
 } network_context_socket_tcp_t;
 
 
@@ -5,9 +5,13 @@
 #include <assert.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
 #include <stdlib.h>
-#include <alloca.h>
+#include <string.h>
+#include <errno.h>
 #include "mysock_impl.h"
 #include "network_io.h"
 #include "network_io_socket.h"
@@ -15,10 +19,18 @@
 
 #define MAX_NUM_PENDING_CONNECTIONS 10
 
+/* room for several packets, each behind its 16-bit length, for
+ * _network_recv_ready()
+ */
+#define TCP_RECV_BUF_SIZE (16 * 1024)
+
 typedef ssize_t (*io_func_t)(socket_t sd, void *buf, size_t count);
 
 static int _tcp_io(socket_t, void *, size_t, io_func_t);
+static int _tcp_send(network_context_socket_tcp_t *, struct iovec *, int);
+static int _tcp_send_rest(network_context_socket_tcp_t *, int);
 static int _tcp_connect(network_context_t *ctx);
+static void _tcp_set_nodelay(socket_t tcp_sd);
 
 
 /* a few words about using TCP to emulate the underlying datagram
@@ -33,6 +45,18 @@ static int _tcp_connect(network_context_t *ctx);
  *   - the passive side dispatches the SYN packet to the right STCP
  *     context, and updates the new context's TCP socket to be that of the
  *     newly accepted (real TCP) connection.
+ *   - each packet goes out as a 16-bit length followed by the packet, in a
+ *     single sendmsg().  Nagle is turned off on every connection: STCP does
+ *     its own windowing, so holding back a small segment until the previous
+ *     one is acknowledged only adds a delayed-ACK timeout to each exchange.
+ *   - in the transport pool, sends don't block (NETWORK_SEND_FLAGS):  a
+ *     packet that finds the socket buffer full is lost.  one that only
+ *     partly fits has to be finished, though, or the peer would take the
+ *     middle of a packet for a length; the rest is sent before the next
+ *     packet (which is lost if the rest still doesn't fit), or at close.
+ *   - the receiver reads as much as has arrived into recv_buf and splits
+ *     it back into packets (_network_recv_ready()), rather than issuing
+ *     separate reads for each length and packet.
  */
 
 
@@ -79,7 +103,14 @@ void _network_close(network_context_t *ctx)
         closesocket(tcp_io_ctx->new_socket);
     }
 
+    /* finish off a packet, in the closing thread, where blocking holds up
+     * no one else
+     */
+    (void) _tcp_send_rest(tcp_io_ctx, 0);
+    free(tcp_io_ctx->send_rest);
+
     PTHREAD_CALL(pthread_mutex_destroy(&tcp_io_ctx->connect_lock));
+    free(tcp_io_ctx->recv_buf);
 
     _network_close_socket(ctx);
 }
@@ -131,14 +162,17 @@ void _network_update_passive_state(network_context_t *new_ctx,
 }
 
 
-/* send the given packet to the peer */
-ssize_t _network_send_packet(network_context_t *ctx,
-                             const void *src, size_t len)
+/* send the given packet to the peer, behind its length */
+ssize_t _network_send_packetv(network_context_t *ctx,
+                              const struct iovec *iov, int iovcnt,
+                              size_t len)
 {
     network_context_socket_tcp_t *tcp_io_ctx;
+    struct iovec vec[NETWORK_IOV_MAX + 1];
     uint16_t packet_len;    /* network byte order */
 
-    assert(ctx && src);
+    assert(ctx && iov);
+    assert(iovcnt > 0 && iovcnt <= NETWORK_IOV_MAX);
     assert(ctx->peer_addr_len > 0);
 
     tcp_io_ctx = (network_context_socket_tcp_t *) ctx->impl_data;
@@ -151,93 +185,161 @@ ssize_t _network_send_packet(network_context_t *ctx,
         return -1;
 
     packet_len = htons(len);
-    if (_tcp_io(GET_SOCKET(ctx), &packet_len, sizeof(packet_len),
-                (io_func_t) write) < 0 ||
-        _tcp_io(GET_SOCKET(ctx), (void *) src, len, (io_func_t) write) < 0)
+    vec[0].iov_base = &packet_len;
+    vec[0].iov_len  = sizeof(packet_len);
+    memcpy(&vec[1], iov, iovcnt * sizeof(struct iovec));
+    if (_tcp_send(tcp_io_ctx, vec, iovcnt + 1) < 0)
         return -1;
 
     return len;
 }
 
-/* read a packet from the peer */
+/* packets are written as they are sent, and Nagle is off, so there is
+ * nothing to flush
+ */
+void _network_flush(network_context_t *ctx)
+{
+    assert(ctx);
+}
+
+/* accept a connection on a listening socket, and read the SYN packet that
+ * the peer sends first on it.  packets on established connections are
+ * read by _network_recv_ready() instead.
+ */
 ssize_t _network_recv_packet(network_context_t *ctx, void *dst, size_t max_len)
 {
     network_context_socket_tcp_t *tcp_io_ctx;
     uint16_t packet_len;
-    socket_t io_socket;
+    socket_t tmp_sd;
     int rc;
 
     assert(ctx && dst);
 
     tcp_io_ctx = (network_context_socket_tcp_t *) ctx->impl_data;
     assert(tcp_io_ctx);
-    assert(tcp_io_ctx->sock_ctx);
+    assert(tcp_io_ctx->sock_ctx && tcp_io_ctx->sock_ctx->listening);
 
     VERIFY_SOCKET(ctx);
-    io_socket = tcp_io_ctx->base.socket;
-
-    if (tcp_io_ctx->sock_ctx->is_active && _tcp_connect(ctx) < 0)
-        return -1;
 
-    if (tcp_io_ctx->sock_ctx->listening/* ||
-        (tcp_io_ctx->sock_ctx->is_active && !tcp_io_ctx->connected)*/)
+    ctx->peer_addr_len = sizeof(ctx->peer_addr);
+    if ((tmp_sd = accept(GET_SOCKET(ctx),
+                         &ctx->peer_addr,
+                         &ctx->peer_addr_len)) < 0)
     {
-        socket_t tmp_sd;
-
-        ctx->peer_addr_len = sizeof(ctx->peer_addr);
-        if ((tmp_sd = accept(GET_SOCKET(ctx),
-                             &ctx->peer_addr,
-                             &ctx->peer_addr_len)) < 0)
-        {
-            perror("accept (network_io_tcp)");
-            return tmp_sd;
-        }
-
-        DEBUG_LOG(("accepted from peer, tmp_sd=%d...\n", (int) tmp_sd));
-
-        /* keep listening socket open for futher connection requests */
-        /* we will not reenter this function until this SYN packet has
-         * been dispatched to the right context, and that context's
-         * socket updated to be 'new_socket'
-         */
-        assert(tcp_io_ctx->new_socket == -1);
-        tcp_io_ctx->new_socket = tmp_sd;
-        io_socket = tmp_sd;
+        perror("accept (network_io_tcp)");
+        return tmp_sd;
     }
 
+    DEBUG_LOG(("accepted from peer, tmp_sd=%d...\n", (int) tmp_sd));
     DEBUG_PEER(ctx);
 
-#ifdef DEBUG
-    if (getpeername(io_socket, &ctx->peer_addr, &ctx->peer_addr_len) < 0)
+    if ((rc = _tcp_io(tmp_sd, &packet_len, sizeof(packet_len), read)) <= 0 ||
+        (packet_len = ntohs(packet_len)) > max_len ||
+        (rc = _tcp_io(tmp_sd, dst, packet_len, read)) <= 0)
     {
-        DEBUG_LOG(("getpeername failed (errno=%d)\n", errno));
+        /* the peer went away, or isn't speaking our framing.  drop this
+         * connection, but keep the listening socket going.
+         */
+        DEBUG_LOG(("couldn't read SYN packet: %d\n", rc));
+        closesocket(tmp_sd);
+        errno = EAGAIN;
         return -1;
     }
-#endif
 
-    if ((rc = _tcp_io(io_socket, &packet_len, sizeof(packet_len), read)) <= 0)
-    {
-        DEBUG_LOG(("couldn't read packet len: %d\n", rc));
-        return rc;
-    }
+    _tcp_set_nodelay(tmp_sd);
+
+    /* keep listening socket open for futher connection requests */
+    /* we will not reenter this function until this SYN packet has
+     * been dispatched to the right context, and that context's
+     * socket updated to be 'new_socket'
+     */
+    assert(tcp_io_ctx->new_socket == -1);
+    tcp_io_ctx->new_socket = tmp_sd;
+
+    return packet_len;
+}
+
+
+/* read whatever has arrived on the connection without blocking, and queue
+ * every complete packet for STCP.  a partial packet stays in recv_buf
+ * until the rest of it arrives.
+ */
+int _network_recv_ready(mysock_context_t *sock_ctx)
+{
+    network_context_socket_tcp_t *tcp_io_ctx;
+    uint16_t packet_len;
+    size_t offset;
+    ssize_t rc;
+    bool_t full;
+
+    assert(sock_ctx && !sock_ctx->listening);
 
-    packet_len = ntohs(packet_len);
-    if ((rc = _tcp_io(io_socket, dst, MIN(packet_len, max_len), read)) <= 0)
+    tcp_io_ctx = (network_context_socket_tcp_t *)
+        sock_ctx->network_state.impl_data;
+    assert(tcp_io_ctx);
+    VERIFY_SOCKET((&sock_ctx->network_state));
+
+    /* the receive thread may get here before the first send has connected
+     * the socket
+     */
+    if (sock_ctx->is_active && _tcp_connect(&sock_ctx->network_state) < 0)
+        return -1;
+
+    if (!tcp_io_ctx->recv_buf)
     {
-        DEBUG_LOG(("couldn't read packet: %d\n", rc));
-        return rc;
+        tcp_io_ctx->recv_buf = (char *) malloc(TCP_RECV_BUF_SIZE);
+        assert(tcp_io_ctx->recv_buf);
     }
 
-    if (packet_len > max_len)
+    for (;;)
     {
-        /* discard unread remainder of packet */
-        char *dummy = (char *) alloca(packet_len - max_len);
-        (void) _tcp_io(io_socket, dummy, packet_len - max_len, read);
-    }
+        rc = recv(tcp_io_ctx->base.socket,
+                  tcp_io_ctx->recv_buf + tcp_io_ctx->recv_len,
+                  TCP_RECV_BUF_SIZE - tcp_io_ctx->recv_len, MSG_DONTWAIT);
+        if (rc < 0 && errno == EINTR)
+            continue;
+        if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        if (rc <= 0)
+        {
+            DEBUG_LOG(("_network_recv_ready: connection gone (%d)\n",
+                       (int) rc));
+            return -1;
+        }
+        tcp_io_ctx->recv_len += rc;
+        full = (tcp_io_ctx->recv_len == TCP_RECV_BUF_SIZE);
 
-    return packet_len;
-}
+        for (offset = 0;
+             tcp_io_ctx->recv_len - offset >= sizeof(packet_len);
+             offset += sizeof(packet_len) + packet_len)
+        {
+            memcpy(&packet_len, tcp_io_ctx->recv_buf + offset,
+                   sizeof(packet_len));
+            packet_len = ntohs(packet_len);
+            if (packet_len > MAX_IP_PAYLOAD_LEN)
+            {
+                DEBUG_LOG(("_network_recv_ready: bad packet length %u\n",
+                           packet_len));
+                return -1;
+            }
+            if (tcp_io_ctx->recv_len - offset <
+                sizeof(packet_len) + packet_len)
+                break;
+
+            _mysock_enqueue_buffer(sock_ctx, &sock_ctx->network_recv_queue,
+                                   tcp_io_ctx->recv_buf + offset +
+                                   sizeof(packet_len), packet_len);
+        }
+
+        tcp_io_ctx->recv_len -= offset;
+        memmove(tcp_io_ctx->recv_buf, tcp_io_ctx->recv_buf + offset,
+                tcp_io_ctx->recv_len);
 
+        /* a short read means the socket is drained */
+        if (!full)
+            return 0;
+    }
+}
 
 /* read/write count bytes into/from buf */
 static int _tcp_io(socket_t tcp_sd, void *buf, size_t count, io_func_t io_func)
@@ -264,6 +366,107 @@ static int _tcp_io(socket_t tcp_sd, void *buf, size_t count, io_func_t io_func)
     return count;
 }
 
+/* write the pieces of a packet (and its length) with one system call.
+ * without NETWORK_SEND_FLAGS, short writes are finished off; with them
+ * (in the transport pool), a packet the socket buffer has no room for is
+ * lost, and the rest of one it has room for only part of is kept for
+ * later (send_rest).  iov is used up.  returns 0, or -1 on error.
+ */
+static int _tcp_send(network_context_socket_tcp_t *tcp_io_ctx,
+                     struct iovec *iov, int iov_count)
+{
+    struct msghdr msg;
+    bool_t started = FALSE;
+
+    /* the rest of an earlier packet goes first; this one is lost if that
+     * still doesn't fit
+     */
+    if (_tcp_send_rest(tcp_io_ctx, NETWORK_SEND_FLAGS) < 0)
+        return -1;
+    if (tcp_io_ctx->send_rest_len > 0)
+        return 0;
+
+    memset(&msg, 0, sizeof(msg));
+    while (iov_count > 0)
+    {
+        ssize_t rc;
+
+        msg.msg_iov    = iov;
+        msg.msg_iovlen = iov_count;
+        if ((rc = sendmsg(tcp_io_ctx->base.socket, &msg,
+                          NETWORK_SEND_FLAGS)) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            DEBUG_LOG(("_tcp_send: errno=%d\n", errno));
+            return -1;
+        }
+        started = TRUE;
+
+        for (; iov_count > 0 && (size_t) rc >= iov->iov_len; --iov_count)
+            rc -= (iov++)->iov_len;
+        if (iov_count > 0)
+        {
+            iov->iov_base = (char *) iov->iov_base + rc;
+            iov->iov_len -= rc;
+        }
+    }
+
+    if (iov_count > 0 && started)
+    {
+        if (!tcp_io_ctx->send_rest)
+        {
+            tcp_io_ctx->send_rest =
+                (char *) malloc(sizeof(uint16_t) + MAX_IP_PAYLOAD_LEN);
+            assert(tcp_io_ctx->send_rest);
+        }
+        tcp_io_ctx->send_rest_off = 0;
+        tcp_io_ctx->send_rest_len =
+            _network_gather(tcp_io_ctx->send_rest, iov, iov_count);
+    }
+    return 0;
+}
+
+/* send what _tcp_send() kept of a packet.  returns 0 (send_rest_len is
+ * left non-zero if the socket buffer still hasn't room for all of it), or
+ * -1 on error.
+ */
+static int _tcp_send_rest(network_context_socket_tcp_t *tcp_io_ctx,
+                          int flags)
+{
+    while (tcp_io_ctx->send_rest_len > 0)
+    {
+        ssize_t rc;
+
+        if ((rc = send(tcp_io_ctx->base.socket,
+                       tcp_io_ctx->send_rest + tcp_io_ctx->send_rest_off,
+                       tcp_io_ctx->send_rest_len, flags)) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            DEBUG_LOG(("_tcp_send_rest: errno=%d\n", errno));
+            return -1;
+        }
+        tcp_io_ctx->send_rest_off += rc;
+        tcp_io_ctx->send_rest_len -= rc;
+    }
+    return 0;
+}
+
+static void _tcp_set_nodelay(socket_t tcp_sd)
+{
+    int on = 1;
+
+    if (setsockopt(tcp_sd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) < 0)
+    {
+        DEBUG_LOG(("couldn't set TCP_NODELAY (errno=%d)\n", errno));
+    }
+}
+
 static int _tcp_connect(network_context_t *ctx)
 {
     network_context_socket_tcp_t *tcp_io_ctx;
@@ -291,6 +494,7 @@ static int _tcp_connect(network_context_t *ctx)
             return -1;
         }
 
+        _tcp_set_nodelay(GET_SOCKET(ctx));
         tcp_io_ctx->connected = TRUE;
     }
     PTHREAD_CALL(pthread_mutex_unlock(&tcp_io_ctx->connect_lock));
@@ -0,0 +1,494 @@
+/* network_io_udp.c: UDP instantiation of the underlying unreliable
+ * datagram service.
+ */
+
+#include <assert.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "mysock_impl.h"
+#include "network_io.h"
+#include "network_io_socket.h"
+
+
+/* datagrams read by one recvmmsg() in _network_recv_ready() */
+#define UDP_RECV_BATCH 32
+
+/* UDP generic segmentation offload (Linux 4.18 and later):  a run of
+ * equal-sized packets is handed to the kernel as one buffer, along with
+ * the packet size, and split into datagrams further down the stack.
+ */
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#define UDP_GSO_MAX_SEGMENTS 64
+#define UDP_GSO_MAX_BYTES    65000
+
+#if defined(LINUX) && defined(MSG_WAITFORONE)
+#define UDP_MMSG 1  /* recvmmsg()/sendmmsg() are available */
+#endif
+
+typedef struct
+{
+    struct mmsghdr msgs[UDP_RECV_BATCH];
+    struct iovec   iovs[UDP_RECV_BATCH];
+    char           bufs[UDP_RECV_BATCH][MAX_IP_PAYLOAD_LEN];
+} udp_recv_batch_t;
+
+static int _udp_connect(network_context_t *ctx);
+#ifdef UDP_MMSG
+static void _udp_recv_batch_key_create(void);
+#endif
+static void _udp_send_batch(network_context_socket_udp_t *udp_io_ctx);
+
+/* cleared once the kernel turns down a GSO send */
+static bool_t udp_gso_ok = TRUE;
+
+#ifdef UDP_MMSG
+/* each thread's udp_recv_batch_t, freed when the thread exits */
+static pthread_key_t  udp_recv_batch_key;
+static pthread_once_t udp_recv_batch_once = PTHREAD_ONCE_INIT;
+#endif
+
+
+/* a few words about the UDP network layer...
+ *
+ *   - each mysocket has a UDP socket, which is connect()ed to the peer
+ *     once it's known, so it only receives the peer's datagrams.
+ *   - a listening socket receives the SYNs of new connections.  the
+ *     socket of each new connection is bound to the same local port
+ *     (SO_REUSEADDR) and connected to the peer; being more specific, it
+ *     gets the peer's later datagrams in place of the listening socket.
+ *   - packets STCP sends are collected until it next waits for events
+ *     (_network_flush()), and then go out in one sendmmsg().  if several
+ *     have the same size, as a stream of full segments does, they go as
+ *     a single GSO buffer.
+ *   - the transport worker pool reads a connection's datagrams with
+ *     recvmmsg(), up to UDP_RECV_BATCH at a time.
+ *
+ * nothing here hides loss, duplication or reordering from STCP.
+ */
+
+
+/* initialise the network subsystem.  this function should be called before
+ * making use of any of the other network layer functions.
+ */
+int _network_init(mysock_context_t *sock_ctx, network_context_t *net_ctx)
+{
+    network_context_socket_udp_t *udp_io_ctx;
+    int rc;
+
+    assert(sock_ctx && net_ctx);
+    if ((rc = _network_init_socket(sock_ctx,
+                                   net_ctx,
+                                   SOCK_DGRAM,
+                                   sizeof(network_context_socket_udp_t))) < 0)
+        return rc;
+
+    udp_io_ctx = (network_context_socket_udp_t *) net_ctx->impl_data;
+    assert(udp_io_ctx);
+
+    udp_io_ctx->sock_ctx = sock_ctx;
+    udp_io_ctx->connected = FALSE;
+
+    return 0;
+}
+
+void _network_close(network_context_t *ctx)
+{
+    network_context_socket_udp_t *udp_io_ctx;
+
+    assert(ctx);
+
+    udp_io_ctx = (network_context_socket_udp_t *) ctx->impl_data;
+    assert(udp_io_ctx);
+
+    /* e.g. the ACK of the peer's FIN */
+    _network_flush(ctx);
+    free(udp_io_ctx->send_buf);
+
+    _network_close_socket(ctx);
+}
+
+/* set the local port associated with the given network layer context */
+int _network_bind(network_context_t *ctx, struct sockaddr *addr, int addrlen)
+{
+    assert(ctx && addr);
+    VERIFY_SOCKET(ctx);
+
+    return _network_bind_socket(ctx, addr, addrlen);
+}
+
+/* connections accepted on this socket share its port.  (only listening
+ * sockets allow this; two active sockets given the same ephemeral port
+ * would be indistinguishable to the peer.)
+ */
+int _network_listen(network_context_t *ctx, int backlog)
+{
+    int on = 1;
+
+    assert(ctx);
+    VERIFY_SOCKET(ctx);
+
+    return setsockopt(GET_SOCKET(ctx), SOL_SOCKET, SO_REUSEADDR,
+                      &on, sizeof(on));
+}
+
+void _network_update_passive_state(network_context_t *new_ctx,
+                                   network_context_t *accept_ctx,
+                                   void *user_data,
+                                   const void *syn_packet, size_t syn_len)
+{
+    struct sockaddr_in sin;
+    socklen_t sin_len = sizeof(sin);
+    int on = 1;
+
+    assert(new_ctx && accept_ctx && syn_packet);
+    assert(!user_data);
+    assert(new_ctx->peer_addr_valid);
+
+    /* the new connection's socket takes over the listening socket's port,
+     * for datagrams from this peer only
+     */
+    if (getsockname(GET_SOCKET(accept_ctx), (struct sockaddr *) &sin,
+                    &sin_len) < 0 ||
+        setsockopt(GET_SOCKET(new_ctx), SOL_SOCKET, SO_REUSEADDR,
+                   &on, sizeof(on)) < 0 ||
+        bind(GET_SOCKET(new_ctx), (struct sockaddr *) &sin, sin_len) < 0 ||
+        _udp_connect(new_ctx) < 0)
+    {
+        /* STCP's SYNACK will fail to go out, and the peer will give up */
+        perror("_network_update_passive_state (network_io_udp)");
+    }
+}
+
+
+/* queue the given packet for the peer.  it's sent by _network_flush(), or
+ * at once if there are already UDP_SEND_BATCH packets waiting.
+ */
+ssize_t _network_send_packetv(network_context_t *ctx,
+                              const struct iovec *iov, int iovcnt,
+                              size_t len)
+{
+    network_context_socket_udp_t *udp_io_ctx;
+
+    assert(ctx && iov);
+    assert(ctx->peer_addr_len > 0);
+    assert(len <= MAX_IP_PAYLOAD_LEN);
+
+    udp_io_ctx = (network_context_socket_udp_t *) ctx->impl_data;
+    assert(udp_io_ctx);
+
+    VERIFY_SOCKET(ctx);
+    DEBUG_PEER(ctx);
+
+    if (_udp_connect(ctx) < 0)
+        return -1;
+
+    if (!udp_io_ctx->send_buf)
+    {
+        udp_io_ctx->send_buf =
+            (char *) malloc(UDP_SEND_BATCH * MAX_IP_PAYLOAD_LEN);
+        assert(udp_io_ctx->send_buf);
+    }
+
+    /* the pieces are copied, as they may be reused before the batch goes
+     * out (a segment acknowledged while its retransmission waits here)
+     */
+    (void) _network_gather(udp_io_ctx->send_buf + udp_io_ctx->send_len,
+                           iov, iovcnt);
+    udp_io_ctx->send_len += len;
+    udp_io_ctx->send_lens[udp_io_ctx->send_count++] = (uint16_t) len;
+
+    if (udp_io_ctx->send_count == UDP_SEND_BATCH)
+        _udp_send_batch(udp_io_ctx);
+
+    return len;
+}
+
+/* send whatever _network_send_packetv() has queued */
+void _network_flush(network_context_t *ctx)
+{
+    network_context_socket_udp_t *udp_io_ctx;
+
+    assert(ctx);
+
+    udp_io_ctx = (network_context_socket_udp_t *) ctx->impl_data;
+    assert(udp_io_ctx);
+
+    if (udp_io_ctx->send_count > 0)
+        _udp_send_batch(udp_io_ctx);
+}
+
+/* read a packet from the peer.  on a listening socket, this may be any
+ * peer; peer_addr is set to whichever it was.
+ */
+ssize_t _network_recv_packet(network_context_t *ctx, void *dst, size_t max_len)
+{
+    network_context_socket_udp_t *udp_io_ctx;
+    ssize_t rc;
+
+    assert(ctx && dst);
+
+    udp_io_ctx = (network_context_socket_udp_t *) ctx->impl_data;
+    assert(udp_io_ctx);
+    VERIFY_SOCKET(ctx);
+
+    /* the receive thread only calls this once poll() says there's a
+     * datagram; don't block if it's gone again
+     */
+    ctx->peer_addr_len = sizeof(ctx->peer_addr);
+    rc = recvfrom(GET_SOCKET(ctx), dst, max_len, MSG_DONTWAIT,
+                  &ctx->peer_addr, &ctx->peer_addr_len);
+    if (rc < 0)
+    {
+        DEBUG_LOG(("recvfrom (network_io_udp): errno=%d\n", errno));
+        return rc;
+    }
+
+    DEBUG_PEER(ctx);
+    return rc;
+}
+
+
+/* read every datagram waiting on the connection without blocking, and
+ * queue them for STCP.  this never reports the peer as gone; an ICMP error
+ * for an earlier datagram just means that datagram was lost.
+ */
+int _network_recv_ready(mysock_context_t *sock_ctx)
+{
+#ifdef UDP_MMSG
+    udp_recv_batch_t *batch;
+    int n, k;
+#else
+    char packet_buf[MAX_IP_PAYLOAD_LEN];
+#endif
+    ssize_t rc;
+
+    assert(sock_ctx && !sock_ctx->listening);
+    VERIFY_SOCKET((&sock_ctx->network_state));
+
+#ifdef UDP_MMSG
+    /* one set of buffers per transport worker (or, without the pool, per
+     * receive thread); the datagrams are copied into network_recv_queue
+     * at once
+     */
+    PTHREAD_CALL(pthread_once(&udp_recv_batch_once,
+                              _udp_recv_batch_key_create));
+    batch = (udp_recv_batch_t *) pthread_getspecific(udp_recv_batch_key);
+    if (!batch)
+    {
+        batch = (udp_recv_batch_t *) malloc(sizeof(*batch));
+        assert(batch);
+        PTHREAD_CALL(pthread_setspecific(udp_recv_batch_key, batch));
+    }
+
+    for (;;)
+    {
+        for (k = 0; k < UDP_RECV_BATCH; ++k)
+        {
+            batch->iovs[k].iov_base = batch->bufs[k];
+            batch->iovs[k].iov_len  = MAX_IP_PAYLOAD_LEN;
+            memset(&batch->msgs[k].msg_hdr, 0, sizeof(struct msghdr));
+            batch->msgs[k].msg_hdr.msg_iov    = &batch->iovs[k];
+            batch->msgs[k].msg_hdr.msg_iovlen = 1;
+        }
+
+        n = recvmmsg(GET_SOCKET((&sock_ctx->network_state)),
+                     batch->msgs, UDP_RECV_BATCH, MSG_DONTWAIT, NULL);
+        if (n < 0)
+        {
+            rc = n;
+            break;
+        }
+
+        for (k = 0; k < n; ++k)
+        {
+            if (batch->msgs[k].msg_hdr.msg_flags & MSG_TRUNC)
+                continue;   /* not one of ours */
+            _mysock_enqueue_buffer(sock_ctx, &sock_ctx->network_recv_queue,
+                                   batch->bufs[k], batch->msgs[k].msg_len);
+        }
+
+        /* a short batch means the socket is drained */
+        if (n < UDP_RECV_BATCH)
+            return 0;
+    }
+#else
+    while ((rc = recv(GET_SOCKET((&sock_ctx->network_state)), packet_buf,
+                      sizeof(packet_buf), MSG_DONTWAIT)) >= 0)
+    {
+        _mysock_enqueue_buffer(sock_ctx, &sock_ctx->network_recv_queue,
+                               packet_buf, rc);
+    }
+#endif
+
+    assert(rc < 0);
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR &&
+        errno != ECONNREFUSED)
+    {
+        DEBUG_LOG(("_network_recv_ready (network_io_udp): errno=%d\n", errno));
+    }
+    return 0;
+}
+
+
+/* connect the socket to the peer, once.  datagrams can then be sent
+ * without an address, and only the peer's are received.
+ */
+static int _udp_connect(network_context_t *ctx)
+{
+    network_context_socket_udp_t *udp_io_ctx;
+
+    assert(ctx);
+
+    udp_io_ctx = (network_context_socket_udp_t *) ctx->impl_data;
+    assert(udp_io_ctx);
+
+    if (!udp_io_ctx->connected)
+    {
+        assert(ctx->peer_addr_valid);
+        assert(ctx->peer_addr.sa_family == AF_INET);
+        assert(((struct sockaddr_in *) &ctx->peer_addr)->sin_port > 0);
+
+        if (connect(GET_SOCKET(ctx), &ctx->peer_addr,
+                    sizeof(struct sockaddr_in)) < 0)
+        {
+            perror("connect (_udp_connect)");
+            return -1;
+        }
+
+        udp_io_ctx->connected = TRUE;
+    }
+
+    return 0;
+}
+
+#ifdef UDP_MMSG
+static void _udp_recv_batch_key_create(void)
+{
+    PTHREAD_CALL(pthread_key_create(&udp_recv_batch_key, free));
+}
+
+/* send the queued packets with as few system calls as possible.  a run of
+ * packets of the same size (the last of which may be shorter) becomes one
+ * GSO message, and all the messages go in one sendmmsg().
+ */
+static void _udp_send_batch(network_context_socket_udp_t *udp_io_ctx)
+{
+    struct mmsghdr msgs[UDP_SEND_BATCH];
+    struct iovec iovs[UDP_SEND_BATCH];
+    char control[UDP_SEND_BATCH][CMSG_SPACE(sizeof(uint16_t))];
+    struct cmsghdr *cmsg;
+    unsigned int num_msgs, k, run, sent;
+    size_t offset, seg_len;
+    bool_t gso;
+    int rc;
+
+    assert(udp_io_ctx && udp_io_ctx->send_count > 0);
+
+retry:
+    gso = __atomic_load_n(&udp_gso_ok, __ATOMIC_RELAXED);
+    memset(msgs, 0, sizeof(msgs));
+
+    for (k = 0, num_msgs = 0, offset = 0; k < udp_io_ctx->send_count; )
+    {
+        seg_len = udp_io_ctx->send_lens[k];
+        iovs[num_msgs].iov_base = udp_io_ctx->send_buf + offset;
+        iovs[num_msgs].iov_len  = seg_len;
+
+        for (run = 1, ++k; gso && k < udp_io_ctx->send_count &&
+                           run < UDP_GSO_MAX_SEGMENTS &&
+                           udp_io_ctx->send_lens[k] <= seg_len &&
+                           iovs[num_msgs].iov_len + udp_io_ctx->send_lens[k] <=
+                               UDP_GSO_MAX_BYTES; ++run, ++k)
+        {
+            iovs[num_msgs].iov_len += udp_io_ctx->send_lens[k];
+            if (udp_io_ctx->send_lens[k] < seg_len)
+            {
+                /* a shorter packet ends the run */
+                ++run, ++k;
+                break;
+            }
+        }
+        offset += iovs[num_msgs].iov_len;
+
+        msgs[num_msgs].msg_hdr.msg_iov    = &iovs[num_msgs];
+        msgs[num_msgs].msg_hdr.msg_iovlen = 1;
+        if (run > 1)
+        {
+            msgs[num_msgs].msg_hdr.msg_control    = control[num_msgs];
+            msgs[num_msgs].msg_hdr.msg_controllen = sizeof(control[0]);
+
+            cmsg = CMSG_FIRSTHDR(&msgs[num_msgs].msg_hdr);
+            cmsg->cmsg_level = SOL_UDP;
+            cmsg->cmsg_type  = UDP_SEGMENT;
+            cmsg->cmsg_len   = CMSG_LEN(sizeof(uint16_t));
+            *(uint16_t *) CMSG_DATA(cmsg) = (uint16_t) seg_len;
+        }
+        ++num_msgs;
+    }
+
+    for (sent = 0; sent < num_msgs; sent += rc)
+    {
+        rc = sendmmsg(udp_io_ctx->base.socket, msgs + sent, num_msgs - sent,
+                      NETWORK_SEND_FLAGS);
+        if (rc >= 0)
+            continue;
+        if (errno == EINTR)
+        {
+            rc = 0;
+            continue;
+        }
+
+        if (gso && sent == 0 && num_msgs < udp_io_ctx->send_count &&
+            (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT))
+        {
+            /* no GSO here; send the packets one by one from now on */
+            DEBUG_LOG(("UDP GSO unavailable (errno=%d)\n", errno));
+            __atomic_store_n(&udp_gso_ok, FALSE, __ATOMIC_RELAXED);
+            goto retry;
+        }
+
+        /* the rest are lost, e.g. if the peer has gone (ECONNREFUSED) or
+         * the socket buffer is full; STCP retransmits as usual
+         */
+        DEBUG_LOG(("sendmmsg (network_io_udp): errno=%d\n", errno));
+        break;
+    }
+
+    udp_io_ctx->send_count = 0;
+    udp_io_ctx->send_len = 0;
+}
+#else
+/* without sendmmsg(), each packet goes in its own send() */
+static void _udp_send_batch(network_context_socket_udp_t *udp_io_ctx)
+{
+    unsigned int k;
+    size_t offset;
+
+    assert(udp_io_ctx && udp_io_ctx->send_count > 0);
+
+    for (k = 0, offset = 0; k < udp_io_ctx->send_count; ++k)
+    {
+        if (send(udp_io_ctx->base.socket, udp_io_ctx->send_buf + offset,
+                 udp_io_ctx->send_lens[k], NETWORK_SEND_FLAGS) < 0)
+        {
+            DEBUG_LOG(("send (network_io_udp): errno=%d\n", errno));
+        }
+        offset += udp_io_ctx->send_lens[k];
+    }
+
+    udp_io_ctx->send_count = 0;
+    udp_io_ctx->send_len = 0;
+}
+#endif  /*UDP_MMSG*/
@@ -5,6 +5,12 @@
  * client to send it something, which it interprets as the name of some
  * file. It then sends an OK to the client (if it can access the requested
  * file) and finally sends the file.
+ *
+ * A request of the form "name,offset,count" (for a name that isn't a file
+ * itself) asks for that range of the file only; the response is then
+ * "name,length,Ok offset/size", where size is the size of the whole file.
+ * Each connection is served by a thread of its own, so a client may fetch
+ * several ranges of a file at once.
  * 
  */
 
@@ -21,15 +27,20 @@
 #include <netdb.h>
 #include <errno.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include "mysock.h"
 
 
+#ifndef MIN
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+#endif
 
 static char usage[] = "usage: %s [-U]\n";
 
+static void *connection_thread(void *arg);
 static void do_connection(mysocket_t bindsd);
-static int get_nvt_line(int sd, char *);
+static int get_nvt_line(int sd, char *, size_t);
 static int process_line(int sd, char *);
 static int local_name(mysocket_t sd, char *name);
 
@@ -99,6 +110,7 @@ main(int argc, char *argv[])
     for (;;)
     {
         mysocket_t sd;
+        pthread_t tid;
 
         /* just keep accepting connections forever */
         if ((sd = myaccept(bindsd, (struct sockaddr *) &sin, &len)) < 0)
@@ -111,7 +123,14 @@ main(int argc, char *argv[])
         fprintf(stderr, "connected to %s at port %u\n",
                 inet_ntoa(sin.sin_addr), ntohs(sin.sin_port));
 
-        do_connection(sd);
+        if (pthread_create(&tid, NULL, connection_thread,
+                           (void *) (intptr_t) sd) != 0)
+        {
+            perror("pthread_create");
+            myclose(sd);
+            continue;
+        }
+        pthread_detach(tid);
     }                           /* end for(;;) */
 
     if (myclose(bindsd) < 0)
@@ -119,6 +138,12 @@ main(int argc, char *argv[])
     return 0;
 }
 
+static void *connection_thread(void *arg)
+{
+    do_connection((mysocket_t) (intptr_t) arg);
+    return NULL;
+}
+
 /* process a single client connection */
 static void do_connection(mysocket_t sd)
 {
@@ -133,7 +158,7 @@ static void do_connection(mysocket_t sd)
 
     for (;;)
     {
-        rc = get_nvt_line(sd, line);
+        rc = get_nvt_line(sd, line, sizeof(line));
         if (rc < 0 || !*line)
             goto done;
         fprintf(stderr, "client: %s\n", line);
@@ -156,53 +181,91 @@ done:
 /**********************************************************************/
 /* get_nvt_line
  * 
- * Retrieves the next line of NVT ASCII from mysocket layer.
+ * Retrieves the next line of NVT ASCII from mysocket layer, into line
+ * (size bytes), without its CRLF.  myreadline() hands it over a whole
+ * line at a time, ending at each LF; a line ends at CRLF.
  *
  * Returns 
  *  0 on success
  *  -1 on failure
  */
 static int
-get_nvt_line(int sd, char *line)
+get_nvt_line(int sd, char *line, size_t size)
 {
-    char last_char;
-    char this_char;
+    size_t used = 0;
     int len;
 
-    last_char = '\0';
     for (;;)
     {
-        len = myread(sd, &this_char, sizeof(this_char));
+        len = myreadline(sd, line + used, size - used);
         if (len < 0)
             return -1;
 
+        /* Connection ended before line terminator (or empty string):
+         * line holds whatever came before the end */
         if (len == 0)
-        {
-            /* Connection ended before line terminator (or empty string) */
-            *line = '\0';
             return 0;
-        }
-    /** fprintf(stderr, "read character %c\n", this_char); **/
-        if (last_char == '\r' && this_char == '\n')
+
+        used += len;
+        if (used >= 2 && line[used - 2] == '\r' && line[used - 1] == '\n')
         {
-            /* Reached the end of line. Already wrote \r into string, overwrite
-             * it with a NUL */
-            line[-1] = '\0';
+            /* Reached the end of line; overwrite the CRLF with a NUL */
+            line[used - 2] = '\0';
             return 0;
         }
 
-        *line++ = this_char;
-        last_char = this_char;
+        if (used == size - 1)
+        {
+            /* no room left for the rest of the line */
+            errno = EMSGSIZE;
+            return -1;
+        }
     }
-    return -1;
+}
+
+/**********************************************************************/
+/* parse_range
+ *
+ * Splits a "name,offset,count" request into name (left in line) and
+ * range.
+ *
+ * Returns
+ *  1 if line was a range request
+ *  0 otherwise (line is left as it was)
+ */
+static int
+parse_range(char *line, off_t *offset, off_t *count)
+{
+    char *comma1, *comma2, *end;
+    long long value1, value2;
+
+    if (!(comma2 = strrchr(line, ',')))
+        return 0;
+    *comma2 = '\0';
+    comma1 = strrchr(line, ',');
+    *comma2 = ',';
+    if (!comma1)
+        return 0;
+
+    value1 = strtoll(comma1 + 1, &end, 10);
+    if (end == comma1 + 1 || end != comma2 || value1 < 0)
+        return 0;
+    value2 = strtoll(comma2 + 1, &end, 10);
+    if (end == comma2 + 1 || *end || value2 < 0)
+        return 0;
+
+    *comma1 = '\0';
+    *offset = value1;
+    *count  = value2;
+    return 1;
 }
 
 /**********************************************************************/
 /* process_line
  * 
- * Process the request (a filename) from the client. Send back the
- * response and then the content of the requested file through
- * mysocket layer.
+ * Process the request (a filename, or a range of a file) from the client.
+ * Send back the response and then the content of the requested file
+ * through mysocket layer.
  *
  * Returns 
  *  0 on success
@@ -212,7 +275,11 @@ static int
 process_line(int sd, char *line)
 {
     char resp[5000];
-    int fd = -1, length;
+    int fd = -1, on = 1, off = 0, range = 0;
+    off_t size = 0, offset = 0, count = 0;
+
+    if (*line && access(line, R_OK) < 0)
+        range = parse_range(line, &offset, &count);
 
     if (!*line || access(line, R_OK) < 0)
     {
@@ -226,12 +293,27 @@ process_line(int sd, char *line)
         }
         else
         {
-            sprintf(resp, "%s,%lu,Ok\r\n", line, lseek(fd, 0, SEEK_END));
-            lseek(fd, 0, SEEK_SET);
+            size = lseek(fd, 0, SEEK_END);
+            if (range)
+            {
+                count = (offset < size) ? MIN(count, size - offset) : 0;
+                sprintf(resp, "%s,%lld,Ok %lld/%lld\r\n", line,
+                        (long long) count, (long long) offset,
+                        (long long) size);
+            }
+            else
+            {
+                count = size;
+                sprintf(resp, "%s,%lu,Ok\r\n", line, (unsigned long) size);
+            }
         }
     }
   /** fprintf(stderr, "sending to client: %s of length %d bytes\n", resp, strlen(resp)); **/
-    /* Return the response to the client */
+    /* Return the response to the client.  cork the socket while the file
+     * follows, so the response line shares a segment with its first bytes.
+     */
+    if (fd != -1)
+        mysetsockopt(sd, STCP_CORK, &on, sizeof(on));
     if (mywrite(sd, resp, strlen(resp)) < 0)
     {
         if (fd != -1)
@@ -242,28 +324,18 @@ process_line(int sd, char *line)
     if (fd == -1)
         return 0;
 
-    for (;;)
+    /* the file goes out straight from its pages, without being read into
+     * resp and copied into the send buffer
+     */
+    if (mysendfile(sd, fd, offset, (size_t) count) < (ssize_t) count)
     {
-        length = read(fd, resp, sizeof(resp));
-        if (length == 0)
-            break;
-
-        if (length == -1)
-        {
-            perror("read");
-            close(fd);
-            return -1;
-        }
-
-        /* fwrite(resp, length, 1, stdout); */
-
-        if (mywrite(sd, resp, length) < 0)
-        {
-            close(fd);
-            return -1;
-        }
+        perror("mysendfile");
+        close(fd);
+        return -1;
     }
 
+    /* flush the tail of the file */
+    mysetsockopt(sd, STCP_CORK, &off, sizeof(off));
     close(fd);
     return 0;
 }
@@ -15,6 +15,10 @@
 #include "tcp_sum.h"
 #include "transport.h"
 
+#if STCP_IOV_MAX + 1 > NETWORK_IOV_MAX
+    #error the network layer takes too few pieces for stcp_network_sendv()
+#endif
+
 
 /* called by the transport layer thread to unblock the calling application,
  * e.g. when the connection is complete, or when an error is detected while
@@ -48,6 +52,112 @@ void stcp_unblock_application(mysocket_t sd)
 }
 
 
+/* bytes of mysendfile() data STCP may take now, of the left still lent.
+ * as with mywrite(), what STCP has taken but the peer hasn't acknowledged
+ * stays within sndbuf.
+ */
+static size_t _stcp_sendfile_room(mysock_context_t *ctx, size_t left)
+{
+    size_t used, limit;
+
+    if (left == 0)
+        return 0;
+    used  = __atomic_load_n(&ctx->snd_unacked, __ATOMIC_SEQ_CST);
+    limit = __atomic_load_n(&ctx->sndbuf, __ATOMIC_SEQ_CST);
+    return (used >= limit) ? 0 : MIN(left, limit - used);
+}
+
+static size_t _stcp_sendfile_ready(mysock_context_t *ctx)
+{
+    return _stcp_sendfile_room(ctx, __atomic_load_n(&ctx->sendfile_left,
+                                                    __ATOMIC_ACQUIRE));
+}
+
+/* data from the app that STCP may take now:  what mywrite() has queued,
+ * then any mysendfile() data
+ */
+static size_t _stcp_app_queued(mysock_context_t *ctx)
+{
+    return _mysock_queued(&ctx->app_recv_queue) + _stcp_sendfile_ready(ctx);
+}
+
+/* the events among flags that have occurred.  data_ready_lock must be
+ * held.
+ */
+static unsigned int _stcp_ready_events(mysock_context_t *ctx,
+                                       unsigned int      flags)
+{
+    unsigned int rc = 0;
+    size_t app_queued, sendfile_left, sendfile_ready;
+
+    /* the app thread and stcp_app_recv() change sendfile_left; read it
+     * once, so everything below agrees
+     */
+    sendfile_left  = __atomic_load_n(&ctx->sendfile_left, __ATOMIC_ACQUIRE);
+    sendfile_ready = _stcp_sendfile_room(ctx, sendfile_left);
+    app_queued = _mysock_queued(&ctx->app_recv_queue) + sendfile_ready;
+
+    /* mysendfile() waits for STCP to take the whole file, so its tail
+     * can't wait for more data to make up a segment
+     */
+    if ((flags & APP_DATA) && app_queued > 0 &&
+        (app_queued >= ctx->app_data_lowat || ctx->close_requested ||
+         (sendfile_left > 0 && sendfile_ready == sendfile_left)))
+        rc |= APP_DATA;
+
+    if ((flags & NETWORK_DATA) &&
+        _mysock_queued(&ctx->network_recv_queue) > 0)
+        rc |= NETWORK_DATA;
+
+    if (/*(flags & APP_CLOSE_REQUESTED) &&*/
+        ctx->close_requested && app_queued == 0)
+    {
+        /* we should only wake up on this event once.  also, we don't
+         * pass the close event down to STCP until we've already passed
+         * it all outstanding data from the app.
+         */
+        ctx->close_requested = FALSE;
+        rc |= APP_CLOSE_REQUESTED;
+    }
+
+    if ((flags & APP_DATA_READ) &&
+        __atomic_exchange_n(&ctx->app_data_read, FALSE, __ATOMIC_SEQ_CST))
+    {
+        rc |= APP_DATA_READ;
+    }
+
+    if ((flags & APP_SOCKOPT) && ctx->sockopt_changed)
+    {
+        ctx->sockopt_changed = FALSE;
+        rc |= APP_SOCKOPT;
+    }
+
+    return rc;
+}
+
+/* the same as stcp_wait_for_event() with a deadline that has already
+ * passed, for the transport worker pool (transport_pool.c).  *release_at
+ * is set to when the network layer next has a held-back packet to send
+ * (see _network_netem_release()), or 0.
+ */
+unsigned int _mysock_transport_events(mysock_context_t *ctx,
+                                      unsigned int      flags,
+                                      int64_t          *release_at)
+{
+    unsigned int rc;
+
+    *release_at = _network_netem_release(&ctx->network_state);
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    rc = _stcp_ready_events(ctx, flags);
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+
+    /* STCP goes idle; see stcp_wait_for_event() */
+    if (!rc)
+        _network_flush(&ctx->network_state);
+    return rc;
+}
+
 /* called by the transport layer to wait for new data, either from the network
  * or from the application, or for the application to request that the
  * mysocket be closed, depending on the value of flags.  abstime is the
@@ -65,43 +175,65 @@ unsigned int stcp_wait_for_event(mysocket_t             sd,
 {
     unsigned int rc = 0;
     mysock_context_t *ctx = _mysock_get_context(sd);
+    bool_t flushed = FALSE;
+    int64_t release_at;
+    struct timespec release_time;
+    const struct timespec *until;
 
-    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    /* an emulated network path (STCP_NETEM) may have packets due to go out */
+    release_at = _network_netem_release(&ctx->network_state);
+
+    _mysock_begin_wait(ctx);
     for (;;)
     {
-        if ((flags & APP_DATA) && (ctx->app_recv_queue.head != NULL))
-            rc |= APP_DATA;
-
-        if ((flags & NETWORK_DATA) && (ctx->network_recv_queue.head != NULL))
-            rc |= NETWORK_DATA;
+        if ((rc = _stcp_ready_events(ctx, flags)))
+            break;
 
-        if (/*(flags & APP_CLOSE_REQUESTED) &&*/
-            ctx->close_requested && (ctx->app_recv_queue.head == NULL))
+        if (!flushed)
         {
-            /* we should only wake up on this event once.  also, we don't
-             * pass the close event down to STCP until we've already passed
-             * it all outstanding data from the app.
+            /* packets STCP has sent may be held back by the network
+             * layer, to go out together; they must be on their way
+             * before we wait.  anything that happens meanwhile is seen
+             * when we look again.
              */
-            ctx->close_requested = FALSE;
-            rc |= APP_CLOSE_REQUESTED;
+            PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+            _network_flush(&ctx->network_state);
+            PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+            flushed = TRUE;
+            continue;
         }
 
-        if (rc)
-            break;
+        /* wake up for the next emulated packet, if that comes first */
+        until = abstime;
+        if (release_at &&
+            (!abstime || release_at < (int64_t) abstime->tv_sec * 1000000000 +
+                                      abstime->tv_nsec))
+        {
+            release_time.tv_sec  = release_at / 1000000000;
+            release_time.tv_nsec = release_at % 1000000000;
+            until = &release_time;
+        }
 
-        if (abstime)
+        if (until)
         {
             /* wait with timeout */
             switch (pthread_cond_timedwait(&ctx->data_ready_cond,
                                            &ctx->data_ready_lock,
-                                           abstime))
+                                           until))
             {
             case 0: /* some data might be available */
             case EINTR:
                 break;
 
             case ETIMEDOUT: /* no data arrived in the specified time */
-                goto done;
+                if (until == abstime)
+                    goto done;
+
+                PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+                release_at = _network_netem_release(&ctx->network_state);
+                PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+                flushed = FALSE;
+                break;
 
             case EINVAL:
                 assert(0);
@@ -121,7 +253,7 @@ unsigned int stcp_wait_for_event(mysocket_t             sd,
     }
 
 done:
-    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+    _mysock_end_wait(ctx);
 
     return rc;
 }
@@ -182,72 +314,232 @@ ssize_t stcp_network_recv(mysocket_t sd, void *dst, size_t max_len)
  *
  * stcp_network_send(mysd, buf1, len1, buf2, len2, NULL);
  *
- * Unreliability is handled by a helper function (_network_send()); if we're
- * operating in unreliable mode, we decide in there whether to drop the
- * datagram or send it later.
+ * The pieces are sent as they are by stcp_network_sendv().
  *
  * Returns the number of bytes transferred on success, or -1 on failure.
  *
  */
 ssize_t stcp_network_send(mysocket_t sd, const void *src, size_t src_len, ...)
 {
-    mysock_context_t *ctx = _mysock_get_context(sd);
-    char              packet[MAX_IP_PAYLOAD_LEN];
-    size_t            packet_len;
-    const void       *next_buf;
-    va_list           argptr;
-    struct tcphdr    *header;
+    struct iovec iov[STCP_IOV_MAX];
+    const void  *next_buf;
+    va_list      argptr;
+    int          iovcnt = 0;
 
-    assert(ctx && src);
+    assert(src);
 
-    assert(src_len <= sizeof(packet));
-    memcpy(packet, src, src_len);
-    packet_len = src_len;
+    iov[iovcnt].iov_base = (void *) src;
+    iov[iovcnt++].iov_len = src_len;
 
     va_start(argptr, src_len);
     while ((next_buf = va_arg(argptr, const void *)))
     {
-        size_t next_len = va_arg(argptr, size_t);
-
-        assert(packet_len + next_len <= sizeof(packet));
-        memcpy(packet + packet_len, next_buf, next_len);
-        packet_len += next_len;
+        assert(iovcnt < STCP_IOV_MAX);
+        iov[iovcnt].iov_base = (void *) next_buf;
+        iov[iovcnt++].iov_len = va_arg(argptr, size_t);
     }
     va_end(argptr);
 
+    return stcp_network_sendv(sd, iov, iovcnt);
+}
+
+/* stcp_network_sendv()
+ *
+ * Send a datagram gathered from iovcnt pieces to the peer (see
+ * stcp_api.h).
+ *
+ * The fixed part of the TCP header is copied, so the fields that aren't
+ * handled by students can be filled in without touching the caller's
+ * buffer; everything after it is summed in place, and handed on to the
+ * network layer as it is.  The backend then writes it out with one
+ * writev() (TCP), or gathers it into its batch of datagrams (UDP), so the
+ * payload is copied no more than once on its way to the kernel.
+ *
+ * Unreliability is handled by a helper function (_network_sendv()); if
+ * we're operating in unreliable mode, we decide in there whether to drop
+ * the datagram or send it later.
+ *
+ * Returns the number of bytes transferred on success, or -1 on failure.
+ */
+ssize_t stcp_network_sendv(mysocket_t sd, const struct iovec *iov, int iovcnt)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    struct tcphdr     header;
+    struct iovec      vec[STCP_IOV_MAX + 1];
+    size_t            packet_len, skip;
+    uint32_t          sum;
+    int               k, n = 0;
+
+    assert(ctx && iov);
+    assert(iovcnt > 0 && iovcnt <= STCP_IOV_MAX);
+    assert(iov[0].iov_base && iov[0].iov_len >= sizeof(header));
+
+    /* the checksum is summed as the pieces are gathered, and then patched
+     * for the header fields filled in below
+     */
+    sum = _mysock_csum_copy(&header, iov[0].iov_base, sizeof(header));
+    vec[n].iov_base = &header;
+    vec[n++].iov_len = sizeof(header);
+    packet_len = sizeof(header);
+
+    for (k = 0, skip = sizeof(header); k < iovcnt; ++k, skip = 0)
+    {
+        const char *base = (const char *) iov[k].iov_base + skip;
+        size_t len = iov[k].iov_len - skip;
+
+        if (len == 0)
+            continue;
+        assert(base);
+        sum = _mysock_csum_block_add(sum, _mysock_csum_partial(base, len),
+                                     packet_len);
+        vec[n].iov_base = (void *) base;
+        vec[n++].iov_len = len;
+        packet_len += len;
+    }
+    assert(packet_len <= MAX_IP_PAYLOAD_LEN);
+
     /* fill in fields in the TCP header that aren't handled by students */
-    assert(packet_len >= sizeof(struct tcphdr));
-    header = (struct tcphdr *) packet;
+#define SET_HEADER_FIELD(field, value) \
+    do { \
+        uint16_t new_value = (value); \
+        sum = _mysock_csum_replace(sum, header.field, new_value); \
+        header.field = new_value; \
+    } while (0)
 
-    header->th_sport = _network_get_port(&ctx->network_state);
-    /* N.B. assert(header->th_sport > 0) fires in the UDP SYN-ACK case */
+    SET_HEADER_FIELD(th_sport, _network_get_port(&ctx->network_state));
+    /* N.B. assert(header.th_sport > 0) fires in the UDP SYN-ACK case */
 
     assert(ctx->network_state.peer_addr.sa_family == AF_INET);
-    header->th_dport =
-        ((struct sockaddr_in *) &ctx->network_state.peer_addr)->sin_port;
-    assert(header->th_dport > 0);
+    SET_HEADER_FIELD(th_dport, ((struct sockaddr_in *)
+                                &ctx->network_state.peer_addr)->sin_port);
+    assert(header.th_dport > 0);
+
+    SET_HEADER_FIELD(th_sum, 0);    /* set below */
+    SET_HEADER_FIELD(th_urp, 0);    /* ignored */
+#undef SET_HEADER_FIELD
 
-    header->th_sum = 0; /* set below */
-    header->th_urp = 0; /* ignored */
+    _mysock_finish_checksum(ctx, &header, packet_len, sum);
+    return _network_sendv(sd, vec, n, packet_len);
+}
 
-    _mysock_set_checksum(ctx, packet, packet_len);
-    return _network_send(sd, packet, packet_len);
+/* largest datagram stcp_network_send() accepts for this mysocket */
+size_t stcp_network_mtu(mysocket_t sd)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    assert(ctx);
+    return MAX_IP_PAYLOAD_LEN;
 }
 
-/* receive data from the application (sent to us using mywrite()).
- * the call blocks until data is available.
+/* receive data from the application (sent to us using mywrite() or
+ * mysendfile()).  the call blocks until data is available.
  */
 size_t stcp_app_recv(mysocket_t sd, void *dst, size_t max_len)
 {
     mysock_context_t *ctx = _mysock_get_context(sd);
+    size_t len;
+
     assert(ctx && dst);
 
-    /* app may have passed in data of arbitrary length; all of it must be
-     * passed down to the transport layer.  if it doesn't fit in the specified
-     * buffer, any left over is kept for the next call to app_recv().
-     */
-    return _mysock_dequeue_buffer(ctx, &ctx->app_recv_queue,
-                                  dst, max_len, TRUE);
+    if (_mysock_queued(&ctx->app_recv_queue) == 0 &&
+        (len = _stcp_sendfile_ready(ctx)) > 0)
+    {
+        /* copy straight from the file mysendfile() lent us, and wake it
+         * once all of it has been taken
+         */
+        len = MIN(len, max_len);
+        memcpy(dst, ctx->sendfile_data, len);
+        ctx->sendfile_data += len;
+        if (__atomic_sub_fetch(&ctx->sendfile_left, len,
+                               __ATOMIC_ACQ_REL) == 0)
+        {
+            PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+            PTHREAD_CALL(pthread_cond_broadcast(&ctx->space_ready_cond));
+            PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+        }
+    }
+    else
+    {
+        /* app may have passed in data of arbitrary length; all of it must
+         * be passed down to the transport layer.  whatever doesn't fit in
+         * the specified buffer is kept for the next call to app_recv().
+         */
+        len = _mysock_dequeue_buffer(ctx, &ctx->app_recv_queue,
+                                     dst, max_len, TRUE);
+    }
+
+    /* the data stays in the send buffer until the peer acknowledges it */
+    __atomic_add_fetch(&ctx->snd_unacked, len, __ATOMIC_SEQ_CST);
+    _mysock_wakeup_writer(ctx);
+    return len;
+}
+
+/* release data passed down with stcp_app_recv() from the send buffer */
+void stcp_app_data_acked(mysocket_t sd, size_t len)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+
+    assert(ctx);
+    assert(len <= ctx->snd_unacked);
+    __atomic_sub_fetch(&ctx->snd_unacked, len, __ATOMIC_SEQ_CST);
+    _mysock_wakeup_writer(ctx);
+}
+
+/* returns the number of bytes written by the app and not yet received,
+ * counting only as much mysendfile() data as may be taken now
+ */
+size_t stcp_app_recv_queued(mysocket_t sd)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+
+    assert(ctx);
+    return _stcp_app_queued(ctx);
+}
+
+/* only the transport thread waits for APP_DATA, so no wakeup is needed */
+void stcp_set_app_data_lowat(mysocket_t sd, size_t lowat)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+
+    assert(ctx);
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    ctx->app_data_lowat = lowat;
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+}
+
+int stcp_app_sockopt(mysocket_t sd, int optname)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    int value;
+
+    assert(ctx);
+    assert(optname == STCP_NODELAY || optname == STCP_CORK);
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    value = (optname == STCP_NODELAY) ? ctx->nodelay : ctx->cork;
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+    return value;
+}
+
+/* publish a snapshot for mygetsockopt(STCP_INFO).  only the STCP thread
+ * writes it, so the sequence number needs no lock; the copy is made a word
+ * at a time with atomic stores, as the reader may be copying it meanwhile.
+ */
+void stcp_set_info(mysocket_t sd, const struct stcp_info *info)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    const uint32_t *src = (const uint32_t *) info;
+    uint32_t *dst = (uint32_t *) &ctx->info;
+    unsigned int seq, k;
+
+    assert(ctx && info);
+    assert(sizeof(*info) % sizeof(uint32_t) == 0);
+
+    seq = ctx->info_seq;
+    __atomic_store_n(&ctx->info_seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    for (k = 0; k < sizeof(*info) / sizeof(uint32_t); ++k)
+        __atomic_store_n(&dst[k], src[k], __ATOMIC_RELAXED);
+    __atomic_store_n(&ctx->info_valid, TRUE, __ATOMIC_RELAXED);
+    __atomic_store_n(&ctx->info_seq, seq + 2, __ATOMIC_RELEASE);
 }
 
 /* pass data up to the application for consumption by myread() */
@@ -259,15 +551,31 @@ void stcp_app_send(mysocket_t sd, const void *src, size_t src_len)
     {
         DEBUG_LOG(("stcp_app_send(%d):  sending %u bytes up to app\n",
                    sd, src_len));
-        _mysock_enqueue_buffer(ctx, &ctx->app_send_queue, src, src_len);
+        /* the receive window keeps this from overflowing the queue */
+        if (_mysock_enqueue_buffer(ctx, &ctx->app_send_queue,
+                                   src, src_len) < src_len)
+        {
+            assert(0);
+        }
+        _mysock_notify_pollers(ctx);
     }
 }
 
+/* returns the number of bytes passed up to the app and not yet read */
+size_t stcp_app_send_queued(mysocket_t sd)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+
+    assert(ctx);
+    return _mysock_queued(&ctx->app_send_queue);
+}
+
 void stcp_fin_received(mysocket_t sd)
 {
     mysock_context_t *ctx = _mysock_get_context(sd);
     assert(ctx);
     DEBUG_LOG(("stcp_fin_received(%d):  setting eof flag\n", sd));
     _mysock_enqueue_buffer(ctx, &ctx->app_send_queue, NULL, 0);
+    _mysock_notify_pollers(ctx);
 }
 
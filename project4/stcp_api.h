@@ -6,8 +6,9 @@
 #ifndef __STCP_API_H__
 #define __STCP_API_H__
 
-#include <time.h>   /* timespec */
-#include "mysock.h" /* mysocket_t */
+#include <time.h>       /* timespec */
+#include <sys/uio.h>    /* iovec */
+#include "mysock.h"     /* mysocket_t */
 
 
 /* stcp_wait_for_event() flags */
@@ -17,7 +18,10 @@ typedef enum
     APP_DATA            = 1,
     NETWORK_DATA        = 2,
     APP_CLOSE_REQUESTED = 4,
-    ANY_EVENT           = APP_DATA | NETWORK_DATA | APP_CLOSE_REQUESTED
+    APP_DATA_READ       = 8,
+    APP_SOCKOPT         = 16,
+    ANY_EVENT           = APP_DATA | NETWORK_DATA | APP_CLOSE_REQUESTED |
+                          APP_DATA_READ | APP_SOCKOPT
 } stcp_event_type_t;
 
 
@@ -37,7 +41,13 @@ void stcp_unblock_application(mysocket_t sd);
  * structure containing all zeros corresponds to 00:00:00 GMT, January 1,
  * 1970); if the timeout pointer is NULL, the function blocks indefinitely
  * until data arrives.  the close event is triggered only once, once all
- * pending data has been dequeued from the application.
+ * pending data has been dequeued from the application.  APP_DATA_READ is
+ * signalled once the application has consumed data passed up with
+ * stcp_app_send() since the last such event, e.g. to send a window update.
+ * APP_SOCKOPT is signalled when the application changes a socket option
+ * with mysetsockopt().  APP_DATA is only signalled once at least the
+ * low-water mark set with stcp_set_app_data_lowat() is queued, or once the
+ * application has asked to close the socket.
  *
  * sd is the mysocket descriptor for the connection of interest.
  *
@@ -98,12 +108,94 @@ ssize_t stcp_network_recv(mysocket_t sd, void *dst, size_t max_len);
  */
 ssize_t stcp_network_send(mysocket_t sd, const void *src, size_t src_len, ...);
 
-/* receive data from the application (sent to us using mywrite()) */
+/* Send a datagram gathered from iovcnt pieces (at most STCP_IOV_MAX), as
+ * stcp_network_send() does.  The first piece must hold at least the STCP
+ * header.  Only the header is copied; the rest is checksummed where it
+ * lies and passed to the network by reference, so it needn't be put
+ * together in one buffer first, and needn't stay put once this returns.
+ *
+ * Returns the number of bytes transferred on success, or -1 on failure.
+ */
+#define STCP_IOV_MAX 8
+ssize_t stcp_network_sendv(mysocket_t sd, const struct iovec *iov, int iovcnt);
+
+/* returns the size in bytes of the largest datagram stcp_network_send() can
+ * carry for the given mysocket, i.e. STCP header, options and payload.
+ */
+size_t stcp_network_mtu(mysocket_t sd);
+
+/* receive data from the application (sent to us using mywrite()).  the
+ * data still counts against the application's send buffer (STCP_SNDBUF)
+ * until it is released with stcp_app_data_acked().
+ */
 size_t stcp_app_recv(mysocket_t sd, void *dst, size_t max_len);
 
-/* pass data up to the application for consumption by myread() */
+/* tell the mysocket layer the peer has acknowledged len bytes received with
+ * stcp_app_recv(), so mywrite() can reuse that space in the send buffer.
+ */
+void stcp_app_data_acked(mysocket_t sd, size_t len);
+
+/* returns the number of bytes written by the application that haven't been
+ * received with stcp_app_recv() yet.
+ */
+size_t stcp_app_recv_queued(mysocket_t sd);
+
+/* APP_DATA is signalled only once lowat bytes are waiting to be received
+ * with stcp_app_recv() (any amount if lowat is 0 or 1), e.g. so that small
+ * writes can be coalesced into a full segment.
+ */
+void stcp_set_app_data_lowat(mysocket_t sd, size_t lowat);
+
+/* returns the current value of socket option optname (STCP_NODELAY or
+ * STCP_CORK, see mysock.h).
+ */
+int stcp_app_sockopt(mysocket_t sd, int optname);
+
+/* publish a snapshot of the connection's state for mygetsockopt(STCP_INFO)
+ * (see mysock.h).  the application may read it at any time, so call this
+ * whenever the state has changed, e.g. after handling each event.
+ */
+void stcp_set_info(mysocket_t sd, const struct stcp_info *info);
+
+/* event tracing.  stcp_trace_open() starts recording the connection's
+ * events to a binary trace file (see stcp_trace.h; stcp_trace2txt converts
+ * it to text).  stcp_trace() only copies the event into a per-connection
+ * ring--without locking or system calls--and a background thread writes
+ * the rings out, so it's cheap enough to call for every segment.  events
+ * are dropped (and the number dropped recorded) if the ring fills up
+ * faster than it's written out.  tracing stops when the connection ends.
+ */
+typedef enum
+{
+    STCP_TRACE_SEND = 1,    /* new data sent; len is the payload */
+    STCP_TRACE_ACKED,       /* an ACK for new data; len is the data acked */
+    STCP_TRACE_RETRANSMIT,  /* a segment sent again */
+    STCP_TRACE_DUPACK,      /* a duplicate ACK */
+    STCP_TRACE_TIMEOUT,     /* the retransmission timer went off; len is
+                             * the data that was in flight */
+    STCP_TRACE_RECOVERY,    /* fast recovery began; len as above */
+    STCP_TRACE_DROPPED      /* (written by the tracer) len events lost */
+} stcp_trace_type_t;
+
+void stcp_trace_open(mysocket_t sd, const char *path);
+void stcp_trace(mysocket_t sd, stcp_trace_type_t type, uint32_t seq,
+                uint32_t ack, uint32_t len, uint32_t cwnd, uint32_t swnd,
+                uint32_t avail);
+
+/* pass data up to the application for consumption by myread().  at most
+ * STCP_APP_BUFFER_SIZE bytes may be waiting for the application, so the
+ * receive window must never exceed the space left (see
+ * stcp_app_send_queued()).
+ */
+#define STCP_APP_BUFFER_SIZE (256 * 1024)
 void stcp_app_send(mysocket_t sd, const void *src, size_t src_len);
 
+/* returns the number of bytes passed up with stcp_app_send() that the
+ * application hasn't read yet, so the receive window can be sized from
+ * the free space left in the receive buffer.
+ */
+size_t stcp_app_send_queued(mysocket_t sd);
+
 /* once you receive a FIN segment from the peer, we need to let the
  * application know there's no more data arriving (by returning 0 bytes for
  * subsequent myread() calls).  call stcp_fin_received() to indicate the
@@ -0,0 +1,322 @@
+/* stcp_trace.c--binary event tracing for STCP connections (see
+ * stcp_trace_open() in stcp_api.h, and stcp_trace.h for the file format).
+ *
+ * each traced connection has a ring of records.  the STCP thread running
+ * the connection is its only producer, and the tracer thread its only
+ * consumer, so (as with packet_queue_t) each side advances its own index
+ * and neither takes a lock.  the tracer wakes up every TRACE_FLUSH_MS, or
+ * when a ring is half full, and appends whatever the rings hold to their
+ * files.  a full ring drops new records rather than wait; the tracer
+ * notes how many in a STCP_TRACE_DROPPED record.
+ *
+ * once STCP is done with a connection, its ring is marked closed; the
+ * tracer writes out what's left and frees it, so the mysocket needn't wait.
+ * anything still unwritten at exit() is written then.
+ */
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <pthread.h>
+#include "mysock_impl.h"
+#include "stcp_trace.h"
+
+
+#define TRACE_RING_SIZE 1024    /* records; a power of two */
+#define TRACE_FLUSH_MS  50
+
+#if (TRACE_RING_SIZE & (TRACE_RING_SIZE - 1)) != 0
+    #error TRACE_RING_SIZE should be a power of two
+#endif
+
+/* a trace file, shared by every connection tracing to the same path */
+typedef struct trace_file
+{
+    char              *path;
+    FILE              *fp;
+    unsigned int       refs;
+    struct trace_file *next;
+} trace_file_t;
+
+typedef struct stcp_trace_ring
+{
+    unsigned int  tail;         /* records ever added (STCP thread) */
+    unsigned int  dropped;      /* records ever dropped (STCP thread) */
+    bool_t        closed;       /* STCP is done with the connection */
+
+    unsigned int  head;         /* records ever written out (tracer) */
+    unsigned int  dropped_seen; /* drops already noted (tracer) */
+
+    mysocket_t    sd;
+    trace_file_t *file;
+    struct stcp_trace_ring *next;
+
+    stcp_trace_record_t records[TRACE_RING_SIZE];
+} stcp_trace_ring_t;
+
+
+/* trace_lock protects the lists below, and the files */
+static pthread_mutex_t    trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t     trace_cond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t     trace_once = PTHREAD_ONCE_INIT;
+static stcp_trace_ring_t *trace_rings;
+static trace_file_t      *trace_files;
+
+
+static void _trace_start(void);
+static void *_trace_thread_func(void *arg);
+static void _trace_flush_all(void);
+
+
+/* return the trace file for path, opening it (and writing its header) if
+ * no connection traces to it yet.  called with trace_lock held.
+ */
+static trace_file_t *_trace_file_get(const char *path)
+{
+    stcp_trace_header_t header;
+    trace_file_t *file;
+
+    for (file = trace_files; file; file = file->next)
+    {
+        if (!strcmp(file->path, path))
+        {
+            ++file->refs;
+            return file;
+        }
+    }
+
+    file = (trace_file_t *) calloc(1, sizeof(trace_file_t));
+    assert(file);
+    if ((file->fp = fopen(path, "wb")) == NULL)
+    {
+        free(file);
+        return NULL;
+    }
+    file->path = strdup(path);
+    assert(file->path);
+    file->refs = 1;
+
+    memset(&header, 0, sizeof(header));
+    strcpy(header.magic, STCP_TRACE_MAGIC);
+    header.version     = STCP_TRACE_VERSION;
+    header.record_size = sizeof(stcp_trace_record_t);
+    fwrite(&header, sizeof(header), 1, file->fp);
+
+    file->next  = trace_files;
+    trace_files = file;
+    return file;
+}
+
+/* drop a reference to a trace file, closing it after the last one.  called
+ * with trace_lock held.
+ */
+static void _trace_file_put(trace_file_t *file)
+{
+    trace_file_t **prev;
+
+    if (--file->refs > 0)
+        return;
+
+    for (prev = &trace_files; *prev != file; prev = &(*prev)->next)
+        ;
+    *prev = file->next;
+    fclose(file->fp);
+    free(file->path);
+    free(file);
+}
+
+/* write out whatever ring holds.  called with trace_lock held; returns
+ * TRUE once the ring is closed and empty.
+ */
+static bool_t _trace_ring_flush(stcp_trace_ring_t *ring)
+{
+    stcp_trace_record_t note;
+    unsigned int head = ring->head, tail, dropped, n;
+    bool_t closed;
+
+    /* closed first:  nothing is added once it's set */
+    closed  = __atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE);
+    tail    = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+
+    while (head != tail)
+    {
+        /* up to the end of the ring at most */
+        n = MIN(tail - head, TRACE_RING_SIZE - head % TRACE_RING_SIZE);
+        fwrite(&ring->records[head % TRACE_RING_SIZE],
+               sizeof(stcp_trace_record_t), n, ring->file->fp);
+        head += n;
+        __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+    }
+
+    if (dropped != ring->dropped_seen)
+    {
+        struct timespec now;
+
+        clock_gettime(CLOCK_REALTIME, &now);
+        memset(&note, 0, sizeof(note));
+        note.time = (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+        note.sd   = ring->sd;
+        note.type = STCP_TRACE_DROPPED;
+        note.len  = dropped - ring->dropped_seen;
+        fwrite(&note, sizeof(note), 1, ring->file->fp);
+        ring->dropped_seen = dropped;
+    }
+
+    return closed;
+}
+
+/* write out every ring, and free the closed ones.  called with trace_lock
+ * held.
+ */
+static void _trace_flush_locked(void)
+{
+    stcp_trace_ring_t **prev = &trace_rings, *ring;
+    trace_file_t *file;
+
+    while ((ring = *prev) != NULL)
+    {
+        if (_trace_ring_flush(ring))
+        {
+            *prev = ring->next;
+            fflush(ring->file->fp);
+            _trace_file_put(ring->file);
+            free(ring);
+        }
+        else
+        {
+            prev = &ring->next;
+        }
+    }
+
+    for (file = trace_files; file; file = file->next)
+        fflush(file->fp);
+}
+
+static void _trace_flush_all(void)
+{
+    PTHREAD_CALL(pthread_mutex_lock(&trace_lock));
+    _trace_flush_locked();
+    PTHREAD_CALL(pthread_mutex_unlock(&trace_lock));
+}
+
+static void _trace_start(void)
+{
+    (void) _mysock_create_thread(_trace_thread_func, NULL, TRUE);
+    atexit(_trace_flush_all);
+}
+
+static void *_trace_thread_func(void *arg)
+{
+    struct timespec deadline;
+    int rc;
+
+    PTHREAD_CALL(pthread_mutex_lock(&trace_lock));
+    for (;;)
+    {
+        _trace_flush_locked();
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += TRACE_FLUSH_MS * 1000000L;
+        deadline.tv_sec  += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        rc = pthread_cond_timedwait(&trace_cond, &trace_lock, &deadline);
+        assert(rc == 0 || rc == ETIMEDOUT);
+    }
+
+    PTHREAD_CALL(pthread_mutex_unlock(&trace_lock));
+    return NULL;
+}
+
+
+/* start tracing sd's events to the file at path (see stcp_api.h).  if the
+ * file can't be opened, the connection just isn't traced.
+ */
+void stcp_trace_open(mysocket_t sd, const char *path)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    stcp_trace_ring_t *ring;
+    trace_file_t *file;
+
+    assert(ctx && path);
+    if (ctx->trace)
+        return;
+
+    PTHREAD_CALL(pthread_once(&trace_once, _trace_start));
+
+    PTHREAD_CALL(pthread_mutex_lock(&trace_lock));
+    if ((file = _trace_file_get(path)) == NULL)
+    {
+        DEBUG_LOG(("stcp_trace_open(%d):  can't open %s\n", sd, path));
+        PTHREAD_CALL(pthread_mutex_unlock(&trace_lock));
+        return;
+    }
+
+    ring = (stcp_trace_ring_t *) malloc(sizeof(stcp_trace_ring_t));
+    assert(ring);
+    memset(ring, 0, offsetof(stcp_trace_ring_t, records));
+    ring->sd   = sd;
+    ring->file = file;
+    ring->next = trace_rings;
+    trace_rings = ring;
+    PTHREAD_CALL(pthread_mutex_unlock(&trace_lock));
+
+    ctx->trace = ring;
+}
+
+/* record an event (see stcp_api.h) */
+void stcp_trace(mysocket_t sd, stcp_trace_type_t type, uint32_t seq,
+                uint32_t ack, uint32_t len, uint32_t cwnd, uint32_t swnd,
+                uint32_t avail)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    stcp_trace_ring_t *ring;
+    stcp_trace_record_t *rec;
+    struct timespec now;
+    unsigned int tail, used;
+
+    assert(ctx);
+    if ((ring = ctx->trace) == NULL)
+        return;
+
+    tail = ring->tail;
+    used = tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if (used == TRACE_RING_SIZE)
+    {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    rec = &ring->records[tail % TRACE_RING_SIZE];
+    rec->time  = (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+    rec->sd    = sd;
+    rec->type  = type;
+    rec->seq   = seq;
+    rec->ack   = ack;
+    rec->len   = len;
+    rec->cwnd  = cwnd;
+    rec->swnd  = swnd;
+    rec->avail = avail;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+
+    /* don't wait for the next flush if the ring is filling up */
+    if (used + 1 == TRACE_RING_SIZE / 2)
+        PTHREAD_CALL(pthread_cond_signal(&trace_cond));
+}
+
+/* called once STCP is done with the connection:  no more events will come,
+ * so the tracer can write out the rest and free the ring
+ */
+void _mysock_trace_close(mysock_context_t *ctx)
+{
+    stcp_trace_ring_t *ring = ctx->trace;
+
+    if (!ring)
+        return;
+    ctx->trace = NULL;
+    __atomic_store_n(&ring->closed, TRUE, __ATOMIC_RELEASE);
+    PTHREAD_CALL(pthread_cond_signal(&trace_cond));
+}
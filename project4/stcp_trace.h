@@ -0,0 +1,39 @@
+/* stcp_trace.h--format of the binary event traces written for
+ * stcp_trace_open() (see stcp_trace.c), and read back by stcp_trace2txt.
+ *
+ * a trace file is a header followed by fixed-size records, in host byte
+ * order, as the file is meant to be read on the machine that wrote it.
+ * every connection tracing to the same file shares it, so records carry
+ * the mysocket descriptor they came from.
+ */
+
+#ifndef __STCP_TRACE_H__
+#define __STCP_TRACE_H__
+
+#include "mysock.h"
+#include "stcp_api.h"   /* stcp_trace_type_t */
+
+#define STCP_TRACE_MAGIC    "STCPTRC"
+#define STCP_TRACE_VERSION  1
+
+typedef struct
+{
+    char     magic[8];      /* STCP_TRACE_MAGIC, NUL terminated */
+    uint32_t version;       /* STCP_TRACE_VERSION */
+    uint32_t record_size;   /* sizeof(stcp_trace_record_t) */
+} stcp_trace_header_t;
+
+typedef struct
+{
+    uint64_t time;      /* CLOCK_REALTIME, in nanoseconds */
+    uint32_t sd;        /* mysocket descriptor */
+    uint32_t type;      /* stcp_trace_type_t */
+    uint32_t seq;
+    uint32_t ack;
+    uint32_t len;
+    uint32_t cwnd;
+    uint32_t swnd;      /* send window, min(cwnd, peer's window) */
+    uint32_t avail;     /* part of swnd not in flight */
+} stcp_trace_record_t;
+
+#endif  /* __STCP_TRACE_H__ */
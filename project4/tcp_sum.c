@@ -1,6 +1,7 @@
 /* TCP checksum support--this is not used directly by students */
 
 #include <stddef.h>
+#include <string.h>
 #include <assert.h>
 #include <netinet/in.h>
 #include "mysock_impl.h"
@@ -8,13 +9,120 @@
 #include "tcp_sum.h"
 
 
-/* computes checksum for TCP segment, based on description in RFCs 793 and
- * 1071, and Berkeley in_cksum().
+/* the one's complement sum is computed as in RFC 1071:  words are added in
+ * host byte order (which yields the host byte order of the 16-bit sum), and
+ * carries are deferred to a wide accumulator and folded in at the end.
+ * buffers are read eight bytes at a time, and need not be aligned.
  */
-uint16_t _mysock_tcp_checksum(uint32_t src_addr /*network byte order*/,
-                              uint32_t dst_addr /*network byte order*/,
-                              const void *packet,
-                              size_t len /*host byte order*/)
+
+/* fold a 64-bit accumulator to a 16-bit one's complement sum */
+static uint32_t _csum_fold(uint64_t sum)
+{
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    return (uint32_t) sum;
+}
+
+/* add len bytes at buf to the accumulator.  each 64-bit word is added as
+ * two 32-bit halves, so the accumulator can't overflow for any buffer
+ * shorter than 16GB.  if dst is non-NULL, the buffer is copied there on
+ * the way through.
+ */
+static uint64_t _csum_add(uint64_t sum, void *dst, const void *buf, size_t len)
+{
+    const uint8_t *src = (const uint8_t *) buf;
+    uint8_t *out = (uint8_t *) dst;
+    uint64_t sum2 = 0;
+    uint64_t w0, w1;
+
+    /* two independent accumulators, so the adds needn't wait on each
+     * other
+     */
+    for (; len >= 16; len -= 16, src += 16)
+    {
+        memcpy(&w0, src, 8);
+        memcpy(&w1, src + 8, 8);
+        sum  += (w0 & 0xffffffff) + (w0 >> 32);
+        sum2 += (w1 & 0xffffffff) + (w1 >> 32);
+        if (out)
+        {
+            memcpy(out, src, 16);
+            out += 16;
+        }
+    }
+    sum += sum2;
+
+    if (len >= 8)
+    {
+        memcpy(&w0, src, 8);
+        sum += (w0 & 0xffffffff) + (w0 >> 32);
+        if (out)
+        {
+            memcpy(out, src, 8);
+            out += 8;
+        }
+        src += 8;
+        len -= 8;
+    }
+
+    if (len > 0)
+    {
+        /* the last word is padded with zero bytes (at the end, in memory--
+         * i.e. at the low-order end in network byte order, whatever the
+         * host byte order)
+         */
+        w0 = 0;
+        memcpy(&w0, src, len);
+        sum += (w0 & 0xffffffff) + (w0 >> 32);
+        if (out)
+            memcpy(out, src, len);
+    }
+
+    return sum;
+}
+
+/* one's complement sum of len bytes at buf (not folded into 16 bits) */
+uint32_t _mysock_csum_partial(const void *buf, size_t len)
+{
+    assert(buf || !len);
+    return _csum_fold(_csum_add(0, NULL, buf, len));
+}
+
+/* copy len bytes from src to dst, returning their one's complement sum */
+uint32_t _mysock_csum_copy(void *dst, const void *src, size_t len)
+{
+    assert(dst && (src || !len));
+    return _csum_fold(_csum_add(0, dst, src, len));
+}
+
+/* add the sum of a block that starts offset bytes into the segment to the
+ * sum of what precedes it.  a block starting at an odd offset has its bytes
+ * in the other halves of the 16-bit words, so its sum is byte-swapped.
+ */
+uint32_t _mysock_csum_block_add(uint32_t sum, uint32_t block_sum,
+                                size_t offset)
+{
+    if (offset & 1)
+        block_sum = ((block_sum & 0xff) << 8) | ((block_sum >> 8) & 0xff);
+    return _csum_fold((uint64_t) sum + block_sum);
+}
+
+/* the sum after a 16-bit word counted in it changed from old_word to
+ * new_word (RFC 1624 eqn. 3)
+ */
+uint32_t _mysock_csum_replace(uint32_t sum,
+                              uint16_t old_word, uint16_t new_word)
+{
+    return _csum_fold((uint64_t) sum + (uint16_t) ~old_word + new_word);
+}
+
+
+/* one's complement sum of the 96-bit pseudo header */
+static uint32_t _mysock_pseudo_sum(uint32_t src_addr, uint32_t dst_addr,
+                                   size_t len)
 {
     struct
     {
@@ -28,59 +136,66 @@ uint16_t _mysock_tcp_checksum(uint32_t src_addr /*network byte order*/,
         src_addr, dst_addr, 0, IPPROTO_TCP, htons(len)
     };
 
-    unsigned int k;
-    int32_t sum = 0;
-
-    assert(packet && len >= sizeof(struct tcphdr));
     assert(sizeof(pseudo_header) == 12);
-
-
     assert(src_addr > 0);
     assert(dst_addr > 0);
 
-    /* process 96-bit pseudo header */
-    for (k = 0; k < sizeof(pseudo_header) / sizeof(uint16_t); ++k)
-        sum += ((uint16_t *) &pseudo_header)[k];
+    return _mysock_csum_partial(&pseudo_header, sizeof(pseudo_header));
+}
 
-    /* process TCP header and payload */
-    assert(((long)packet & 2) == 0);
-    assert((offsetof(struct tcphdr, th_sum) & 2) == 0);
-    for (k = 0; k < (len >> 1); ++k)
-    {
-        if (k == (offsetof(struct tcphdr, th_sum) >> 1))
-            continue;   /* th_sum == 0 during checksum computation */
-        sum += ((uint16_t *) packet)[k];
-    }
+/* computes checksum for TCP segment, based on description in RFCs 793 and
+ * 1071, and Berkeley in_cksum().  the segment's th_sum is taken to be zero.
+ */
+uint16_t _mysock_tcp_checksum(uint32_t src_addr /*network byte order*/,
+                              uint32_t dst_addr /*network byte order*/,
+                              const void *packet,
+                              size_t len /*host byte order*/)
+{
+    uint32_t sum;
 
-    if (len & 1)
-    {
-        uint16_t tmp = 0;
-        *(uint8_t *) &tmp = ((uint8_t *) packet)[len - 1];
-        sum += tmp;
-    }
+    assert(packet && len >= sizeof(struct tcphdr));
 
-    /* fold 32-bit sum to 16 bits */
-    sum = (sum >> 16) + (sum & 0xffff);
-    sum += (sum >> 16);
+    /* th_sum == 0 during checksum computation */
+    sum = _mysock_csum_replace(_mysock_csum_partial(packet, len),
+                               ((const struct tcphdr *) packet)->th_sum, 0);
+    sum = _mysock_csum_block_add(sum, _mysock_pseudo_sum(src_addr, dst_addr,
+                                                         len), 0);
 
     return (uint16_t) ~sum;
 }
 
-/* update checksum in the given STCP segment */
-void _mysock_set_checksum(const mysock_context_t *ctx,
-                          void *packet, size_t len)
+/* fill in th_sum in the given STCP segment, given the sum of the segment
+ * (as computed by _mysock_csum_partial() etc.) with th_sum zero
+ */
+void _mysock_finish_checksum(const mysock_context_t *ctx,
+                             void *packet, size_t len, uint32_t sum)
 {
     assert(ctx && packet);
     assert(len >= sizeof(struct tcphdr));
+    assert(((struct tcphdr *) packet)->th_sum == 0);
 
     assert(ctx->network_state.peer_addr.sa_family == AF_INET);
 
-    ((struct tcphdr *) packet)->th_sum = _mysock_tcp_checksum(
+    sum = _mysock_csum_block_add(sum, _mysock_pseudo_sum(
         _network_get_local_addr((network_context_t *)
                                 &ctx->network_state), /*src*/
         ((struct sockaddr_in *) &ctx->network_state.peer_addr)-> /*dst*/
             sin_addr.s_addr,
-        packet, len);
+        len), 0);
+
+    ((struct tcphdr *) packet)->th_sum = (uint16_t) ~sum;
+}
+
+/* update checksum in the given STCP segment */
+void _mysock_set_checksum(const mysock_context_t *ctx,
+                          void *packet, size_t len)
+{
+    assert(ctx && packet);
+    assert(len >= sizeof(struct tcphdr));
+
+    ((struct tcphdr *) packet)->th_sum = 0;
+    _mysock_finish_checksum(ctx, packet, len,
+                            _mysock_csum_partial(packet, len));
 }
 
 /* returns TRUE if checksum is correct, FALSE otherwise */
@@ -15,6 +15,21 @@ uint16_t _mysock_tcp_checksum(uint32_t src_addr /*network byte order*/,
 void _mysock_set_checksum(const struct mysock_context *ctx,
                           void *packet, size_t len);
 
+/* for building a segment's checksum as it is put together:  sums of the
+ * pieces (one's complement, not yet complemented), combined by
+ * _mysock_csum_block_add(), then _mysock_finish_checksum() adds the pseudo
+ * header and fills in th_sum.
+ */
+uint32_t _mysock_csum_partial(const void *buf, size_t len);
+uint32_t _mysock_csum_copy(void *dst, const void *src, size_t len);
+uint32_t _mysock_csum_block_add(uint32_t sum, uint32_t block_sum,
+                                size_t offset);
+uint32_t _mysock_csum_replace(uint32_t sum,
+                              uint16_t old_word, uint16_t new_word);
+
+void _mysock_finish_checksum(const struct mysock_context *ctx,
+                             void *packet, size_t len, uint32_t sum);
+
 bool_t _mysock_verify_checksum(const mysock_context_t *ctx,
                                const void *packet, size_t len);
 
@@ -0,0 +1,116 @@
+/*
+ * trace2txt.c
+ *
+ * Converts an STCP event trace (client_log.bin, server_log.bin; see
+ * stcp_trace.h) to text on stdout.  By default it writes the Send/Recv
+ * lines logic checks:
+ *
+ *   Send:  swnd  avail  bytes     new data sent
+ *   Recv:  swnd  avail  bytes     new data acknowledged
+ *
+ * With -a, every event is written instead, one per line:  time (in
+ * microseconds since the first event), mysocket, event, seq, ack, len,
+ * cwnd, swnd and avail.  -c keeps only the events of one mysocket, for a
+ * trace shared by several connections.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "stcp_trace.h"
+
+
+static char usage[] = "usage: %s [-a] [-c mysocket] trace-file\n";
+
+static const char *event_names[] =
+{
+    "?", "send", "acked", "retransmit", "dupack", "timeout", "recovery",
+    "dropped"
+};
+
+
+/**********************************************************************/
+int
+main(int argc, char *argv[])
+{
+    stcp_trace_header_t header;
+    stcp_trace_record_t rec;
+    uint64_t start = 0;
+    bool_t all = FALSE, first = TRUE;
+    long only_sd = -1;
+    int opt, errflg = 0;
+    FILE *fp;
+
+    while ((opt = getopt(argc, argv, "ac:")) != EOF)
+    {
+        switch (opt)
+        {
+        case 'a':
+            all = TRUE;
+            break;
+        case 'c':
+            only_sd = atol(optarg);
+            break;
+        case '?':
+            ++errflg;
+            break;
+        }
+    }
+
+    if (errflg || optind != argc - 1)
+    {
+        fprintf(stderr, usage, argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    if ((fp = fopen(argv[optind], "rb")) == NULL)
+    {
+        perror(argv[optind]);
+        exit(EXIT_FAILURE);
+    }
+    if (fread(&header, sizeof(header), 1, fp) != 1 ||
+        memcmp(header.magic, STCP_TRACE_MAGIC, sizeof(STCP_TRACE_MAGIC)) ||
+        header.version != STCP_TRACE_VERSION ||
+        header.record_size != sizeof(rec))
+    {
+        fprintf(stderr, "%s: not an STCP trace (or from another version)\n",
+                argv[optind]);
+        exit(EXIT_FAILURE);
+    }
+
+    while (fread(&rec, sizeof(rec), 1, fp) == 1)
+    {
+        if (only_sd >= 0 && rec.sd != (uint32_t) only_sd)
+            continue;
+
+        if (all)
+        {
+            if (first)
+                start = rec.time;
+            first = FALSE;
+            printf("%.3f\t%u\t%s\t%u\t%u\t%u\t%u\t%u\t%u\n",
+                   (double) (rec.time - start) / 1000, rec.sd,
+                   rec.type < sizeof(event_names) / sizeof(event_names[0]) ?
+                       event_names[rec.type] : "?",
+                   rec.seq, rec.ack, rec.len, rec.cwnd, rec.swnd, rec.avail);
+        }
+        else if (rec.type == STCP_TRACE_SEND)
+        {
+            printf("Send:\t%u\t%u\t%u\n", rec.swnd, rec.avail, rec.len);
+        }
+        else if (rec.type == STCP_TRACE_ACKED)
+        {
+            printf("Recv:\t%u\t%u\t%u\n", rec.swnd, rec.avail, rec.len);
+        }
+        else if (rec.type == STCP_TRACE_DROPPED)
+        {
+            fprintf(stderr, "%s: %u events of mysocket %u were lost\n",
+                    argv[optind], rec.len, rec.sd);
+        }
+    }
+
+    fclose(fp);
+    return 0;
+}
@@ -22,9 +22,50 @@
 /* my headers */
 #include <arpa/inet.h>
 #include <stdbool.h>
+#include <time.h>
 
 /* my macros */
-#define WINDOW_SIZE 3072
+// receive buffer: data not yet read by the app plus the window we advertise
+// always fit in it (so stcp_app_send() never blocks), and the reassembly
+// ring below is just as big
+#define RCV_BUFFER_SIZE STCP_APP_BUFFER_SIZE
+// window scale we offer (RFC 7323); RCV_BUFFER_SIZE >> RCV_WSCALE must fit
+// in the 16-bit window field
+#define RCV_WSCALE 3
+// max # of separate out-of-order blocks; segments opening a new hole beyond
+// this are dropped and left to the sender to retransmit
+#define MAX_RCV_BLOCKS 32
+// retransmission timeout bounds (RFC 6298), in microseconds.
+// RTO_MAX is well below the RFC's 60s since STCP only runs on LAN-like links.
+#define RTO_INITIAL 1000000L
+#define RTO_MIN     200000L
+#define RTO_MAX     8000000L
+// give up on the connection after this many timeouts of the same segment
+#define MAX_RETRANSMITS 8
+// sequence number comparisons that survive wrap-around
+#define SEQ_LT(a, b)  ((int32_t)((a) - (b)) < 0)
+#define SEQ_LEQ(a, b) ((int32_t)((a) - (b)) <= 0)
+#define SEQ_GT(a, b)  ((int32_t)((a) - (b)) > 0)
+#define SEQ_GEQ(a, b) ((int32_t)((a) - (b)) >= 0)
+#define TIMESPEC_LEQ(a, b) ((a).tv_sec < (b).tv_sec || ((a).tv_sec == (b).tv_sec && (a).tv_nsec <= (b).tv_nsec))
+// delayed ACKs (RFC 1122): ACK every DELACK_SEGMENTS in-order segments, or
+// DELACK_TIMEOUT microseconds after the first unacknowledged one
+#define DELACK_SEGMENTS 2
+#define DELACK_TIMEOUT  40000L
+// TCP options; the header may grow by at most 40 bytes
+#define MAX_OPTIONS_LEN 40
+#define TCPOPT_EOL           0
+#define TCPOPT_NOP           1
+#define TCPOPT_MSS           2
+#define TCPOPT_WSCALE        3
+#define TCPOPT_SACK_PERMITTED 4
+#define TCPOPT_SACK          5
+// at most 4 SACK blocks fit in the option space (RFC 2018)
+#define MAX_SACK_BLOCKS 4
+// a hole is presumed lost after this many duplicate ACKs, or once this many
+// segments' worth of data above it has been SACKed (RFC 6675's DupThresh)
+#define DUPTHRESH 3
+// build with -DNO_SACK to fall back to cumulative ACKs only
 // set when we want to debug, and PrintPacket() will print something
 //#define __DEBUG__ 1
 
@@ -53,6 +94,50 @@ enum PacketType {
 };
 typedef enum PacketType PacketType;
 
+/* a sent but not yet acknowledged segment, kept for retransmission */
+typedef struct segment
+{
+    tcp_seq seq;                // first sequence number of the segment
+    PacketType type;            // SYN, SYNACK, DATA or FINACK
+    size_t len;                 // payload length
+    struct timespec sent_time;  // time of the latest transmission
+    unsigned int transmissions; // > 1 once retransmitted (Karn's rule)
+    bool sacked;                // the peer holds it out of order
+    bool rexmit;                // resent since the last loss was detected
+    struct segment *next;
+    char data[];                // payload
+} segment_t;
+
+/* header and options of an outgoing segment; the payload is handed to
+ * stcp_network_sendv() separately
+ */
+typedef struct
+{
+    STCPHeader header;
+    char options[MAX_OPTIONS_LEN];
+} packet_header_t;
+
+/* sequence space taken by a segment; SYN and FIN count as one byte */
+#define SEG_SEQ_LEN(s) ((s)->type == DATA ? (s)->len : 1)
+
+/* a run of out-of-order bytes [start, end) held in the reassembly buffer */
+typedef struct
+{
+    tcp_seq start;
+    tcp_seq end;
+} rcv_block_t;
+
+/* options we understand from a received segment */
+typedef struct
+{
+    uint16_t mss;           // 0 if absent
+    bool sack_permitted;
+    bool wscale_present;
+    unsigned int wscale;
+    int num_sack_blocks;
+    rcv_block_t sack_blocks[MAX_SACK_BLOCKS];
+} stcp_options_t;
+
 /* this structure is global to a mysocket descriptor */
 typedef struct
 {
@@ -60,26 +145,73 @@ typedef struct
 
     int connection_state;   /* state of the connection (established, etc.) */
     tcp_seq initial_sequence_num;
+    bool_t is_active;       /* TRUE if we sent the SYN */
+    uint32_t mss;           /* segment size both ends agreed on */
+    uint32_t rcv_mss;       /* largest segment we can take, offered in our SYN */
 
     /* any other connection-wide global variables go here */
     /* my variables */
-    // already sent
-    tcp_seq prev_seq;
-    tcp_seq prev_ack;
-    size_t prev_len;
-    // received
-    tcp_seq rcvd_seq;
-    tcp_seq rcvd_ack;
-    size_t rcvd_len;
-    tcp_seq rcvd_win;
-    // to be sent
-    tcp_seq next_seq;
+    // send sequence space
+    tcp_seq snd_una;    // oldest unacknowledged sequence number
+    tcp_seq snd_nxt;    // next sequence number to send; pulled back on timeout
+    tcp_seq snd_max;    // highest sequence number sent so far, plus one
+    // receive sequence space
+    tcp_seq rcv_nxt;    // next sequence number expected from the peer
+    tcp_seq rcv_adv;    // right edge of the window we last advertised
+    uint32_t rcvd_win;  // window advertised by the peer
+    // window scaling, both 0 unless both ends sent the option
+    unsigned int snd_wscale;    // applied to windows we receive
+    unsigned int rcv_wscale;    // applied to windows we send
+    bool persist;       // peer's window is closed: may probe it with one byte
+    // sender-side coalescing of small writes (Nagle, RFC 896)
+    bool nodelay;       // STCP_NODELAY: never hold back a partial segment
+    bool cork;          // STCP_CORK: always hold back a partial segment
+    size_t app_lowat;   // APP_DATA low-water mark last set
+    // reassembly buffer: a ring in which rcv_buffer[rcv_head] holds the
+    // byte at rcv_nxt, so byte seq sits (seq - rcv_nxt) further along.
+    // allocated when the first segment arrives out of order
+    char *rcv_buffer;
+    size_t rcv_head;
+    rcv_block_t rcv_blocks[MAX_RCV_BLOCKS];   // sorted by sequence number
+    int num_rcv_blocks;
+    bool rcv_fin_pending;   // FIN arrived ahead of some data
+    tcp_seq rcv_fin_seq;
+    tcp_seq rcv_last_seq;   // latest out-of-order arrival, reported first
+    // selective acknowledgements (RFC 2018/6675)
+    bool sack_permitted;    // both ends sent SACK-permitted
+    uint32_t sacked_bytes;  // bytes of queued segments marked sacked
+    // fast retransmit/recovery (NewReno, RFC 6582, or RFC 6675 with SACK)
+    unsigned int dupacks;   // duplicate ACKs in a row
+    bool in_recovery;       // repairing holes without waiting for the RTO
+    tcp_seq recover;        // snd_max when recovery (or the last timeout) began
     // windows
     uint32_t cwnd;
+    uint32_t ssthresh;
     uint32_t swnd;
     uint32_t remainder_window;
-    // log file pointer
-    FILE *logfile;
+    // retransmission queue, oldest segment first
+    segment_t *unacked_head;
+    segment_t *unacked_tail;
+    // acknowledged segments kept for reuse, each with room for rcv_mss
+    // bytes, so that steady-state sending doesn't touch the heap
+    segment_t *free_segs;
+    // retransmission timer; all durations are in microseconds
+    long srtt;
+    long rttvar;
+    long rto;               // before backoff
+    bool rtt_valid;         // false until the first RTT sample
+    bool timer_running;
+    struct timespec timer_expiry;
+    unsigned int timeouts;  // consecutive timeouts, i.e. the RTO backoff shift
+    // delayed ACK
+    bool delack_pending;    // in-order data received but not acknowledged
+    unsigned int delack_segs;
+    struct timespec delack_expiry;
+    // running totals for mygetsockopt(STCP_INFO); PublishInfo() fills in the rest
+    struct stcp_info info;
+    // big enough for any segment we told the peer it may send
+    char *buffer;
+    size_t buffer_length;
 } context_t;
 
 
@@ -88,10 +220,37 @@ static void control_loop(mysocket_t sd, context_t *ctx);
 
 
 /* My functions start */
-STCPHeader* CreatePacket(tcp_seq seqnum, tcp_seq acknum, PacketType type, char* payload, size_t length);
+size_t CreatePacket(packet_header_t* packet, tcp_seq seqnum, tcp_seq acknum, PacketType type, size_t options_length);
+size_t BuildOptions(context_t* ctx, PacketType type, char* options);
+void ParseOptions(STCPHeader* packet, size_t header_length, stcp_options_t* options);
+void NegotiateOptions(context_t* ctx, stcp_options_t* options);
 bool SendPacket(mysocket_t sd, context_t* ctx, PacketType type, char* src, size_t src_len);
-bool WaitPacket(mysocket_t sd, context_t* ctx, PacketType type);
+bool SendSegment(mysocket_t sd, context_t* ctx, segment_t* seg, PacketType type, size_t len);
+bool TransmitSegment(mysocket_t sd, context_t* ctx, segment_t* seg);
+segment_t* GetSegment(context_t* ctx);
+void PutSegment(context_t* ctx, segment_t* seg);
+void RetransmitPending(mysocket_t sd, context_t* ctx);
+void HandlePacket(mysocket_t sd, context_t* ctx, STCPHeader* packet, size_t length);
+void ProcessAck(mysocket_t sd, context_t* ctx, tcp_seq acknum, uint32_t window, stcp_options_t* options, bool bare);
+void UpdateScoreboard(context_t* ctx, stcp_options_t* options);
+void DetectLoss(mysocket_t sd, context_t* ctx);
+bool IsLost(context_t* ctx, segment_t* seg, uint32_t sacked_above);
+uint32_t BytesInFlight(context_t* ctx);
+void ReceiveData(mysocket_t sd, context_t* ctx, tcp_seq seqnum, bool fin, char* payload, size_t length);
+bool StoreOutOfOrder(context_t* ctx, tcp_seq seqnum, char* payload, size_t length);
+void DeliverInOrder(mysocket_t sd, context_t* ctx);
+void ConnectionEstablished(mysocket_t sd, context_t* ctx);
+void UpdateWindow(context_t* ctx);
+uint32_t ReceiveWindow(mysocket_t sd, context_t* ctx);
+uint16_t AdvertiseWindow(mysocket_t sd, context_t* ctx, PacketType type);
+void SendWindowUpdate(mysocket_t sd, context_t* ctx);
+void UpdateRTO(context_t* ctx, long sample);
+void StartTimer(context_t* ctx);
+void SetDeadline(struct timespec* deadline, long usec);
+void HandleTimeout(mysocket_t sd, context_t* ctx);
 void PrintPacket(STCPHeader *packet, bool isSend);
+void PublishInfo(mysocket_t sd, context_t* ctx);
+void Trace(mysocket_t sd, context_t* ctx, stcp_trace_type_t type, tcp_seq seq, tcp_seq ack, size_t len);
 /* My functions end */
 
 /* initialise the transport layer, and start the main loop, handling
@@ -99,6 +258,21 @@ void PrintPacket(STCPHeader *packet, bool isSend);
  * return until the connection is closed.
  */
 void transport_init(mysocket_t sd, bool_t is_active)
+{
+    transport_open(sd, is_active);
+    control_loop(sd, (context_t *) stcp_get_context(sd));
+    transport_close(sd);
+}
+
+
+/* the same, one step at a time, for callers that run many connections
+ * from an event loop of their own (see transport_pool.c):  transport_open()
+ * sets the connection up, transport_wants() returns the events to wait for
+ * and until when (or 0 once the connection is over), transport_handle()
+ * acts on the events that occurred (possibly none, if the deadline passed),
+ * and transport_close() frees everything.
+ */
+void transport_open(mysocket_t sd, bool_t is_active)
 {
     context_t *ctx;
 
@@ -106,6 +280,7 @@ void transport_init(mysocket_t sd, bool_t is_active)
     assert(ctx);
 
     generate_initial_seq_num(ctx);
+    ctx->is_active = is_active;
 
     /* XXX: you should send a SYN packet here if is_active, or wait for one
      * to arrive if !is_active.  after the handshake completes, unblock the
@@ -115,68 +290,65 @@ void transport_init(mysocket_t sd, bool_t is_active)
      * ECONNREFUSED, etc.) before calling the function.
      */
 
-    /* initialize cwnd, swnd, remainder_window and connection_state*/
-    ctx->cwnd = STCP_MSS;
-    ctx->swnd = STCP_MSS;
-    ctx->remainder_window = STCP_MSS;
+    /* initialize windows, timer and connection_state; the MSS stays at the
+     * default until the peer offers a larger one
+     */
+    ctx->mss = STCP_MSS;
+    ctx->rcv_mss = stcp_network_mtu(sd) - sizeof(STCPHeader);
+    assert(ctx->rcv_mss >= STCP_MSS);
+    ctx->cwnd = ctx->mss;
+    ctx->ssthresh = 4 * ctx->mss;
+    ctx->swnd = ctx->mss;
+    ctx->remainder_window = ctx->mss;
+    ctx->rcvd_win = ctx->mss;
+    ctx->rto = RTO_INITIAL;
+    ctx->snd_una = ctx->initial_sequence_num;
+    ctx->snd_nxt = ctx->initial_sequence_num;
+    ctx->snd_max = ctx->initial_sequence_num;
+    ctx->recover = ctx->initial_sequence_num;
     ctx->connection_state = CSTATE_LISTEN;
 
+    ctx->buffer_length = sizeof(STCPHeader) + MAX_OPTIONS_LEN + ctx->rcv_mss;
+    ctx->buffer = (char *)calloc(1, ctx->buffer_length);
+    assert(ctx->buffer);
+    stcp_set_context(sd, ctx);
+
     if (is_active) {
-	    // send SYN & change state
+        // send SYN & change state; the rest of the handshake (and any
+        // retransmission of the SYN) is driven by transport_handle()
         if (!SendPacket(sd, ctx, SYN, NULL, 0)) {
             perror("3-way handshake send SYN");
-            free(ctx);
             errno = ECONNREFUSED;
-            return;
+            ctx->done = 1;
         }
         ctx->connection_state = CSTATE_SYN_SENT;
-        if (!WaitPacket(sd, ctx, SYNACK)) {
-            perror("3-way handshake wait SYNACK");
-            free(ctx);
-            errno = ECONNREFUSED;
-            return;
-        }
-        ctx->connection_state = CSTATE_ESTABLISHED;
-        if (!SendPacket(sd, ctx, ACK, NULL, 0)) {
-            perror("3-way handshake send ACK");
-            free(ctx);
-            errno = ECONNREFUSED;
-            return;
-        }
-        ctx->logfile = fopen("client_log.txt", "w");
-    }
-	else {
-        // wait for SYN packet to arrive
-        if (!WaitPacket(sd, ctx, SYN)) {
-            perror("3-way handshake wait SYN");
-            free(ctx);
-            errno = ECONNREFUSED;
-            return;
-        }
-        if (!SendPacket(sd, ctx, SYNACK, NULL, 0)) {
-            perror("3-way handshake send SYNACK");
-            free(ctx);
-            errno = ECONNREFUSED;
-            return;
-        }
-        ctx->connection_state = CSTATE_SYN_RCVD;
-        if (!WaitPacket(sd, ctx, ACK)) {
-            perror("3-way handshake wait ACK");
-            free(ctx);
-            errno = ECONNREFUSED;
-            return;
-        }
-        ctx->connection_state = CSTATE_ESTABLISHED;
-        ctx->logfile = fopen("server_log.txt", "w");
     }
+    // otherwise stay in LISTEN; transport_handle() answers the peer's SYN
+}
 
-    stcp_unblock_application(sd);
+void transport_close(mysocket_t sd)
+{
+    context_t *ctx = (context_t *) stcp_get_context(sd);
+    segment_t *seg;
+    int saved_errno;
+
+    assert(ctx);
 
-    control_loop(sd, ctx);
-    
     /* do any cleanup here */
-    fclose(ctx->logfile);
+    saved_errno = errno;
+    while ((seg = ctx->unacked_head)) {
+        ctx->unacked_head = seg->next;
+        free(seg);
+    }
+    while ((seg = ctx->free_segs)) {
+        ctx->free_segs = seg->next;
+        free(seg);
+    }
+    free(ctx->buffer);
+    free(ctx->rcv_buffer);
     free(ctx);
+    stcp_set_context(sd, NULL);
+    errno = saved_errno;
 }
 
 
@@ -199,171 +371,175 @@ static void control_loop(mysocket_t sd, context_t *ctx)
 {
     assert(ctx);
 
-    unsigned int event;
+    unsigned int event, flags;
+    const struct timespec *deadline;
+
+    while ((flags = transport_wants(sd, &deadline)) != 0)
+    {
+        /* see stcp_api.h or stcp_api.c for details of this function */
+        event = stcp_wait_for_event(sd, flags, deadline);
+        transport_handle(sd, event);
+    }
+}
+
+/* the events control_loop() should wait for next, and the time by which
+ * it should wake up regardless (NULL if none); 0 once the connection is
+ * over
+ */
+unsigned int transport_wants(mysocket_t sd, const struct timespec **deadline)
+{
+    context_t *ctx = (context_t *) stcp_get_context(sd);
+    unsigned int flags;
+    size_t lowat;
+
+    assert(ctx && deadline);
+    // whatever the last events changed, the app may look at it now
+    PublishInfo(sd, ctx);
+    if (ctx->done)
+        return 0;
+
+    // only ask for app data while we can send it, and after anything
+    // that is waiting to be retransmitted
+    flags = NETWORK_DATA | APP_CLOSE_REQUESTED | APP_SOCKOPT;
+    if ((ctx->connection_state == CSTATE_ESTABLISHED || ctx->connection_state == CSTATE_CLOSE_WAIT) &&
+        (ctx->remainder_window > 0 || ctx->persist) && ctx->snd_nxt == ctx->snd_max) {
+        flags |= APP_DATA;
+        // Nagle: while data is unacknowledged, small writes pile up
+        // until a full segment's worth is queued (or until myclose())
+        lowat = 1;
+        if ((ctx->cork || (!ctx->nodelay && ctx->snd_una != ctx->snd_max)) &&
+            ctx->remainder_window > 0) {
+            lowat = ctx->mss;
+        }
+        if (lowat != ctx->app_lowat) {
+            stcp_set_app_data_lowat(sd, lowat);
+            ctx->app_lowat = lowat;
+        }
+    }
+    // and for the app to read, while a window update may be due
+    if ((ctx->connection_state == CSTATE_ESTABLISHED || ctx->connection_state == CSTATE_FIN_WAIT1 ||
+         ctx->connection_state == CSTATE_FIN_WAIT2) &&
+        ctx->rcv_adv - ctx->rcv_nxt <= RCV_BUFFER_SIZE - MIN(RCV_BUFFER_SIZE / 2, ctx->mss)) {
+        flags |= APP_DATA_READ;
+    }
+
+    // wake up for whichever of the two timers goes off first
+    *deadline = ctx->timer_running ? &ctx->timer_expiry : NULL;
+    if (ctx->delack_pending && (!*deadline || TIMESPEC_LEQ(ctx->delack_expiry, **deadline))) {
+        *deadline = &ctx->delack_expiry;
+    }
+    return flags;
+}
+
+/* act on the events stcp_wait_for_event() returned, then on any timer
+ * that has gone off
+ */
+void transport_handle(mysocket_t sd, unsigned int event)
+{
+    context_t *ctx = (context_t *) stcp_get_context(sd);
     char *buffer;
-    size_t max_length = 0;
+    size_t buffer_length, max_length = 0;
     ssize_t data_length = 0;
+    struct timespec now;
 
-    while (!ctx->done)
-    {
+    assert(ctx);
+    buffer = ctx->buffer;
+    buffer_length = ctx->buffer_length;
 
-        /* see stcp_api.h or stcp_api.c for details of this function */
-        /* XXX: you will need to change some of these arguments! */
-        event = stcp_wait_for_event(sd, ANY_EVENT, NULL);
-
-        max_length = (ctx->remainder_window > STCP_MSS) ? STCP_MSS : ctx->remainder_window;
-        //max_length -= sizeof(STCPHeader);
-        
-        buffer = (char *)calloc(1, STCP_MSS + sizeof(STCPHeader));
-        STCPHeader *packet = (STCPHeader *)buffer;
-
-        /* check whether it was the network, app, or a close request */
-        if (event & APP_DATA) {
-            /* the application has requested that data be sent */
-            /* see stcp_app_recv() */
-            data_length = stcp_app_recv(sd, buffer, max_length);
-
-            if (data_length == 0) {
-                // something wrong
-                fprintf(stderr, "control_loop(): Supposed to get APP_DATA but received nothing.\n");
-                free(buffer);
-                free(ctx);
-                return;
-            }
-            if (!SendPacket(sd, ctx, DATA, buffer, data_length)) {
-                perror("control_loop(): Sending DATA");
-                free(buffer);
-                free(ctx);
-                return;
-            }
-            if (!WaitPacket(sd, ctx, ACK)) {
-                perror("control_loop(): Waiting for ACK of sent DATA");
-                free(buffer);
-                free(ctx);
-                return;
-            }
+    /* check whether it was the network, app, or a close request */
+    if (event & NETWORK_DATA) {
+        /* incoming data from the peer */
+        data_length = stcp_network_recv(sd, (void *)buffer, buffer_length);
+
+        if (data_length < (ssize_t)sizeof(STCPHeader)) {
+            // runt segment, just drop it
+            fprintf(stderr, "control_loop(): Supposed to get NETWORK_DATA but received something too small.\n");
+        }
+        else {
+            data_length = MIN(data_length, (ssize_t)buffer_length);
+            ctx->info.stcpi_segs_in++;
+            HandlePacket(sd, ctx, (STCPHeader *)buffer, (size_t)data_length);
+        }
+        if (!ctx->done) {
+            RetransmitPending(sd, ctx);
         }
-        
-        else if (event & NETWORK_DATA) {
-            /* incoming data from the peer */
-            data_length = stcp_network_recv(sd, (void *)buffer, max_length + sizeof(STCPHeader));
+    }
 
-            if (data_length < (ssize_t)sizeof(STCPHeader)) {
-                // something wrong
-                fprintf(stderr, "control_loop(): Supposed to get NETWORK_DATA but received something too small.\n");
-                free(buffer);
-                free(ctx);
-                return;
-            }
-            
-            PrintPacket((STCPHeader *)buffer, 0);
-            /* check for all possible closing cases */
-            if ((ctx->connection_state == CSTATE_ESTABLISHED) && (packet->th_flags & TH_FIN)) {
-                // was open -> asked to close: 4-way handshake
-                if (!SendPacket(sd, ctx, ACK, NULL, 0)) {
-                    perror("4-way handshake send FINACK 1");
-                    free(buffer);
-                    free(ctx);
-                    return;
-                }
-                ctx->connection_state = CSTATE_CLOSE_WAIT;
-                // notify upper layer
-                stcp_fin_received(sd);
-                if (!SendPacket(sd, ctx, FIN, NULL, 0)) {
-                    perror("4-way handshake send FIN 2");
-                    free(buffer);
-                    free(ctx);
-                    return;
-                }
-                ctx->connection_state = CSTATE_LAST_ACK;
-                if (!WaitPacket(sd, ctx, ACK)) {
-                    perror("4-way handshake wait FINACK 2");
-                    free(buffer);
-                    free(ctx);
-                    return;
-                }
-                ctx->connection_state = CSTATE_CLOSED;
-                ctx->done = 1;
-                break;
-            }
-            
-            else {
-                // regular data
-                stcp_app_send(sd, ((char *)buffer + sizeof(STCPHeader)), ((size_t)data_length - sizeof(STCPHeader)));
-
-                // set ctx fields for next ACK
-                STCPHeader *datapacket = (STCPHeader *)buffer;
-                ctx->rcvd_seq = ntohl(datapacket->th_seq);
-                ctx->rcvd_ack = ntohl(datapacket->th_ack);
-                ctx->rcvd_len = (size_t)data_length - sizeof(STCPHeader);
-                ctx->rcvd_win = ntohl(datapacket->th_win);
-
-                // send ACK
-                if (!SendPacket(sd, ctx, ACK, NULL, 0)) {
-                    perror("control_loop(): Sending ACK of received DATA");
-                    free(buffer);
-                    free(ctx);
-                    return;
-                }
-            }
+    if ((event & APP_DATA_READ) && !ctx->done) {
+        SendWindowUpdate(sd, ctx);
+    }
+
+    if (event & APP_SOCKOPT) {
+        ctx->nodelay = stcp_app_sockopt(sd, STCP_NODELAY);
+        ctx->cork = stcp_app_sockopt(sd, STCP_CORK);
+    }
+
+    // an ACK above might have shrunk the peer's window; if it is closed,
+    // a single byte may still go out as a window probe
+    max_length = (ctx->remainder_window > ctx->mss) ? ctx->mss : ctx->remainder_window;
+    if (max_length == 0 && ctx->persist) {
+        max_length = 1;
+    }
+
+    if ((event & APP_DATA) && !ctx->done && max_length > 0 && ctx->snd_nxt == ctx->snd_max) {
+        /* the application has requested that data be sent */
+        /* see stcp_app_recv() */
+        // the data is read straight into the segment that keeps it until
+        // it is acknowledged, and a segment may gather several small writes
+        segment_t *seg = GetSegment(ctx);
+        data_length = stcp_app_recv(sd, seg->data, max_length);
+        while (data_length > 0 && (size_t)data_length < max_length && stcp_app_recv_queued(sd) > 0) {
+            data_length += stcp_app_recv(sd, seg->data + data_length, max_length - data_length);
         }
-        else if (event & APP_CLOSE_REQUESTED) {
-            /* the socket asked to be closed */
-            if (ctx->connection_state != CSTATE_ESTABLISHED) {
-                fprintf(stderr, "control_loop(): App reqeuested close but already in process.\n");
-                free(buffer);
-                free(ctx);
-                assert(0);
-                return;
-            }
-            // nothing wrong
-            //stcp_fin_received(sd);
-            if (!SendPacket(sd, ctx, FIN, NULL, 0)) {
-                perror("control_loop(): 4-way handshake send FIN 1");
-                free(buffer);
-                free(ctx);
-                return;
-            }
-            ctx->connection_state = CSTATE_FIN_WAIT1;
-            if (!WaitPacket(sd, ctx, ACK)) {
-                perror("control_loop(): 4-way handshake wait FINACK 1");
-                free(buffer);
-                free(ctx);
-                return;
-            }
-            ctx->connection_state = CSTATE_FIN_WAIT2;
-            if (!WaitPacket(sd, ctx, FIN)) {
-                perror("control_loop(): 4-way handshake wait FIN 2");
-                free(buffer);
-                free(ctx);
-                return;
-            }
-            if (!SendPacket(sd, ctx, ACK, NULL, 0)) {
-                perror("control_loop(): 4-way handshake send FINACK 2");
-                free(buffer);
-                free(ctx);
-                return;
-            }
-            ctx->connection_state = CSTATE_CLOSED;
+
+        if (data_length == 0) {
+            // something wrong
+            fprintf(stderr, "control_loop(): Supposed to get APP_DATA but received nothing.\n");
+            PutSegment(ctx, seg);
             ctx->done = 1;
-            break;
+            return;
         }
-
-        else if (event & TIMEOUT) {
-            /* timeout */
-            fprintf(stderr, "control_loop: Didn't expect TIMEOUT event...\n");
-            assert(0);
+        ctx->persist = false;
+        if (!SendSegment(sd, ctx, seg, DATA, data_length)) {
+            perror("control_loop(): Sending DATA");
+            ctx->done = 1;
+            return;
         }
+    }
 
+    if ((event & APP_CLOSE_REQUESTED) && !ctx->done) {
+        /* the socket asked to be closed; every byte the app wrote has
+         * been handed to us by now, so the FIN goes right behind it
+         */
+        if (ctx->connection_state == CSTATE_ESTABLISHED) {
+            ctx->connection_state = CSTATE_FIN_WAIT1;
+        }
+        else if (ctx->connection_state == CSTATE_CLOSE_WAIT) {
+            ctx->connection_state = CSTATE_LAST_ACK;
+        }
         else {
-            // should not reach here?
-            fprintf(stderr, "control_loop(): Unknown event type.\n");
+            fprintf(stderr, "control_loop(): App reqeuested close but already in process.\n");
             assert(0);
         }
+        if (!SendPacket(sd, ctx, FINACK, NULL, 0)) {
+            perror("control_loop(): 4-way handshake send FIN");
+            ctx->done = 1;
+            return;
+        }
+    }
+
+    /* check the timers on every pass, since a steady stream of other
+     * events would otherwise keep a TIMEOUT from ever being reported
+     */
+    clock_gettime(CLOCK_REALTIME, &now);
+    if (ctx->timer_running && !ctx->done && TIMESPEC_LEQ(ctx->timer_expiry, now)) {
+        HandleTimeout(sd, ctx);
+    }
+    if (ctx->delack_pending && !ctx->done && TIMESPEC_LEQ(ctx->delack_expiry, now)) {
+        if (!SendPacket(sd, ctx, ACK, NULL, 0)) {
+            perror("control_loop(): Sending delayed ACK");
+        }
     }
-    /* clean up my mess! */
-    free(buffer);
-    return;
 }
 
 
@@ -371,7 +547,7 @@ static void control_loop(mysocket_t sd, context_t *ctx)
 /* our_dprintf
  *
  * Send a formatted message to stdout.
- * 
+ *
  * format               A printf-style format string.
  *
  * This function is equivalent to a printf, but may be
@@ -396,17 +572,23 @@ void our_dprintf(const char *format,...)
 /**********************************************************************/
 /* CreatePacket
  *
- * Creates a MEMORY-ALLOCATED packet of the specified type and returns it.
- * Called in SendPacket()
+ * Fills in the header of a packet of the specified type, whose options
+ * BuildOptions() has already written to packet->options, and returns the
+ * length of header and options.  options_length must be a multiple of 4.
+ * The packet lives on the caller's stack, and any payload goes to
+ * stcp_network_sendv() as a separate piece, so nothing is allocated.
+ * Called in SendPacket() and TransmitSegment()
  */
-STCPHeader*
-CreatePacket(tcp_seq seqnum, tcp_seq acknum, PacketType type, char* payload, size_t length)
+size_t
+CreatePacket(packet_header_t* packet, tcp_seq seqnum, tcp_seq acknum, PacketType type, size_t options_length)
 {
-    STCPHeader *header = (STCPHeader *)calloc(1, sizeof(STCPHeader) + length);
+    STCPHeader *header = &packet->header;
+    assert(options_length % 4 == 0 && options_length <= MAX_OPTIONS_LEN);
+    memset(header, 0, sizeof(STCPHeader));
     header->th_seq = htonl(seqnum);
     header->th_ack = htonl(acknum);
-    header->th_off = 5;  // no options whatsoever
-    header->th_win = htons(WINDOW_SIZE);
+    header->th_off = 5 + options_length / 4;
+    // th_win is left to the caller (see AdvertiseWindow())
     switch (type)
     {
         case SYN:
@@ -425,232 +607,1238 @@ CreatePacket(tcp_seq seqnum, tcp_seq acknum, PacketType type, char* payload, siz
             header->th_flags = TH_FIN | TH_ACK;
             break;
         case DATA:
-            assert(payload);
-            assert(length);
-            header->th_flags = 0x0;
-            memcpy((void *)header + sizeof(STCPHeader), payload, length);
+            // data always carries our latest ACK
+            header->th_flags = TH_ACK;
             break;
         default:
             fprintf(stderr, "CreatePacket(): Unknown packet type\n");
             assert(0);
             break;
     }
-    return header;
+    return sizeof(STCPHeader) + options_length;
+}
+
+/**********************************************************************/
+/* BuildOptions
+ *
+ * Writes the options for a segment of the given type into options
+ * (MAX_OPTIONS_LEN bytes) and returns their length, padded with NOPs to
+ * a multiple of 4:
+ *   - SYN and SYNACK offer our MSS, SACK-permitted and our window scale
+ *   - a bare ACK reports up to MAX_SACK_BLOCKS out-of-order blocks, the
+ *     one holding the latest arrival first as RFC 2018 asks
+ */
+size_t
+BuildOptions(context_t* ctx, PacketType type, char* options)
+{
+    uint32_t edge;
+    size_t length = 0;
+    int i, first = -1, count = 0;
+
+    if (type == SYN || type == SYNACK) {
+        options[length++] = TCPOPT_MSS;
+        options[length++] = 4;
+        options[length++] = (ctx->rcv_mss >> 8) & 0xff;
+        options[length++] = ctx->rcv_mss & 0xff;
+    }
+
+    switch (type)
+    {
+        case SYN:
+#ifndef NO_SACK
+            options[length++] = TCPOPT_NOP;
+            options[length++] = TCPOPT_NOP;
+            options[length++] = TCPOPT_SACK_PERMITTED;
+            options[length++] = 2;
+#endif
+            options[length++] = TCPOPT_NOP;
+            options[length++] = TCPOPT_WSCALE;
+            options[length++] = 3;
+            options[length++] = RCV_WSCALE;
+            break;
+        case SYNACK:
+            if (ctx->sack_permitted) {
+                options[length++] = TCPOPT_NOP;
+                options[length++] = TCPOPT_NOP;
+                options[length++] = TCPOPT_SACK_PERMITTED;
+                options[length++] = 2;
+            }
+            // only answer a window scale with one
+            if (ctx->rcv_wscale > 0) {
+                options[length++] = TCPOPT_NOP;
+                options[length++] = TCPOPT_WSCALE;
+                options[length++] = 3;
+                options[length++] = ctx->rcv_wscale;
+            }
+            break;
+        case ACK:
+            if (!ctx->sack_permitted || ctx->num_rcv_blocks == 0) {
+                break;
+            }
+            for (i = 0; i < ctx->num_rcv_blocks; ++i) {
+                if (SEQ_LEQ(ctx->rcv_blocks[i].start, ctx->rcv_last_seq) &&
+                    SEQ_LT(ctx->rcv_last_seq, ctx->rcv_blocks[i].end)) {
+                    first = i;
+                }
+            }
+            count = MIN(ctx->num_rcv_blocks, MAX_SACK_BLOCKS);
+            options[length++] = TCPOPT_NOP;
+            options[length++] = TCPOPT_NOP;
+            options[length++] = TCPOPT_SACK;
+            options[length++] = 2 + 8 * count;
+            for (i = -1; i < ctx->num_rcv_blocks && count > 0; ++i) {
+                if ((i == -1 && first < 0) || (i >= 0 && i == first)) {
+                    continue;
+                }
+                edge = htonl(ctx->rcv_blocks[i == -1 ? first : i].start);
+                memcpy(options + length, &edge, 4);
+                edge = htonl(ctx->rcv_blocks[i == -1 ? first : i].end);
+                memcpy(options + length + 4, &edge, 4);
+                length += 8;
+                count--;
+            }
+            break;
+        default:
+            break;
+    }
+    return length;
+}
+
+/**********************************************************************/
+/* ParseOptions
+ *
+ * Picks the options we understand out of a received header, skipping the
+ * rest.  A malformed option list ends the parse.
+ */
+void
+ParseOptions(STCPHeader* packet, size_t header_length, stcp_options_t* options)
+{
+    unsigned char *opt = (unsigned char *)packet + sizeof(STCPHeader);
+    unsigned char *end = (unsigned char *)packet + header_length;
+    uint32_t edge;
+    size_t optlen;
+    int i;
+
+    memset(options, 0, sizeof(stcp_options_t));
+
+    while (opt < end && *opt != TCPOPT_EOL) {
+        if (*opt == TCPOPT_NOP) {
+            opt++;
+            continue;
+        }
+        if (opt + 1 >= end || opt[1] < 2 || opt + opt[1] > end) {
+            return;
+        }
+        optlen = opt[1];
+        switch (opt[0])
+        {
+            case TCPOPT_MSS:
+                if (optlen == 4) {
+                    options->mss = (opt[2] << 8) | opt[3];
+                }
+                break;
+            case TCPOPT_SACK_PERMITTED:
+                options->sack_permitted = true;
+                break;
+            case TCPOPT_WSCALE:
+                if (optlen == 3) {
+                    options->wscale_present = true;
+                    options->wscale = MIN(opt[2], 14);
+                }
+                break;
+            case TCPOPT_SACK:
+                for (i = 0; i < (int)(optlen - 2) / 8 && i < MAX_SACK_BLOCKS; ++i) {
+                    memcpy(&edge, opt + 2 + 8 * i, 4);
+                    options->sack_blocks[i].start = ntohl(edge);
+                    memcpy(&edge, opt + 6 + 8 * i, 4);
+                    options->sack_blocks[i].end = ntohl(edge);
+                }
+                options->num_sack_blocks = i;
+                break;
+            default:
+                break;
+        }
+        opt += optlen;
+    }
+}
+
+/**********************************************************************/
+/* NegotiateOptions
+ *
+ * Settles the connection options from the peer's SYN or SYNACK: the MSS
+ * (STCP_MSS if the peer offers none), SACK and window scaling.
+ */
+void
+NegotiateOptions(context_t* ctx, stcp_options_t* options)
+{
+    if (options->mss > 0) {
+        ctx->mss = MIN(options->mss, ctx->rcv_mss);
+        ctx->cwnd = ctx->mss;
+        ctx->ssthresh = 4 * ctx->mss;
+        UpdateWindow(ctx);
+    }
+#ifndef NO_SACK
+    ctx->sack_permitted = options->sack_permitted;
+#endif
+    if (options->wscale_present) {
+        ctx->snd_wscale = options->wscale;
+        ctx->rcv_wscale = RCV_WSCALE;
+    }
 }
 
 /**********************************************************************/
 /* SendPacket
  *
  * Sends a packet of the specified type.
+ * Anything but a bare ACK takes up sequence space, so it is put on the
+ * retransmission queue and sent through TransmitSegment().
  * Returns true on success and false on error.
- * TODO:
- * Not sure if errno should be set.
  */
 bool
 SendPacket(mysocket_t sd, context_t* ctx, PacketType type, char* src, size_t src_len)
 {
     // variables
-    STCPHeader *packet;
-    tcp_seq seqnum, acknum;
+    packet_header_t packet;
+    size_t packet_length;
+    segment_t *seg;
     ssize_t numBytes;
 
     switch (type)
     {
-        case SYN:
-            seqnum = ctx->initial_sequence_num;
-            acknum = 0;
-            ctx->prev_seq = seqnum;
-            ctx->prev_ack = acknum;
-            ctx->prev_len = 1;
-            break;
         case ACK:
-            //seqnum = ctx->rcvd_ack;
-            seqnum = ctx->next_seq;
-            acknum = ctx->rcvd_seq + ctx->rcvd_len;
-            ctx->prev_seq = seqnum;
-            ctx->prev_ack = acknum;
-            ctx->prev_len = 1;
-            break;
+            ctx->delack_pending = false;
+            ctx->delack_segs = 0;
+            packet_length = CreatePacket(&packet, ctx->snd_nxt, ctx->rcv_nxt, type,
+                                         BuildOptions(ctx, type, packet.options));
+            packet.header.th_win = htons(AdvertiseWindow(sd, ctx, type));
+            numBytes = stcp_network_send(sd, (void *)&packet, packet_length, NULL);
+            PrintPacket(&packet.header, true);
+            ctx->info.stcpi_segs_out++;
+            if (numBytes > 0) {
+                return true;
+            }
+            fprintf(stderr, "SendPacket(): stcp_network_send(): non-positive sent packet.\n");
+            return false;
+        case SYN:
         case SYNACK:
-            seqnum = ctx->initial_sequence_num;
-            acknum = ctx->rcvd_seq + 1;
-            ctx->prev_seq = seqnum;
-            ctx->prev_ack = acknum;
-            ctx->prev_len = 1;
-            break;
-        case FIN:
-            seqnum = ctx->next_seq;
-            acknum = ctx->prev_ack;
-            ctx->prev_seq = seqnum;
-            ctx->prev_ack = acknum;
-            ctx->prev_len = 1;
-            break;
         case FINACK:
-            // probably no such type
-            seqnum = ctx->rcvd_ack;
-            acknum = ctx->rcvd_seq + 1;
-            ctx->prev_seq = seqnum;
-            ctx->prev_ack = acknum;
-            ctx->prev_len = 1;
             break;
         case DATA:
             assert(src);
             assert(src_len);
-            // print log
-            if (ctx->connection_state == CSTATE_ESTABLISHED) {
-                fprintf(ctx->logfile, "Send:\t%u\t%u\t%lu\n", ctx->swnd, ctx->remainder_window, src_len);
-            }
-            seqnum = ctx->next_seq;
-            acknum = ctx->prev_ack;
-            ctx->prev_seq = seqnum;
-            ctx->prev_ack = acknum;
-            ctx->prev_len = src_len;
-
-            ctx->remainder_window -= src_len;
             break;
         default:
             fprintf(stderr, "SendPacket(): Unknown packet type.\n");
             return false;
             break;
     }
-    packet = CreatePacket(seqnum, acknum, type, src, src_len);
-    numBytes = stcp_network_send(sd, (void *)packet, sizeof(STCPHeader) + src_len, NULL);
-    PrintPacket(packet, true);
-    
-    free(packet);
-    
-    if (numBytes > 0) {
-        return true;
+
+    assert(src_len <= ctx->mss);
+    seg = GetSegment(ctx);
+    if (src_len > 0) {
+        memcpy(seg->data, src, src_len);
     }
-   
-    fprintf(stderr, "SendPacket(): stcp_network_send(): non-positive sent packet.\n");
-    return false;
+    return SendSegment(sd, ctx, seg, type, src_len);
 }
 
 /**********************************************************************/
-/* WaitPacket
+/* SendSegment
  *
- * Waits for a packet of the specified type.
- * Returns true on success and false on any failure.
- * This function should not ever be called in control loop.
- * Hence, it only waits for "NETWORK_DATA".
+ * Sends a new segment of the specified type from GetSegment(), whose
+ * payload (len bytes) is already in seg->data, and puts it on the
+ * retransmission queue.
+ * Returns true on success and false on error.
  */
 bool
-WaitPacket(mysocket_t sd, context_t *ctx, PacketType type)
+SendSegment(mysocket_t sd, context_t* ctx, segment_t* seg, PacketType type, size_t len)
 {
-    STCPHeader *packet = (STCPHeader *)calloc(1, sizeof(STCPHeader) + STCP_MSS);
-    ssize_t numBytes;
-#ifdef __DEBUG__
-    unsigned int event;
-    event = stcp_wait_for_event(sd, NETWORK_DATA, NULL);
-    if (!(event & NETWORK_DATA)) {
-        fprintf(stderr, "WaitPacket(): Expected NETWORK_DATA(2), got %d instead.\n", event);
-    }
-#else
-    stcp_wait_for_event(sd, NETWORK_DATA, NULL);
-#endif
-    numBytes = stcp_network_recv(sd, (void *)packet, sizeof(STCPHeader) + STCP_MSS);
+    assert(len <= ctx->mss);
+    assert(ctx->snd_nxt == ctx->snd_max);
+    if (type == DATA) {
+        Trace(sd, ctx, STCP_TRACE_SEND, ctx->snd_nxt, ctx->rcv_nxt, len);
+    }
+    seg->seq = ctx->snd_nxt;
+    seg->type = type;
+    seg->len = len;
 
-    if (numBytes < (ssize_t)sizeof(STCPHeader)) {
-        // something went wrong
-        free(packet);
-        return false;
+    // append to the retransmission queue
+    if (ctx->unacked_tail) ctx->unacked_tail->next = seg;
+    else                   ctx->unacked_head = seg;
+    ctx->unacked_tail = seg;
+
+    ctx->snd_nxt += SEG_SEQ_LEN(seg);
+    ctx->snd_max = ctx->snd_nxt;
+    UpdateWindow(ctx);
+
+    return TransmitSegment(sd, ctx, seg);
+}
+
+/**********************************************************************/
+/* GetSegment
+ *
+ * Returns a cleared segment with room for a full segment's payload,
+ * reusing one that has been acknowledged if there is any.  The free list
+ * grows to the most segments ever outstanding at once, after which
+ * sending allocates nothing.
+ */
+segment_t*
+GetSegment(context_t* ctx)
+{
+    segment_t *seg = ctx->free_segs;
+
+    if (seg) {
+        ctx->free_segs = seg->next;
+    }
+    else {
+        // the MSS can only shrink from rcv_mss during the handshake
+        seg = (segment_t *)malloc(sizeof(segment_t) + ctx->rcv_mss);
+        assert(seg);
     }
+    memset(seg, 0, sizeof(segment_t));
+    return seg;
+}
 
-    switch (type)
-    {
-        case SYN:
-            if ((packet->th_flags & TH_SYN) == TH_SYN) {
-                ctx->rcvd_seq = ntohl(packet->th_seq);
-                ctx->rcvd_ack = ntohl(packet->th_ack);
-                ctx->rcvd_win = ntohs(packet->th_win);
-                ctx->rcvd_len = (size_t)numBytes - sizeof(STCPHeader);
-                
-                ctx->rcvd_len = (ctx->rcvd_len == 0) ? 1 : ctx->rcvd_len;
-
-                ctx->next_seq = ctx->initial_sequence_num; // not used
-            }
-            else {
-                fprintf(stderr, "WaitPacket(): Waiting for SYN... Unexpected packet type.\n");
-                free(packet);
-                return false;
-            }
-            break;
-        case ACK:
-            if ((packet->th_flags & TH_ACK) == TH_ACK) {
-                
-                // print log
-                if (ctx->connection_state == CSTATE_ESTABLISHED) {
-                    fprintf(ctx->logfile, "Recv:\t%u\t%u\t%lu\n", ctx->swnd, ctx->remainder_window, ctx->prev_len);
-                }
-                
-                ctx->rcvd_seq = ntohl(packet->th_seq);
-                ctx->rcvd_ack = ntohl(packet->th_ack);
-                ctx->rcvd_win = ntohs(packet->th_win);
-                ctx->rcvd_len = (size_t)numBytes - sizeof(STCPHeader);
-                
-                ctx->rcvd_len = (ctx->rcvd_len == 0) ? 1 : ctx->rcvd_len;
-
-                ctx->next_seq = ctx->rcvd_ack;
-                
-                uint32_t prev_swnd = ctx->swnd;
-                if (ctx->prev_len != 1) {
-                    if (ctx->cwnd < (4 * STCP_MSS)) ctx->cwnd += STCP_MSS;
-                    else                            ctx->cwnd += (STCP_MSS * STCP_MSS / ctx->cwnd);
-                }
-                // set swnd to min(cwnd, rwnd == WINDOW_SIZE)
-                ctx->swnd = (ctx->cwnd < WINDOW_SIZE) ? ctx->cwnd : WINDOW_SIZE;
-                if (ctx->prev_len != 1) ctx->remainder_window += ctx->prev_len;
-                ctx->remainder_window += (ctx->swnd - prev_swnd);
-            }
-            else {
-                fprintf(stderr, "WaitPacket(): Waiting for ACK... Unexpected packet type.\n");
-                free(packet);
-                return false;
-            }
+/**********************************************************************/
+/* PutSegment
+ *
+ * Puts a segment that has left the retransmission queue back on the free
+ * list.
+ */
+void
+PutSegment(context_t* ctx, segment_t* seg)
+{
+    seg->next = ctx->free_segs;
+    ctx->free_segs = seg;
+}
+
+/**********************************************************************/
+/* RetransmitPending
+ *
+ * Resends, oldest first and as the window allows:
+ *   - during fast recovery, the holes presumed lost (see IsLost()); the
+ *     oldest one goes out whatever the window, as in fast retransmit
+ *   - after a timeout, which pulls snd_nxt back to snd_una, every queued
+ *     segment from snd_nxt on that the peer hasn't SACKed
+ */
+void
+RetransmitPending(mysocket_t sd, context_t* ctx)
+{
+    segment_t *seg;
+    uint32_t above = ctx->sacked_bytes;
+
+    for (seg = ctx->unacked_head; ctx->in_recovery && seg && SEQ_LT(seg->seq, ctx->snd_nxt); seg = seg->next) {
+        if (seg->sacked) {
+            above -= seg->len;
+            continue;
+        }
+        if (!IsLost(ctx, seg, above)) {
+            continue;
+        }
+        if (ctx->remainder_window < SEG_SEQ_LEN(seg) && seg != ctx->unacked_head) {
             break;
-        case SYNACK:
-            if (((packet->th_flags & TH_SYN) | (packet->th_flags & TH_ACK)) == (TH_SYN | TH_ACK)) {
-                ctx->rcvd_seq = ntohl(packet->th_seq);
-                ctx->rcvd_ack = ntohl(packet->th_ack);
-                ctx->rcvd_win = ntohs(packet->th_win);
-                ctx->rcvd_len = (size_t)numBytes - sizeof(STCPHeader);
-
-                ctx->rcvd_len = (ctx->rcvd_len == 0) ? 1 : ctx->rcvd_len;
-                ctx->next_seq = ctx->rcvd_ack;
+        }
+        if (!TransmitSegment(sd, ctx, seg)) {
+            return;
+        }
+        UpdateWindow(ctx);
+    }
+
+    for (seg = ctx->unacked_head; seg && SEQ_LT(ctx->snd_nxt, ctx->snd_max); seg = seg->next) {
+        if (SEQ_LT(seg->seq, ctx->snd_nxt)) {
+            continue;
+        }
+        if (seg->sacked) {
+            // the peer already holds this one
+            ctx->snd_nxt = seg->seq + SEG_SEQ_LEN(seg);
+            continue;
+        }
+        // always let one segment out, however small the window
+        if (ctx->remainder_window < SEG_SEQ_LEN(seg) && ctx->snd_nxt != ctx->snd_una) {
+            break;
+        }
+        ctx->snd_nxt = seg->seq + SEG_SEQ_LEN(seg);
+        UpdateWindow(ctx);
+        if (!TransmitSegment(sd, ctx, seg)) {
+            break;
+        }
+    }
+}
+
+/**********************************************************************/
+/* TransmitSegment
+ *
+ * (Re)transmits a segment from the retransmission queue, acknowledging
+ * whatever we have received so far, and arms the retransmission timer if
+ * it isn't running yet.
+ * Returns true on success and false on error.
+ */
+bool
+TransmitSegment(mysocket_t sd, context_t* ctx, segment_t* seg)
+{
+    packet_header_t packet;
+    struct iovec iov[2];
+    size_t packet_length;
+    ssize_t numBytes;
+
+    // anything but a SYN carries our ACK, so a delayed one goes along with it
+    if (seg->type != SYN) {
+        ctx->delack_pending = false;
+        ctx->delack_segs = 0;
+    }
+    packet_length = CreatePacket(&packet, seg->seq, (seg->type == SYN) ? 0 : ctx->rcv_nxt, seg->type,
+                                 BuildOptions(ctx, seg->type, packet.options));
+    packet.header.th_win = htons(AdvertiseWindow(sd, ctx, seg->type));
+    // the payload is checksummed and sent from the segment itself, behind
+    // the header on the stack
+    iov[0].iov_base = &packet;
+    iov[0].iov_len = packet_length;
+    iov[1].iov_base = seg->data;
+    iov[1].iov_len = seg->len;
+    numBytes = stcp_network_sendv(sd, iov, (seg->len > 0) ? 2 : 1);
+    PrintPacket(&packet.header, true);
+
+    clock_gettime(CLOCK_REALTIME, &seg->sent_time);
+    seg->rexmit = (seg->transmissions > 0);
+    seg->transmissions++;
+    ctx->info.stcpi_segs_out++;
+    ctx->info.stcpi_bytes_sent += seg->len;
+    if (seg->rexmit) {
+        Trace(sd, ctx, STCP_TRACE_RETRANSMIT, seg->seq, ctx->rcv_nxt, seg->len);
+        ctx->info.stcpi_retrans_segs++;
+        ctx->info.stcpi_retrans_bytes += seg->len;
+    }
+    if (!ctx->timer_running) {
+        StartTimer(ctx);
+    }
+
+    if (numBytes > 0) {
+        return true;
+    }
+
+    fprintf(stderr, "TransmitSegment(): stcp_network_sendv(): non-positive sent packet.\n");
+    return false;
+}
+
+/**********************************************************************/
+/* HandlePacket
+ *
+ * Processes one segment received from the peer, according to the
+ * connection state: completes the handshakes, handles the ACK and
+ * passes any data up to the application.
+ */
+void
+HandlePacket(mysocket_t sd, context_t* ctx, STCPHeader* packet, size_t length)
+{
+    tcp_seq seqnum = ntohl(packet->th_seq);
+    tcp_seq acknum = ntohl(packet->th_ack);
+    uint32_t window = ntohs(packet->th_win);
+    size_t header_length = TCP_DATA_START(packet);
+    stcp_options_t options;
+    bool bare;
+
+    PrintPacket(packet, false);
+
+    if (header_length < sizeof(STCPHeader) || header_length > length) {
+        fprintf(stderr, "HandlePacket(): Bad data offset, dropping segment.\n");
+        return;
+    }
+    ParseOptions(packet, header_length, &options);
+    // windows in SYNs are never scaled
+    if (!(packet->th_flags & TH_SYN)) {
+        window <<= ctx->snd_wscale;
+    }
+    // only a segment without data, SYN or FIN can be a duplicate ACK
+    bare = (length == header_length) && !(packet->th_flags & (TH_SYN | TH_FIN));
+
+    switch (ctx->connection_state)
+    {
+        case CSTATE_LISTEN:
+            // wait for SYN packet to arrive
+            if (!(packet->th_flags & TH_SYN)) {
+                return;
             }
-            else {
-                fprintf(stderr, "WaitPacket(): Waiting for SYNACK... Unexpected packet type.\n");
-                free(packet);
-                return false;
+            ctx->rcv_nxt = seqnum + 1;
+            ctx->rcvd_win = window;
+            NegotiateOptions(ctx, &options);
+            if (!SendPacket(sd, ctx, SYNACK, NULL, 0)) {
+                perror("3-way handshake send SYNACK");
+                errno = ECONNREFUSED;
+                ctx->done = 1;
+                return;
             }
-            break;
-        case FIN:
-            if ((packet->th_flags & TH_FIN) == (TH_FIN)) {
-                ctx->rcvd_seq = ntohl(packet->th_seq);
-                ctx->rcvd_ack = ntohl(packet->th_ack);
-                ctx->rcvd_win = ntohs(packet->th_win);
-                ctx->rcvd_len = (size_t)numBytes - sizeof(STCPHeader);
-
-                ctx->rcvd_len = (ctx->rcvd_len == 0) ? 1 : ctx->rcvd_len;
-                ctx->next_seq = ctx->rcvd_ack;
+            ctx->connection_state = CSTATE_SYN_RCVD;
+            return;
+        case CSTATE_SYN_SENT:
+            if ((packet->th_flags & (TH_SYN | TH_ACK)) != (TH_SYN | TH_ACK) || acknum != ctx->snd_max) {
+                return;
             }
-            else {
-                fprintf(stderr, "WaitPacket(): Waiting for FIN... Unexpected packet type.\n");
-                free(packet);
-                return false;
+            ctx->rcv_nxt = seqnum + 1;
+            NegotiateOptions(ctx, &options);
+            ProcessAck(sd, ctx, acknum, window, &options, false);
+            ctx->connection_state = CSTATE_ESTABLISHED;
+            if (!SendPacket(sd, ctx, ACK, NULL, 0)) {
+                perror("3-way handshake send ACK");
+                errno = ECONNREFUSED;
+                ctx->done = 1;
+                return;
+            }
+            ConnectionEstablished(sd, ctx);
+            return;
+        case CSTATE_SYN_RCVD:
+            if ((packet->th_flags & TH_SYN) && !(packet->th_flags & TH_ACK)) {
+                // the peer never saw our SYNACK
+                if (ctx->unacked_head) TransmitSegment(sd, ctx, ctx->unacked_head);
+                return;
             }
+            if (!(packet->th_flags & TH_ACK) || acknum != ctx->snd_max) {
+                return;
+            }
+            ProcessAck(sd, ctx, acknum, window, &options, false);
+            ctx->connection_state = CSTATE_ESTABLISHED;
+            ConnectionEstablished(sd, ctx);
+            // the ACK may already carry data, so keep going
             break;
         default:
-            fprintf(stderr, "WaitPacket(): Packet with unspecified behavior.\n");
-            free(packet);
-            return false;
             break;
     }
-    free(packet);
+
+    if (packet->th_flags & TH_SYN) {
+        // a retransmitted SYNACK: our handshake ACK was lost
+        SendPacket(sd, ctx, ACK, NULL, 0);
+        return;
+    }
+
+    if (packet->th_flags & TH_ACK) {
+        ProcessAck(sd, ctx, acknum, window, &options, bare);
+        if (ctx->done) {
+            return;
+        }
+    }
+
+    if (length > header_length || (packet->th_flags & TH_FIN)) {
+        ReceiveData(sd, ctx, seqnum, (packet->th_flags & TH_FIN) != 0,
+                    (char *)packet + header_length, length - header_length);
+    }
+}
+
+/**********************************************************************/
+/* ProcessAck
+ *
+ * Handles the acknowledgement number, window and SACK blocks of a
+ * received segment: frees acknowledged segments, takes an RTT sample,
+ * opens the congestion window and restarts the retransmission timer.
+ * Counts duplicate ACKs (bare is true if the segment carries nothing but
+ * the ACK) and enters fast recovery once the oldest hole is presumed lost.
+ */
+void
+ProcessAck(mysocket_t sd, context_t* ctx, tcp_seq acknum, uint32_t window, stcp_options_t* options, bool bare)
+{
+    segment_t *seg;
+    size_t acked_data = 0;
+    bool fin_acked = false;
+    long sample = -1;
+    struct timespec now;
+    uint32_t old_window = ctx->rcvd_win;
+
+    ctx->rcvd_win = window;
+
+    if (SEQ_GT(acknum, ctx->snd_max)) {
+        // bogus ACK
+        UpdateWindow(ctx);
+        return;
+    }
+    if (ctx->sack_permitted && options->num_sack_blocks > 0) {
+        UpdateScoreboard(ctx, options);
+    }
+
+    if (SEQ_LEQ(acknum, ctx->snd_una)) {
+        // old or duplicate ACK: only the window and scoreboard may have changed
+        if (old_window == 0 && window > 0) {
+            // the window reopened: whatever went out while it was closed
+            // (a probe at least) was dropped, so send it again right away
+            ctx->snd_nxt = ctx->snd_una;
+        }
+        if (bare && acknum == ctx->snd_una && window == old_window && ctx->unacked_head) {
+            ctx->dupacks++;
+            ctx->info.stcpi_total_dupacks++;
+            Trace(sd, ctx, STCP_TRACE_DUPACK, ctx->snd_una, acknum, 0);
+            if (ctx->in_recovery && !ctx->sack_permitted) {
+                // NewReno window inflation: one more segment has left the network
+                ctx->cwnd += ctx->mss;
+            }
+        }
+        DetectLoss(sd, ctx);
+        UpdateWindow(ctx);
+        return;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    while ((seg = ctx->unacked_head) && SEQ_LEQ(seg->seq + SEG_SEQ_LEN(seg), acknum)) {
+        // Karn's rule: a retransmitted segment gives no RTT sample
+        if (seg->transmissions == 1) {
+            sample = (now.tv_sec - seg->sent_time.tv_sec) * 1000000L +
+                     (now.tv_nsec - seg->sent_time.tv_nsec) / 1000L;
+        }
+        else {
+            sample = -1;
+        }
+        if (seg->type == DATA) acked_data += seg->len;
+        if (seg->type == FINACK) fin_acked = true;
+        if (seg->sacked) ctx->sacked_bytes -= seg->len;
+
+        ctx->unacked_head = seg->next;
+        PutSegment(ctx, seg);
+    }
+    if (!ctx->unacked_head) {
+        ctx->unacked_tail = NULL;
+    }
+    // free up room in the app's send buffer
+    if (acked_data > 0) {
+        stcp_app_data_acked(sd, acked_data);
+        ctx->info.stcpi_bytes_acked += acked_data;
+    }
+
+    if (acked_data > 0) {
+        Trace(sd, ctx, STCP_TRACE_ACKED, ctx->snd_una, acknum, acked_data);
+    }
+
+    ctx->snd_una = acknum;
+    if (SEQ_LT(ctx->snd_nxt, acknum)) {
+        // the peer already had what we were about to resend
+        ctx->snd_nxt = acknum;
+    }
+    ctx->timeouts = 0;
+    ctx->dupacks = 0;
+    if (sample >= 0) {
+        UpdateRTO(ctx, sample);
+    }
+
+    if (ctx->in_recovery && SEQ_GEQ(acknum, ctx->recover)) {
+        // full ACK: deflate the window
+        ctx->in_recovery = false;
+        ctx->cwnd = ctx->ssthresh;
+    }
+    else if (ctx->in_recovery && !ctx->sack_permitted) {
+        // NewReno partial ACK: the new oldest segment is lost as well
+        // (RetransmitPending() resends it); deflate by what was acked
+        ctx->cwnd -= MIN(acked_data, ctx->cwnd - ctx->mss);
+        if (acked_data >= ctx->mss) ctx->cwnd += ctx->mss;
+    }
+    // the window stays put while holes are being repaired
+    if (acked_data > 0 && !ctx->in_recovery) {
+        if (ctx->cwnd < ctx->ssthresh) ctx->cwnd += ctx->mss;
+        else                           ctx->cwnd += (ctx->mss * ctx->mss / ctx->cwnd);
+    }
+
+    // restart the timer for whatever is still outstanding, or to probe a
+    // closed window
+    if (ctx->unacked_head || ctx->rcvd_win == 0) {
+        StartTimer(ctx);
+    }
+    else {
+        ctx->timer_running = false;
+    }
+
+    if (fin_acked) {
+        if (ctx->connection_state == CSTATE_FIN_WAIT1) {
+            ctx->connection_state = CSTATE_FIN_WAIT2;
+        }
+        else if (ctx->connection_state == CSTATE_CLOSING || ctx->connection_state == CSTATE_LAST_ACK) {
+            ctx->connection_state = CSTATE_CLOSED;
+            ctx->done = 1;
+        }
+    }
+
+    DetectLoss(sd, ctx);
+    UpdateWindow(ctx);
+}
+
+/**********************************************************************/
+/* DetectLoss
+ *
+ * Enters fast recovery once the oldest hole is presumed lost, after
+ * DUPTHRESH duplicate ACKs or once more than DUPTHRESH - 1 segments'
+ * worth of data above it has been SACKed: halves the congestion window
+ * and lets RetransmitPending() resend the hole right away instead of
+ * waiting for the retransmission timer.
+ * Duplicate ACKs for data sent before the last timeout or recovery
+ * (below recover) are ignored, as in NewReno.
+ */
+void
+DetectLoss(mysocket_t sd, context_t* ctx)
+{
+    segment_t *seg = ctx->unacked_head;
+    uint32_t in_flight = ctx->snd_max - ctx->snd_una;
+
+    if (ctx->in_recovery || !seg || seg->sacked) {
+        return;
+    }
+    if (!(ctx->dupacks >= DUPTHRESH && SEQ_GEQ(ctx->snd_una, ctx->recover)) &&
+        ctx->sacked_bytes <= (DUPTHRESH - 1) * ctx->mss) {
+        return;
+    }
+
+    ctx->in_recovery = true;
+    ctx->info.stcpi_recoveries++;
+    Trace(sd, ctx, STCP_TRACE_RECOVERY, ctx->snd_una, ctx->rcv_nxt, in_flight);
+    ctx->recover = ctx->snd_max;
+    ctx->ssthresh = (in_flight / 2 > 2 * ctx->mss) ? in_flight / 2 : 2 * ctx->mss;
+    // without SACK, the DUPTHRESH segments behind the duplicate ACKs have
+    // left the network (RFC 6582); with SACK, BytesInFlight() knows better
+    ctx->cwnd = ctx->sack_permitted ? ctx->ssthresh : ctx->ssthresh + DUPTHRESH * ctx->mss;
+    for (; seg; seg = seg->next) {
+        seg->rexmit = false;
+    }
+}
+
+/**********************************************************************/
+/* IsLost
+ *
+ * Tells whether a segment that hasn't been resent since the loss was
+ * detected should be presumed lost, given how many bytes above it the
+ * peer has SACKed.  During recovery the oldest segment is lost as well if
+ * duplicate ACKs point at it, or if there is no SACK to tell otherwise
+ * (a NewReno partial ACK).
+ */
+bool
+IsLost(context_t* ctx, segment_t* seg, uint32_t sacked_above)
+{
+    if (seg->sacked || seg->rexmit) {
+        return false;
+    }
+    if (sacked_above > (DUPTHRESH - 1) * ctx->mss) {
+        return true;
+    }
+    return ctx->in_recovery && seg == ctx->unacked_head &&
+           (!ctx->sack_permitted || ctx->dupacks >= DUPTHRESH);
+}
+
+/**********************************************************************/
+/* UpdateScoreboard
+ *
+ * Marks every queued segment that lies entirely inside a SACK block as
+ * held by the peer.  STCP receivers never renege on SACKed data, so the
+ * marks stay until the cumulative ACK covers them.
+ */
+void
+UpdateScoreboard(context_t* ctx, stcp_options_t* options)
+{
+    segment_t *seg;
+    rcv_block_t *block;
+    int i;
+
+    for (i = 0; i < options->num_sack_blocks; ++i) {
+        block = &options->sack_blocks[i];
+        if (SEQ_GEQ(block->start, block->end) || SEQ_LEQ(block->end, ctx->snd_una) ||
+            SEQ_GT(block->end, ctx->snd_max)) {
+            continue;
+        }
+        for (seg = ctx->unacked_head; seg && SEQ_LT(seg->seq, block->end); seg = seg->next) {
+            if (!seg->sacked && seg->type == DATA && SEQ_GEQ(seg->seq, block->start) &&
+                SEQ_LEQ(seg->seq + seg->len, block->end)) {
+                seg->sacked = true;
+                ctx->sacked_bytes += seg->len;
+            }
+        }
+    }
+}
+
+/**********************************************************************/
+/* BytesInFlight
+ *
+ * Estimates how much of what was sent below snd_nxt is still in the
+ * network (RFC 6675's pipe): SACKed segments have left it, and so have
+ * holes presumed lost that haven't been resent yet.
+ */
+uint32_t
+BytesInFlight(context_t* ctx)
+{
+    segment_t *seg;
+    uint32_t pipe = 0, above = ctx->sacked_bytes;
+
+    if (ctx->sacked_bytes == 0) {
+        return ctx->snd_nxt - ctx->snd_una;
+    }
+
+    for (seg = ctx->unacked_head; seg && SEQ_LT(seg->seq, ctx->snd_nxt); seg = seg->next) {
+        if (seg->sacked) {
+            above -= seg->len;
+            continue;
+        }
+        if (IsLost(ctx, seg, above)) {
+            continue;
+        }
+        pipe += SEG_SEQ_LEN(seg);
+    }
+    return pipe;
+}
+
+/**********************************************************************/
+/* ReceiveData
+ *
+ * Passes in-order data (and FIN) from the peer up to the application.
+ * Data that arrives ahead of a hole is kept in the reassembly buffer until
+ * the hole is filled; duplicates and anything beyond our window are
+ * dropped.  Either way the peer gets an ACK for everything received so far:
+ * right away for anything unusual, or delayed (see DELACK_SEGMENTS) for a
+ * plain in-order segment, in the hope that it can ride on our next one.
+ */
+void
+ReceiveData(mysocket_t sd, context_t* ctx, tcp_seq seqnum, bool fin, char* payload, size_t length)
+{
+    size_t trim = 0;
+    bool delay = false;
+    tcp_seq edge;
+
+    if (ctx->connection_state == CSTATE_ESTABLISHED ||
+        ctx->connection_state == CSTATE_FIN_WAIT1 ||
+        ctx->connection_state == CSTATE_FIN_WAIT2) {
+        // skip whatever part of the segment we already have
+        if (SEQ_LT(seqnum, ctx->rcv_nxt)) {
+            trim = MIN(length, (size_t)(ctx->rcv_nxt - seqnum));
+            seqnum += trim;
+            payload += trim;
+            length -= trim;
+        }
+        // and whatever doesn't fit in the window; the free space never
+        // ends short of what we advertised, since the app's unread data
+        // only grows by what we pass up
+        edge = ctx->rcv_nxt + ReceiveWindow(sd, ctx);
+        if (SEQ_GT(seqnum + length, edge)) {
+            length = SEQ_LT(seqnum, edge) ? edge - seqnum : 0;
+            fin = false;
+        }
+        if (fin && SEQ_GEQ(seqnum + length, ctx->rcv_nxt)) {
+            ctx->rcv_fin_pending = true;
+            ctx->rcv_fin_seq = seqnum + length;
+        }
+
+        if (length > 0) {
+            if (seqnum == ctx->rcv_nxt && ctx->num_rcv_blocks == 0) {
+                // the common case: in order, nothing buffered
+                stcp_app_send(sd, payload, length);
+                ctx->rcv_nxt += length;
+                ctx->rcv_head = (ctx->rcv_head + length) % RCV_BUFFER_SIZE;
+                ctx->info.stcpi_bytes_received += length;
+                delay = (trim == 0);
+            }
+            else if (StoreOutOfOrder(ctx, seqnum, payload, length)) {
+                ctx->rcv_last_seq = seqnum;
+                DeliverInOrder(sd, ctx);
+            }
+        }
+
+        if (ctx->rcv_fin_pending && ctx->rcv_nxt == ctx->rcv_fin_seq) {
+            delay = false;
+            ctx->rcv_fin_pending = false;
+            ctx->rcv_nxt += 1;
+            // notify upper layer
+            stcp_fin_received(sd);
+            if (ctx->connection_state == CSTATE_ESTABLISHED) {
+                ctx->connection_state = CSTATE_CLOSE_WAIT;
+            }
+            else if (ctx->connection_state == CSTATE_FIN_WAIT1) {
+                ctx->connection_state = CSTATE_CLOSING;
+            }
+            else {
+                // no TIME_WAIT in STCP
+                ctx->connection_state = CSTATE_CLOSED;
+                ctx->done = 1;
+            }
+        }
+    }
+
+    if (delay && ++ctx->delack_segs < DELACK_SEGMENTS) {
+        if (!ctx->delack_pending) {
+            ctx->delack_pending = true;
+            SetDeadline(&ctx->delack_expiry, DELACK_TIMEOUT);
+        }
+        return;
+    }
+
+    // send ACK
+    if (!SendPacket(sd, ctx, ACK, NULL, 0)) {
+        perror("ReceiveData(): Sending ACK of received DATA");
+    }
+}
+
+/**********************************************************************/
+/* StoreOutOfOrder
+ *
+ * Copies [seqnum, seqnum + length) into the reassembly buffer and merges
+ * it into rcv_blocks.  The range must lie within the window.
+ * Returns false if the range would need a new block and none is left.
+ */
+bool
+StoreOutOfOrder(context_t* ctx, tcp_seq seqnum, char* payload, size_t length)
+{
+    tcp_seq start = seqnum, end = seqnum + length;
+    size_t pos, first;
+    int i, j;
+
+    if (!ctx->rcv_buffer) {
+        ctx->rcv_buffer = (char *)malloc(RCV_BUFFER_SIZE);
+        assert(ctx->rcv_buffer);
+    }
+
+    // find the blocks that overlap or touch the new range
+    for (i = 0; i < ctx->num_rcv_blocks && SEQ_LT(ctx->rcv_blocks[i].end, start); ++i)
+        ;
+    for (j = i; j < ctx->num_rcv_blocks && SEQ_LEQ(ctx->rcv_blocks[j].start, end); ++j) {
+        if (SEQ_LT(ctx->rcv_blocks[j].start, start)) start = ctx->rcv_blocks[j].start;
+        if (SEQ_GT(ctx->rcv_blocks[j].end, end))     end = ctx->rcv_blocks[j].end;
+    }
+
+    if (i == j) {
+        // a new hole-separated block
+        if (ctx->num_rcv_blocks == MAX_RCV_BLOCKS) {
+            return false;
+        }
+        memmove(&ctx->rcv_blocks[i + 1], &ctx->rcv_blocks[i],
+                (ctx->num_rcv_blocks - i) * sizeof(rcv_block_t));
+        ctx->num_rcv_blocks++;
+    }
+    else {
+        // blocks i..j-1 collapse into one
+        memmove(&ctx->rcv_blocks[i + 1], &ctx->rcv_blocks[j],
+                (ctx->num_rcv_blocks - j) * sizeof(rcv_block_t));
+        ctx->num_rcv_blocks -= j - i - 1;
+    }
+    ctx->rcv_blocks[i].start = start;
+    ctx->rcv_blocks[i].end = end;
+
+    pos = (ctx->rcv_head + (seqnum - ctx->rcv_nxt)) % RCV_BUFFER_SIZE;
+    first = MIN(length, RCV_BUFFER_SIZE - pos);
+    memcpy(ctx->rcv_buffer + pos, payload, first);
+    memcpy(ctx->rcv_buffer, payload + first, length - first);
     return true;
 }
 
+/**********************************************************************/
+/* DeliverInOrder
+ *
+ * If the first buffered block starts at rcv_nxt, the hole before it has
+ * been filled: passes the whole block up to the application at once.
+ */
+void
+DeliverInOrder(mysocket_t sd, context_t* ctx)
+{
+    size_t length, first;
+
+    if (ctx->num_rcv_blocks == 0 || ctx->rcv_blocks[0].start != ctx->rcv_nxt) {
+        return;
+    }
+
+    length = ctx->rcv_blocks[0].end - ctx->rcv_blocks[0].start;
+    first = MIN(length, RCV_BUFFER_SIZE - ctx->rcv_head);
+    stcp_app_send(sd, ctx->rcv_buffer + ctx->rcv_head, first);
+    if (length > first) {
+        stcp_app_send(sd, ctx->rcv_buffer, length - first);
+    }
+    ctx->rcv_nxt += length;
+    ctx->rcv_head = (ctx->rcv_head + length) % RCV_BUFFER_SIZE;
+    ctx->info.stcpi_bytes_received += length;
+
+    memmove(&ctx->rcv_blocks[0], &ctx->rcv_blocks[1],
+            (ctx->num_rcv_blocks - 1) * sizeof(rcv_block_t));
+    ctx->num_rcv_blocks--;
+}
+
+/**********************************************************************/
+/* ConnectionEstablished
+ *
+ * Starts tracing the connection's events and unblocks the application
+ * once the 3-way handshake is over.
+ */
+void
+ConnectionEstablished(mysocket_t sd, context_t* ctx)
+{
+    stcp_trace_open(sd, ctx->is_active ? "client_log.bin" : "server_log.bin");
+    stcp_unblock_application(sd);
+}
+
+/**********************************************************************/
+/* UpdateWindow
+ *
+ * Recomputes swnd = min(cwnd, rwnd) and how much of it is still unused.
+ */
+void
+UpdateWindow(context_t* ctx)
+{
+    uint32_t in_flight = BytesInFlight(ctx);
+
+    ctx->swnd = (ctx->cwnd < ctx->rcvd_win) ? ctx->cwnd : ctx->rcvd_win;
+    ctx->remainder_window = (ctx->swnd > in_flight) ? ctx->swnd - in_flight : 0;
+}
+
+/**********************************************************************/
+/* ReceiveWindow
+ *
+ * Free space in the receive buffer, i.e. RCV_BUFFER_SIZE less whatever
+ * the application hasn't read yet.
+ */
+uint32_t
+ReceiveWindow(mysocket_t sd, context_t* ctx)
+{
+    size_t queued = stcp_app_send_queued(sd);
+
+    return (queued < RCV_BUFFER_SIZE) ? RCV_BUFFER_SIZE - queued : 0;
+}
+
+/**********************************************************************/
+/* AdvertiseWindow
+ *
+ * Returns the th_win field for an outgoing segment of the given type, and
+ * remembers the right edge it advertises.  To avoid the silly window
+ * syndrome (RFC 1122), the edge only moves once it can move by at least
+ * min(RCV_BUFFER_SIZE / 2, MSS).
+ */
+uint16_t
+AdvertiseWindow(mysocket_t sd, context_t* ctx, PacketType type)
+{
+    uint32_t window = ReceiveWindow(sd, ctx);
+    // windows in SYNs are never scaled
+    unsigned int scale = (type == SYN || type == SYNACK) ? 0 : ctx->rcv_wscale;
+
+    if (type != SYN && type != SYNACK && SEQ_GT(ctx->rcv_adv, ctx->rcv_nxt) &&
+        SEQ_LT(ctx->rcv_nxt + window, ctx->rcv_adv + MIN(RCV_BUFFER_SIZE / 2, ctx->mss))) {
+        window = ctx->rcv_adv - ctx->rcv_nxt;
+    }
+    window = MIN(window >> scale, 65535);
+    if (type != SYN && SEQ_GT(ctx->rcv_nxt + (window << scale), ctx->rcv_adv)) {
+        ctx->rcv_adv = ctx->rcv_nxt + (window << scale);
+    }
+    return window;
+}
+
+/**********************************************************************/
+/* SendWindowUpdate
+ *
+ * Called once the application has read some data: sends a bare ACK if the
+ * window can now move right by at least min(RCV_BUFFER_SIZE / 2, MSS),
+ * which keeps us from advertising silly little windows (RFC 1122).
+ */
+void
+SendWindowUpdate(mysocket_t sd, context_t* ctx)
+{
+    tcp_seq edge = ctx->rcv_nxt + ReceiveWindow(sd, ctx);
+
+    if (SEQ_GT(edge, ctx->rcv_adv) && edge - ctx->rcv_adv >= MIN(RCV_BUFFER_SIZE / 2, ctx->mss)) {
+        if (!SendPacket(sd, ctx, ACK, NULL, 0)) {
+            perror("SendWindowUpdate(): Sending window update");
+        }
+    }
+}
+
+/**********************************************************************/
+/* UpdateRTO
+ *
+ * Feeds an RTT sample (in microseconds) into the Jacobson/Karels
+ * estimator and recomputes the RTO as in RFC 6298.
+ */
+void
+UpdateRTO(context_t* ctx, long sample)
+{
+    long delta;
+
+    if (!ctx->rtt_valid) {
+        ctx->srtt = sample;
+        ctx->rttvar = sample / 2;
+        ctx->rtt_valid = true;
+    }
+    else {
+        delta = (ctx->srtt > sample) ? ctx->srtt - sample : sample - ctx->srtt;
+        ctx->rttvar = (3 * ctx->rttvar + delta) / 4;
+        ctx->srtt = (7 * ctx->srtt + sample) / 8;
+    }
+
+    ctx->rto = ctx->srtt + 4 * ctx->rttvar;
+    if (ctx->rto < RTO_MIN) ctx->rto = RTO_MIN;
+    if (ctx->rto > RTO_MAX) ctx->rto = RTO_MAX;
+}
+
+/**********************************************************************/
+/* StartTimer
+ *
+ * (Re)starts the retransmission timer to expire one RTO from now, doubled
+ * for every consecutive timeout.  As in BSD, the backoff is dropped as
+ * soon as an ACK covers new data, while Karn's rule keeps retransmitted
+ * segments out of the RTT estimate.
+ */
+void
+StartTimer(context_t* ctx)
+{
+    long rto = ctx->rto;
+    unsigned int k;
+
+    for (k = 0; k < ctx->timeouts && rto < RTO_MAX; ++k) {
+        rto *= 2;
+    }
+    if (rto > RTO_MAX) rto = RTO_MAX;
+
+    SetDeadline(&ctx->timer_expiry, rto);
+    ctx->timer_running = true;
+}
+
+/**********************************************************************/
+/* SetDeadline
+ *
+ * Sets deadline to usec microseconds from now, as an absolute
+ * CLOCK_REALTIME time for stcp_wait_for_event().
+ */
+void
+SetDeadline(struct timespec* deadline, long usec)
+{
+    clock_gettime(CLOCK_REALTIME, deadline);
+    deadline->tv_sec += usec / 1000000L;
+    deadline->tv_nsec += (usec % 1000000L) * 1000L;
+    if (deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_sec += 1;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+/**********************************************************************/
+/* HandleTimeout
+ *
+ * The retransmission timer went off: back off the timer, collapse the
+ * congestion window and retransmit the oldest unacknowledged segment.
+ * Gives up on the connection after MAX_RETRANSMITS timeouts in a row.
+ */
+void
+HandleTimeout(mysocket_t sd, context_t* ctx)
+{
+    uint32_t in_flight = ctx->snd_nxt - ctx->snd_una;
+    segment_t *seg;
+
+    if (ctx->rcvd_win == 0 &&
+        (ctx->connection_state == CSTATE_ESTABLISHED || ctx->connection_state == CSTATE_CLOSE_WAIT)) {
+        // persist timer: the peer's window is closed, and it is alive as
+        // long as it ACKs our probes, so keep probing without giving up or
+        // collapsing the congestion window
+        if (ctx->timeouts < MAX_RETRANSMITS) ctx->timeouts++;
+        if (!ctx->unacked_head) {
+            // let the next byte from the app out as a probe
+            ctx->persist = true;
+            ctx->timer_running = false;
+            return;
+        }
+        StartTimer(ctx);
+        TransmitSegment(sd, ctx, ctx->unacked_head);
+        return;
+    }
+
+    if (!ctx->unacked_head) {
+        ctx->timer_running = false;
+        return;
+    }
+
+    if (++ctx->timeouts > MAX_RETRANSMITS) {
+        if (ctx->connection_state == CSTATE_SYN_SENT || ctx->connection_state == CSTATE_SYN_RCVD) {
+            fprintf(stderr, "HandleTimeout(): 3-way handshake timed out.\n");
+            errno = ECONNREFUSED;
+        }
+        else if (ctx->connection_state != CSTATE_LAST_ACK && ctx->connection_state != CSTATE_CLOSING) {
+            fprintf(stderr, "HandleTimeout(): Peer stopped responding.\n");
+            errno = ETIMEDOUT;
+        }
+        // in LAST_ACK/CLOSING the peer most likely closed after its last ACK got lost
+        ctx->connection_state = CSTATE_CLOSED;
+        ctx->done = 1;
+        return;
+    }
+
+    ctx->info.stcpi_timeouts++;
+    Trace(sd, ctx, STCP_TRACE_TIMEOUT, ctx->snd_una, ctx->rcv_nxt, in_flight);
+    ctx->ssthresh = (in_flight / 2 > 2 * ctx->mss) ? in_flight / 2 : 2 * ctx->mss;
+    ctx->cwnd = ctx->mss;
+    ctx->in_recovery = false;
+    ctx->recover = ctx->snd_max;
+    ctx->dupacks = 0;
+    for (seg = ctx->unacked_head; seg; seg = seg->next) {
+        seg->rexmit = false;
+    }
+
+    // go back N: resend the oldest segment now, the rest as ACKs come in
+    ctx->snd_nxt = ctx->unacked_head->seq + SEG_SEQ_LEN(ctx->unacked_head);
+    UpdateWindow(ctx);
+    StartTimer(ctx);
+    if (!TransmitSegment(sd, ctx, ctx->unacked_head) &&
+        (ctx->connection_state == CSTATE_LAST_ACK || ctx->connection_state == CSTATE_CLOSING)) {
+        // the peer has already gone away
+        ctx->connection_state = CSTATE_CLOSED;
+        ctx->done = 1;
+    }
+}
+
+/**********************************************************************/
+/* PublishInfo
+ *
+ * Hands a snapshot of the connection to the mysock layer, where
+ * mygetsockopt(STCP_INFO) can read it at any time.  The running totals are
+ * kept in ctx->info as they change; the rest is filled in here.
+ */
+void
+PublishInfo(mysocket_t sd, context_t* ctx)
+{
+    struct stcp_info *info = &ctx->info;
+    long rto = ctx->rto;
+    unsigned int k;
+
+    switch (ctx->connection_state)
+    {
+        case CSTATE_ESTABLISHED: info->stcpi_state = STCP_ESTABLISHED; break;
+        case CSTATE_LISTEN:      info->stcpi_state = STCP_LISTEN;      break;
+        case CSTATE_SYN_SENT:    info->stcpi_state = STCP_SYN_SENT;    break;
+        case CSTATE_SYN_RCVD:    info->stcpi_state = STCP_SYN_RECV;    break;
+        case CSTATE_FIN_WAIT1:   info->stcpi_state = STCP_FIN_WAIT1;   break;
+        case CSTATE_FIN_WAIT2:   info->stcpi_state = STCP_FIN_WAIT2;   break;
+        case CSTATE_CLOSING:     info->stcpi_state = STCP_CLOSING;     break;
+        case CSTATE_CLOSE_WAIT:  info->stcpi_state = STCP_CLOSE_WAIT;  break;
+        case CSTATE_LAST_ACK:    info->stcpi_state = STCP_LAST_ACK;    break;
+        default:                 info->stcpi_state = STCP_CLOSE;       break;
+    }
+    if (ctx->done) {
+        info->stcpi_state = STCP_CLOSE;
+    }
+
+    // the timeout StartTimer() would use now
+    for (k = 0; k < ctx->timeouts && rto < RTO_MAX; ++k) {
+        rto *= 2;
+    }
+
+    info->stcpi_mss = ctx->mss;
+    info->stcpi_sack = ctx->sack_permitted;
+    info->stcpi_cwnd = ctx->cwnd;
+    info->stcpi_ssthresh = ctx->ssthresh;
+    info->stcpi_srtt = ctx->rtt_valid ? ctx->srtt : 0;
+    info->stcpi_rttvar = ctx->rtt_valid ? ctx->rttvar : 0;
+    info->stcpi_rto = MIN(rto, RTO_MAX);
+    info->stcpi_backoff = ctx->timeouts;
+    info->stcpi_unacked = ctx->snd_max - ctx->snd_una;
+    info->stcpi_in_flight = BytesInFlight(ctx);
+    info->stcpi_sacked = ctx->sacked_bytes;
+    info->stcpi_dupacks = ctx->dupacks;
+    info->stcpi_snd_wnd = ctx->rcvd_win;
+    info->stcpi_rcv_wnd = SEQ_GT(ctx->rcv_adv, ctx->rcv_nxt) ? ctx->rcv_adv - ctx->rcv_nxt : 0;
+    info->stcpi_in_recovery = ctx->in_recovery;
+
+    stcp_set_info(sd, info);
+}
+
+/**********************************************************************/
+/* Trace
+ *
+ * Records an event in the connection's trace (see stcp_trace_open()),
+ * along with the windows at the time.  stcp_trace2txt turns the SEND and
+ * ACKED events back into the Send/Recv lines logic checks.
+ */
+void
+Trace(mysocket_t sd, context_t* ctx, stcp_trace_type_t type, tcp_seq seq, tcp_seq ack, size_t len)
+{
+    stcp_trace(sd, type, seq, ack, len, ctx->cwnd, ctx->swnd, ctx->remainder_window);
+}
+
 /**********************************************************************/
 /* PrintPacket
  *
@@ -678,5 +1866,5 @@ void PrintPacket(STCPHeader *packet, bool isSend)
     if (packet->th_flags & TH_SYN) fprintf(stdout, "SYN ");
     if (packet->th_flags & TH_ACK) fprintf(stdout, "ACK ");
     fprintf(stdout, "\n");
-    fprintf(stdout, "-------------------------------------------------\n"); 
+    fprintf(stdout, "-------------------------------------------------\n");
 }
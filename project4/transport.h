@@ -73,7 +73,9 @@ typedef struct tcphdr
 /* length of options (in bytes) in TCP packet p */
 #define TCP_OPTIONS_LEN(p) (TCP_DATA_START(p) - sizeof(struct tcphdr))
 
-/* STCP maximum segment size */
+/* STCP maximum segment size, unless both ends agree on a larger one with
+ * the MSS option (see stcp_network_mtu())
+ */
 #define STCP_MSS 536
 
 
@@ -118,4 +120,14 @@ typedef struct tcphdr
 
 extern void transport_init(mysocket_t sd, bool_t is_active);
 
+/* transport_init(), broken up for an event loop that drives many
+ * connections (see transport.c)
+ */
+struct timespec;
+extern void transport_open(mysocket_t sd, bool_t is_active);
+extern unsigned int transport_wants(mysocket_t sd,
+                                    const struct timespec **deadline);
+extern void transport_handle(mysocket_t sd, unsigned int event);
+extern void transport_close(mysocket_t sd);
+
 #endif  /* __TRANSPORT_H__ */
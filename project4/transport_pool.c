@@ -0,0 +1,639 @@
+/* transport_pool.c--runs STCP for many connections on a fixed pool of
+ * transport worker threads, rather than on two threads per connection.
+ *
+ * there is one worker per CPU.  each connection is owned by the worker its
+ * mysocket descriptor hashes to; the owner waits for the connection's
+ * network input in its epoll set, reads it (_network_recv_ready()), and
+ * keeps its STCP timer.  whenever something happens that STCP may have to
+ * act on--network input, data or a close request from the app, a timer
+ * going off--the connection is "kicked" onto its owner's run queue, where
+ * a worker runs the transport layer (transport_wants()/transport_handle())
+ * until it has nothing more to do.  a worker whose run queue is empty takes
+ * connections from other workers' run queues, so a worker with a few busy
+ * connections doesn't hold up the rest of its run queue.
+ *
+ * a connection is run by one worker at a time.  task_state tracks this:
+ * IDLE -> QUEUED (kicked) -> RUNNING -> IDLE, or RUNNING -> KICKED (kicked
+ * while running, so it's run again) -> RUNNING.  once STCP is done with a
+ * connection, its owner removes it (DEAD) and lets myclose() go on.
+ *
+ * nothing here walks all of a worker's connections: timers are kept in a
+ * heap ordered by deadline, and finished connections on a list of their
+ * own, so the cost per event stays the same however many there are.
+ *
+ * nor does a worker block on any one connection's socket:  the network
+ * layer sends with NETWORK_SEND_FLAGS (MSG_DONTWAIT), and a packet that
+ * finds the socket buffer full is lost, as it might be in the network, so
+ * a peer that stops reading stalls only its own connection (see
+ * network_io_tcp.c for what happens to a packet that partly fits).
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include "mysock_impl.h"
+#include "network_io.h"
+#include "transport.h"
+
+#ifdef TRANSPORT_POOL
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+
+#define MAX_TRANSPORT_WORKERS 64
+#define WORKER_MAX_EVENTS     64    /* epoll events handled at once */
+#define WORKER_MAX_RUNS       64    /* connections run between epoll calls */
+
+enum { TASK_IDLE, TASK_QUEUED, TASK_RUNNING, TASK_KICKED, TASK_DEAD };
+
+typedef struct transport_worker
+{
+    pthread_t         thread;
+    int               epoll_fd;
+    int               wake_fd;      /* eventfd; interrupts epoll_wait() */
+    bool_t            sleeping;     /* in (or about to enter) epoll_wait() */
+    bool_t            sweep;        /* an owned connection has finished */
+
+    pthread_mutex_t   lock;         /* protects everything below */
+    mysock_context_t *runq_head;    /* connections waiting to be run */
+    mysock_context_t *runq_tail;
+    mysock_context_t *finished;     /* owned connections STCP is done with */
+
+    /* binary min-heap of owned connections with a timer set, by deadline */
+    mysock_context_t **timers;
+    unsigned int      num_timers;
+    unsigned int      max_timers;
+} transport_worker_t;
+
+
+static transport_worker_t workers[MAX_TRANSPORT_WORKERS];
+static unsigned int num_workers;
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+/* the connection this thread is running, if any; its own wakeups needn't
+ * kick it, as _pool_step() keeps going until there are no more events.
+ */
+static __thread mysock_context_t *running_ctx;
+
+
+static void _pool_start(void);
+static void *_pool_worker_func(void *arg);
+
+
+static int64_t _pool_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void _pool_wake(transport_worker_t *w)
+{
+    uint64_t one = 1;
+
+    if (write(w->wake_fd, &one, sizeof(one)) < 0)
+        assert(errno == EAGAIN);
+}
+
+/* wake w if it's waiting in epoll_wait() */
+static void _pool_wake_if_sleeping(transport_worker_t *w)
+{
+    if (__atomic_load_n(&w->sleeping, __ATOMIC_SEQ_CST))
+        _pool_wake(w);
+}
+
+/* append ctx to w's run queue.  if w is busy and ctx has to wait behind
+ * other connections, an idle worker is woken to take some of them.
+ */
+static void _pool_push(transport_worker_t *w, mysock_context_t *ctx)
+{
+    bool_t was_empty;
+    unsigned int k;
+
+    PTHREAD_CALL(pthread_mutex_lock(&w->lock));
+    ctx->runq_next = NULL;
+    was_empty = (w->runq_head == NULL);
+    if (w->runq_tail)
+        w->runq_tail->runq_next = ctx;
+    else
+        w->runq_head = ctx;
+    w->runq_tail = ctx;
+    PTHREAD_CALL(pthread_mutex_unlock(&w->lock));
+
+    if (__atomic_load_n(&w->sleeping, __ATOMIC_SEQ_CST))
+    {
+        _pool_wake(w);
+    }
+    else if (!was_empty)
+    {
+        for (k = 0; k < num_workers; ++k)
+        {
+            if (&workers[k] != w &&
+                __atomic_load_n(&workers[k].sleeping, __ATOMIC_SEQ_CST))
+            {
+                _pool_wake(&workers[k]);
+                break;
+            }
+        }
+    }
+}
+
+static mysock_context_t *_pool_pop(transport_worker_t *w)
+{
+    mysock_context_t *ctx;
+
+    PTHREAD_CALL(pthread_mutex_lock(&w->lock));
+    if ((ctx = w->runq_head))
+    {
+        w->runq_head = ctx->runq_next;
+        if (!w->runq_head)
+            w->runq_tail = NULL;
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&w->lock));
+    return ctx;
+}
+
+/* take a connection from the first other worker that has one waiting */
+static mysock_context_t *_pool_steal(transport_worker_t *thief)
+{
+    mysock_context_t *ctx = NULL;
+    unsigned int k, start = (unsigned int) (thief - workers);
+
+    for (k = 1; k < num_workers && !ctx; ++k)
+        ctx = _pool_pop(&workers[(start + k) % num_workers]);
+    return ctx;
+}
+
+/* timer heap helpers; the owner's lock must be held.  ctx->task_timer is
+ * 1 + ctx's index in w->timers, or 0 if it has no timer set.
+ */
+static void _pool_timer_place(transport_worker_t *w, unsigned int k,
+                              mysock_context_t *ctx)
+{
+    w->timers[k] = ctx;
+    ctx->task_timer = k + 1;
+}
+
+static void _pool_timer_fix(transport_worker_t *w, unsigned int k)
+{
+    mysock_context_t *ctx = w->timers[k];
+    unsigned int child;
+
+    /* sift up... */
+    while (k > 0 && w->timers[(k - 1) / 2]->task_deadline > ctx->task_deadline)
+    {
+        _pool_timer_place(w, k, w->timers[(k - 1) / 2]);
+        k = (k - 1) / 2;
+    }
+
+    /* ...or down */
+    while ((child = 2 * k + 1) < w->num_timers)
+    {
+        if (child + 1 < w->num_timers &&
+            w->timers[child + 1]->task_deadline < w->timers[child]->task_deadline)
+            ++child;
+        if (w->timers[child]->task_deadline >= ctx->task_deadline)
+            break;
+        _pool_timer_place(w, k, w->timers[child]);
+        k = child;
+    }
+
+    _pool_timer_place(w, k, ctx);
+}
+
+static void _pool_timer_remove(transport_worker_t *w, mysock_context_t *ctx)
+{
+    unsigned int k = ctx->task_timer - 1;
+
+    assert(ctx->task_timer && w->timers[k] == ctx);
+    ctx->task_timer = 0;
+    ctx->task_deadline = 0;
+    if (k != --w->num_timers)
+    {
+        w->timers[k] = w->timers[w->num_timers];
+        _pool_timer_fix(w, k);
+    }
+}
+
+/* set (or, if expiry is 0, clear) ctx's timer.  the owner is woken if the
+ * timer is now the first to go off, as it may be asleep with a later
+ * timeout.
+ */
+static void _pool_set_timer(mysock_context_t *ctx, int64_t expiry)
+{
+    transport_worker_t *w = ctx->worker;
+    bool_t first = FALSE;
+    mysock_context_t **timers;
+    unsigned int max_timers;
+
+    PTHREAD_CALL(pthread_mutex_lock(&w->lock));
+    if (!expiry)
+    {
+        if (ctx->task_timer)
+            _pool_timer_remove(w, ctx);
+    }
+    else if (expiry != ctx->task_deadline || !ctx->task_timer)
+    {
+        if (!ctx->task_timer)
+        {
+            if (w->num_timers == w->max_timers)
+            {
+                max_timers = w->max_timers ? 2 * w->max_timers : 64;
+                timers = (mysock_context_t **)
+                    realloc(w->timers, max_timers * sizeof(*timers));
+                assert(timers);
+                w->timers = timers;
+                w->max_timers = max_timers;
+            }
+            _pool_timer_place(w, w->num_timers++, ctx);
+        }
+
+        ctx->task_deadline = expiry;
+        _pool_timer_fix(w, ctx->task_timer - 1);
+        first = (w->timers[0] == ctx);
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&w->lock));
+
+    if (first)
+        _pool_wake_if_sleeping(w);
+}
+
+/* run STCP on ctx until it has no more events to handle.  returns TRUE if
+ * STCP is done with the connection.
+ */
+static bool_t _pool_step(mysock_context_t *ctx)
+{
+    const struct timespec *deadline;
+    unsigned int flags, event;
+    int64_t expiry, release_at;
+
+    for (;;)
+    {
+        if (!(flags = transport_wants(ctx->my_sd, &deadline)))
+        {
+            transport_close(ctx->my_sd);
+            _mysock_transport_finished(ctx);
+            return TRUE;
+        }
+
+        expiry = deadline ? (int64_t) deadline->tv_sec * 1000000000 +
+                            deadline->tv_nsec : 0;
+        event = _mysock_transport_events(ctx, flags, &release_at);
+        if (!event && (!expiry || expiry > _pool_now()))
+        {
+            /* wake up early to send emulated packets (STCP_NETEM) that
+             * will be due by then; STCP is only told of its own timeout
+             */
+            if (release_at && (!expiry || release_at < expiry))
+                expiry = release_at;
+            _pool_set_timer(ctx, expiry);
+            return FALSE;
+        }
+
+        /* STCP reports why a connection failed in errno */
+        errno = 0;
+        transport_handle(ctx->my_sd, event);
+    }
+}
+
+/* run a connection taken off a run queue */
+static void _pool_run(mysock_context_t *ctx)
+{
+    transport_worker_t *owner = ctx->worker;
+    int state;
+    bool_t finished, already_finished;
+
+    already_finished = __atomic_load_n(&ctx->task_finished, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&ctx->task_state, TASK_RUNNING, __ATOMIC_SEQ_CST);
+    running_ctx = ctx;
+    for (;;)
+    {
+        finished = __atomic_load_n(&ctx->task_finished, __ATOMIC_SEQ_CST);
+        if (!finished)
+        {
+            errno = 0;
+            finished = _pool_step(ctx);
+            __atomic_store_n(&ctx->task_finished, finished,
+                             __ATOMIC_SEQ_CST);
+        }
+
+        /* run it again if it was kicked in the meantime */
+        state = TASK_RUNNING;
+        if (__atomic_compare_exchange_n(&ctx->task_state, &state, TASK_IDLE,
+                                        FALSE, __ATOMIC_SEQ_CST,
+                                        __ATOMIC_SEQ_CST))
+            break;
+        assert(state == TASK_KICKED);
+        __atomic_store_n(&ctx->task_state, TASK_RUNNING, __ATOMIC_SEQ_CST);
+    }
+    running_ctx = NULL;
+
+    /* the owner may free ctx (via myclose()) as soon as it sees this.
+     * task_finished is only ever set once, so ctx goes on the list once.
+     */
+    if (finished && !already_finished)
+    {
+        PTHREAD_CALL(pthread_mutex_lock(&owner->lock));
+        ctx->task_next = owner->finished;
+        owner->finished = ctx;
+        PTHREAD_CALL(pthread_mutex_unlock(&owner->lock));
+
+        __atomic_store_n(&owner->sweep, TRUE, __ATOMIC_SEQ_CST);
+        _pool_wake_if_sleeping(owner);
+    }
+}
+
+/* kick every owned connection whose timer has gone off.  returns the
+ * epoll_wait() timeout (in ms) until the next one will.
+ */
+static int _pool_expire_timers(transport_worker_t *w)
+{
+    mysock_context_t *expired[WORKER_MAX_RUNS];
+    int64_t now = _pool_now(), next = 0;
+    int n = 0, k;
+
+    PTHREAD_CALL(pthread_mutex_lock(&w->lock));
+    /* kicked below, once the lock is released; any more are left for the
+     * next call
+     */
+    while (w->num_timers > 0 && w->timers[0]->task_deadline <= now &&
+           n < WORKER_MAX_RUNS)
+    {
+        expired[n++] = w->timers[0];
+        _pool_timer_remove(w, w->timers[0]);
+    }
+    if (w->num_timers > 0)
+        next = w->timers[0]->task_deadline;
+    PTHREAD_CALL(pthread_mutex_unlock(&w->lock));
+
+    for (k = 0; k < n; ++k)
+        _mysock_pool_kick(expired[k]);
+
+    if (!next)
+        return -1;
+    if (next <= now)
+        return 0;
+    /* round up, so we don't wake just before the deadline */
+    return (int) ((next - now + 999999) / 1000000);
+}
+
+/* remove finished connections that no worker is running any more, and let
+ * myclose() free them
+ */
+static void _pool_sweep(transport_worker_t *w)
+{
+    mysock_context_t **pp, *ctx, *released = NULL;
+    int state;
+
+    __atomic_store_n(&w->sweep, FALSE, __ATOMIC_SEQ_CST);
+
+    PTHREAD_CALL(pthread_mutex_lock(&w->lock));
+    for (pp = &w->finished; (ctx = *pp); )
+    {
+        state = TASK_IDLE;
+        if (__atomic_compare_exchange_n(&ctx->task_state, &state,
+                                        TASK_DEAD, FALSE,
+                                        __ATOMIC_SEQ_CST,
+                                        __ATOMIC_SEQ_CST))
+        {
+            *pp = ctx->task_next;
+            if (ctx->task_timer)
+                _pool_timer_remove(w, ctx);
+            (void) epoll_ctl(w->epoll_fd, EPOLL_CTL_DEL,
+                             _network_get_fd(&ctx->network_state), NULL);
+            ctx->task_next = released;
+            released = ctx;
+        }
+        else
+        {
+            /* queued or running after all; look again later */
+            __atomic_store_n(&w->sweep, TRUE, __ATOMIC_SEQ_CST);
+            pp = &ctx->task_next;
+        }
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&w->lock));
+
+    /* once blocking_lock is dropped, myclose() may free ctx:  broadcast
+     * while still holding it, and don't touch ctx after the unlock
+     */
+    while ((ctx = released))
+    {
+        released = ctx->task_next;
+        PTHREAD_CALL(pthread_mutex_lock(&ctx->blocking_lock));
+        ctx->task_released = TRUE;
+        PTHREAD_CALL(pthread_cond_broadcast(&ctx->blocking_cond));
+        PTHREAD_CALL(pthread_mutex_unlock(&ctx->blocking_lock));
+    }
+}
+
+static bool_t _pool_has_work(transport_worker_t *w)
+{
+    bool_t rc;
+
+    PTHREAD_CALL(pthread_mutex_lock(&w->lock));
+    rc = (w->runq_head != NULL);
+    PTHREAD_CALL(pthread_mutex_unlock(&w->lock));
+    return rc || __atomic_load_n(&w->sweep, __ATOMIC_SEQ_CST);
+}
+
+static void *_pool_worker_func(void *arg)
+{
+    transport_worker_t *w = (transport_worker_t *) arg;
+    struct epoll_event events[WORKER_MAX_EVENTS];
+    mysock_context_t *ctx;
+    uint64_t count;
+    int n, k, timeout;
+    bool_t busy = FALSE;
+
+    for (;;)
+    {
+        timeout = _pool_expire_timers(w);
+
+        /* _pool_push() wakes us if it sees 'sleeping' set after we've
+         * found the run queue empty
+         */
+        __atomic_store_n(&w->sleeping, TRUE, __ATOMIC_SEQ_CST);
+        if (busy || _pool_has_work(w))
+            timeout = 0;
+
+        n = epoll_wait(w->epoll_fd, events, WORKER_MAX_EVENTS, timeout);
+        __atomic_store_n(&w->sleeping, FALSE, __ATOMIC_SEQ_CST);
+        if (n < 0)
+        {
+            assert(errno == EINTR);
+            n = 0;
+        }
+
+        for (k = 0; k < n; ++k)
+        {
+            if (!(ctx = (mysock_context_t *) events[k].data.ptr))
+            {
+                if (read(w->wake_fd, &count, sizeof(count)) < 0)
+                    assert(errno == EAGAIN);
+                continue;
+            }
+
+            /* queue whatever arrived; this kicks the connection.  once the
+             * peer has gone, STCP is left to time out as usual.
+             */
+            if (_network_recv_ready(ctx) < 0)
+            {
+                (void) epoll_ctl(w->epoll_fd, EPOLL_CTL_DEL,
+                                 _network_get_fd(&ctx->network_state), NULL);
+            }
+        }
+
+        for (k = 0; k < WORKER_MAX_RUNS && (ctx = _pool_pop(w)); ++k)
+            _pool_run(ctx);
+
+        /* help out another worker if we have nothing left to do */
+        busy = (k == WORKER_MAX_RUNS);
+        if (!busy && (ctx = _pool_steal(w)))
+        {
+            _pool_run(ctx);
+            busy = TRUE;
+        }
+
+        if (__atomic_load_n(&w->sweep, __ATOMIC_SEQ_CST))
+            _pool_sweep(w);
+    }
+
+    return NULL;
+}
+
+static void _pool_start(void)
+{
+    struct epoll_event ev;
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int k;
+
+    num_workers = (ncpus < 1) ? 1 : (unsigned int) ncpus;
+    if (num_workers > MAX_TRANSPORT_WORKERS)
+        num_workers = MAX_TRANSPORT_WORKERS;
+
+    for (k = 0; k < num_workers; ++k)
+    {
+        transport_worker_t *w = &workers[k];
+
+        PTHREAD_CALL(pthread_mutex_init(&w->lock, NULL));
+        if ((w->epoll_fd = epoll_create1(0)) < 0 ||
+            (w->wake_fd = eventfd(0, EFD_NONBLOCK)) < 0)
+        {
+            perror("transport worker pool");
+            abort();
+        }
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events   = EPOLLIN;
+        ev.data.ptr = NULL;
+        if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->wake_fd, &ev) < 0)
+        {
+            perror("epoll_ctl (transport worker pool)");
+            abort();
+        }
+
+        w->thread = _mysock_create_thread(_pool_worker_func, w, TRUE);
+    }
+}
+
+
+/* start running STCP for a new connection; called by
+ * _mysock_transport_init() in place of starting its threads
+ */
+void _mysock_pool_add(mysock_context_t *ctx)
+{
+    transport_worker_t *w;
+    struct epoll_event ev;
+
+    assert(ctx && !ctx->listening);
+    PTHREAD_CALL(pthread_once(&pool_once, _pool_start));
+
+    /* Fibonacci hashing, so consecutive descriptors spread out */
+    w = &workers[((uint32_t) ctx->my_sd * 2654435769u) % num_workers];
+
+    /* the active side sends its SYN from here, in the application's
+     * thread, so the network socket is connected before it's watched
+     */
+    transport_open(ctx->my_sd, ctx->is_active);
+
+    ctx->task_state    = TASK_IDLE;
+    ctx->task_deadline = 0;
+    ctx->task_timer    = 0;
+    __atomic_store_n(&ctx->worker, w, __ATOMIC_SEQ_CST);
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events   = EPOLLIN;
+    ev.data.ptr = ctx;
+    if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD,
+                  _network_get_fd(&ctx->network_state), &ev) < 0)
+    {
+        /* STCP will time out without any network input */
+        perror("epoll_ctl (transport worker pool)");
+    }
+
+    /* handle anything that's already queued, e.g. a passive socket's SYN */
+    _mysock_pool_kick(ctx);
+}
+
+/* let STCP know something happened on ctx */
+void _mysock_pool_kick(mysock_context_t *ctx)
+{
+    transport_worker_t *w = __atomic_load_n(&ctx->worker, __ATOMIC_SEQ_CST);
+    int state;
+
+    if (!w || ctx == running_ctx)
+        return;
+
+    state = __atomic_load_n(&ctx->task_state, __ATOMIC_SEQ_CST);
+    for (;;)
+    {
+        switch (state)
+        {
+        case TASK_IDLE:
+            if (__atomic_compare_exchange_n(&ctx->task_state, &state,
+                                            TASK_QUEUED, FALSE,
+                                            __ATOMIC_SEQ_CST,
+                                            __ATOMIC_SEQ_CST))
+            {
+                _pool_push(w, ctx);
+                return;
+            }
+            break;
+
+        case TASK_RUNNING:
+            if (__atomic_compare_exchange_n(&ctx->task_state, &state,
+                                            TASK_KICKED, FALSE,
+                                            __ATOMIC_SEQ_CST,
+                                            __ATOMIC_SEQ_CST))
+                return;
+            break;
+
+        default:    /* already queued/kicked, or gone */
+            return;
+        }
+    }
+}
+
+/* block until the worker pool is done with ctx; called by myclose() */
+void _mysock_pool_wait(mysock_context_t *ctx)
+{
+    assert(ctx);
+    if (!ctx->worker)
+        return;
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->blocking_lock));
+    while (!ctx->task_released)
+    {
+        PTHREAD_CALL(pthread_cond_wait(&ctx->blocking_cond,
+                                       &ctx->blocking_lock));
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->blocking_lock));
+}
+
+#endif  /*TRANSPORT_POOL*/